@@ -28,16 +28,19 @@
 #include <interfaces.h>
 
 static int nremcliadd(int argc, char **argv);
+static int nremcliimport(int argc, char **argv);
 static int nremclisearch(int argc, char **argv);
+static int nremclicount(int argc, char **argv);
 static int nremcliremove(int argc, char **argv);
 static int nremclidefrag(int argc, char **argv);
+static int nremclireindex(int argc, char **argv);
 
 static int printpart(struct event *ev, char *part);
 
 int nremcli(int argc, char **argv) {
 	if (argc < 2) {
 		fprintf(stderr,
-"Usage: %s [add/search/remove/defrag] [options]\n",
+"Usage: %s [add/import/search/count/remove/defrag/reindex] [options]\n",
 				argv[0]);
 		return 1;
 	}
@@ -45,15 +48,24 @@ int nremcli(int argc, char **argv) {
 	if (strcmp(argv[1], "add") == 0) {
 		return nremcliadd(argc-1, argv+1);
 	}
+	if (strcmp(argv[1], "import") == 0) {
+		return nremcliimport(argc-1, argv+1);
+	}
 	if (strcmp(argv[1], "search") == 0) {
 		return nremclisearch(argc-1, argv+1);
 	}
+	if (strcmp(argv[1], "count") == 0) {
+		return nremclicount(argc-1, argv+1);
+	}
 	if (strcmp(argv[1], "remove") == 0) {
 		return nremcliremove(argc-1, argv+1);
 	}
 	if (strcmp(argv[1], "defrag") == 0) {
 		return nremclidefrag(argc-1, argv+1);
 	}
+	if (strcmp(argv[1], "reindex") == 0) {
+		return nremclireindex(argc-1, argv+1);
+	}
 	fprintf(stderr, "Invalid command %s\n", argv[1]);
 	return 1;
 }
@@ -82,9 +94,79 @@ static int nremcliadd(int argc, char **argv) {
 	return 0;
 }
 
+/* Reads events from stdin, one per line, as tab separated
+ * [event name] [start] (end) and adds them all at once */
+static int nremcliimport(int argc, char **argv) {
+	struct event *events;
+	size_t len, alloc;
+	char *line;
+	size_t linealloc;
+	ssize_t linelen;
+	int ret;
+
+	ret = 1;
+	len = 0;
+	alloc = 64;
+	line = NULL;
+	linealloc = 0;
+	if ((events = malloc(alloc * sizeof *events)) == NULL) {
+		goto end;
+	}
+
+	while ((linelen = getline(&line, &linealloc, stdin)) >= 0) {
+		char *start, *end;
+		if (linelen > 0 && line[linelen-1] == '\n') {
+			line[linelen-1] = '\0';
+		}
+		if (line[0] == '\0') {
+			continue;
+		}
+		if ((start = strchr(line, '\t')) == NULL) {
+			fprintf(stderr, "Invalid line %zu\n", len + 1);
+			goto end;
+		}
+		*start++ = '\0';
+		if ((end = strchr(start, '\t')) != NULL) {
+			*end++ = '\0';
+		}
+
+		if (len >= alloc) {
+			struct event *newevents;
+			alloc *= 2;
+			newevents = realloc(events, alloc * sizeof *newevents);
+			if (newevents == NULL) {
+				goto end;
+			}
+			events = newevents;
+		}
+		if ((events[len].name = strdup(line)) == NULL) {
+			goto end;
+		}
+		events[len].start = parsetime(start);
+		events[len].end = end == NULL ?
+			events[len].start : parsetime(end);
+		++len;
+	}
+
+	if (dateaddbatch(events, len, &f)) {
+		fputs("Failed to import events\n", stderr);
+		goto end;
+	}
+	ret = 0;
+end:
+	for (size_t i = 0; i < len; ++i) {
+		free(events[i].name);
+	}
+	free(events);
+	free(line);
+	return ret;
+}
+
 static int nremclisearch(int argc, char **argv) {
 	char *format = "DATE,TIME12,NAME";
-	struct eventlist *list;
+	struct datesearch *search;
+	struct event event;
+	int status;
 	if (argc < 3) {
 		fprintf(stderr, "Usage: %s [start] [end] (format)\n",
 				argv[0]);
@@ -94,13 +176,15 @@ static int nremclisearch(int argc, char **argv) {
 		format = argv[3];
 	}
 
-	list = datesearch(&f, parsetime(argv[1]), parsetime(argv[2]));
-	if (list == NULL) {
+	/* Events are printed as they're found, so a huge search never has to
+	 * fit in memory unless it's split between threads */
+	search = datesearchopen(&f, parsetime(argv[1]), parsetime(argv[2]));
+	if (search == NULL) {
 		fputs("Search failed\n", stderr);
 		return 1;
 	}
 	/* This code is awful, do not copy it */
-	for (int i = 0; i < list->len; ++i) {
+	while ((status = datesearchnext(search, &event)) == 1) {
 		char part[50];
 		int partlen;
 		int pcount;
@@ -109,6 +193,7 @@ static int nremclisearch(int argc, char **argv) {
 			if (partlen >= sizeof part) {
 				fputs("Oversized format component detected, "
 						"quitting\n", stderr);
+				datesearchclose(search);
 				return 1;
 			}
 
@@ -120,7 +205,8 @@ static int nremclisearch(int argc, char **argv) {
 				if (pcount != 0) {
 					putchar('\t');
 				}
-				if (printpart(list->events + i, part)) {
+				if (printpart(&event, part)) {
+					datesearchclose(search);
 					return 1;
 				}
 
@@ -135,6 +221,25 @@ static int nremclisearch(int argc, char **argv) {
 			}
 		}
 	}
+	datesearchclose(search);
+	if (status == -1) {
+		fputs("Search failed\n", stderr);
+		return 1;
+	}
+	return 0;
+}
+
+static int nremclicount(int argc, char **argv) {
+	uint64_t count;
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s [start] [end]\n", argv[0]);
+		return 1;
+	}
+	if (datecount(&f, parsetime(argv[1]), parsetime(argv[2]), &count)) {
+		fputs("Count failed\n", stderr);
+		return 1;
+	}
+	printf("%llu\n", (unsigned long long) count);
 	return 0;
 }
 
@@ -143,7 +248,10 @@ static int nremcliremove(int argc, char **argv) {
 		fprintf(stderr, "Usage: %s [event id]\n", argv[0]);
 		return 1;
 	}
-	dateremove(&f, strtoull(argv[1], NULL, 10));
+	if (dateremove(&f, strtoull(argv[1], NULL, 10))) {
+		fputs("Failed to remove event\n", stderr);
+		return 1;
+	}
 	return 0;
 }
 
@@ -151,6 +259,10 @@ static int nremclidefrag(int argc, char **argv) {
 	return datedefrag(&f);
 }
 
+static int nremclireindex(int argc, char **argv) {
+	return datereindex(&f);
+}
+
 static int printpart(struct event *ev, char *part) {
 	time_t t = (time_t) ev->start;
 	struct tm *tm = localtime(&t);
@@ -21,18 +21,30 @@
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-function"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <dates.h>
+#include <wal.h>
+#include <lock.h>
+#include <pool.h>
 #include <tests.h>
 
 /* datefile format
  * NOTE: all integer values are stored in big endian (most significant byte
- *   first)
+ *   first) in version 0 files, and little endian in version 4 files, see
+ *   below
  *
  * datefile is a file format that associates dates with text events. The format
  * is designed so that adding events at random timestamps can be done in O(1)
@@ -45,7 +57,10 @@
  *         char magic_number[8];        Always "datefile"
  *         uint64_t bit1;               Location of the root node
  *         uint8_t bitn;                Bits per timestamp
- *         char reserved[16];           Ignored for now, MUST be all 0s
+ *         uint8_t version;             The format version, see below
+ *         uint64_t meta;               Location of the metadata, or 0 if
+ *                                      there isn't any yet
+ *         char reserved[7];            Ignored for now, MUST be all 0s
  *     };
  *
  * datefiles contain a binary tree with a max depth of `bitn`. Events are placed
@@ -93,15 +108,79 @@
  *         uint64_t child0;
  *         uint64_t child1;
  *         uint64_t event;
- *         char reserved[16];
+ *         uint64_t key;                The bits skipped by this node
+ *         uint8_t skip;                The number of bits skipped
+ *         uint8_t flags;               See "Allocation" below
+ *         char reserved[6];
+ *     };
+ *
+ * Version 0 datefiles have a node for every bit of every prefix, and skip and
+ * key are always 0. They're still read and written uncompressed, and
+ * datedefrag converts them to version 4, the only other version. Versions 1 to
+ * 3 never made it into a release and aren't read.
+ *
+ * Since most of the nodes of a version 0 file only have one child, version 4
+ * files are path compressed (a PATRICIA tree), and a search also goes through
+ * a dependent read for every 4 bits instead of every bit. Their nodes are
+ * 16-ary, and they have event counts so that datecount doesn't have to read
+ * any events:
+ *
+ *     struct {
+ *         uint64_t key;                The bits skipped by this node
+ *         uint64_t map;                The slots the node has, see below
+ *         uint8_t skip;                The number of bits skipped, always a
+ *                                      multiple of 4
+ *         uint8_t flags;
+ *         uint8_t size;                The number of slots there's room for
+ *         char reserved[5];
+ *         uint64_t slots[];
  *     };
  *
+ * Each node has 16 children child[16], 15 event lists event[15], and 32
+ * counts starts[16] and ends[16], but most of those are 0 in most nodes, so
+ * only the ones in `map` take up a slot. Bit i of `map` is child[i], bit 16+i
+ * is event[i], bit 32+i is starts[i], and bit 48+i is ends[i] (bit 31 is never
+ * set), and the slots are in the order of their bits. A slot in the map can
+ * still be 0. A node that runs out of room for slots moves somewhere with more
+ * room, except for the root, which always has room for all 63 of them.
+ *
+ * A node that's reached from a parent at depth d is at depth d+4+skip, and
+ * `key` holds the `skip` bits between the two (right aligned). Following the
+ * first example above, a single event at 0b01001011 is just a node with skip=4,
+ * key=0b1011 under child[0b0100] of the root. Nodes are split when a new prefix
+ * diverges partway through a skip.
+ *
+ * child[i] is the child whose next 4 bits are i. Prefixes don't have to line up
+ * with nodes though, so a node at depth d has a list of events for every prefix
+ * with a precision from d to d+3 under it. The list for the prefix whose next
+ * k bits are j is event[2^k - 1 + j]. In the second example above, 0b001/3 and
+ * 0b01/2 both go in the root node, in event[8] and event[4].
+ *
+ * An event is in the lists of all the prefixes that cover it. The first of
+ * those starts where the event starts, and the last one ends where it ends.
+ * starts[j] counts the events whose first prefix is in this node or under
+ * child[j], and whose start has j as its next 4 bits after the node (the ones
+ * at the bottom of the tree have no next bits and use starts[0]). ends[j] does
+ * the same for last prefixes and ends. Following one time stamp down from the
+ * root then counts the events that start after it or end before it, and the
+ * events in a range are all of them except for those.
+ *
+ * Every integer in a version 4 file is little endian, int64_ts are stored as
+ * they are instead of through su64(), and every structure starts at a multiple
+ * of 8 bytes (the root right after the header at 40, and event data padded out
+ * after its name). Every member of a node, event, or event data is then
+ * naturally aligned, so on a little endian machine they're used as they are in
+ * the mapping, or after a single read into an aligned buffer, without decoding
+ * anything. The header is little endian too, but its version is a single byte
+ * at the same place as always, so that's read first to find out.
+ *
  * Event representation:
  *     struct {
  *         uint64_t next;               The next event that occurs at this same
  *                                      time stamp
  *         uint64_t prev;               The location of the pointer to this
- *                                      event
+ *                                      event (either the event field of a
+ *                                      node, or the next field of an event)
  *         uint64_t nextsm;             A pointer to the next event with the
  *                                      same event data
  *         uint64_t ptr;                A pointer to event data
@@ -120,25 +199,103 @@
  *         uint64_t len;                The length of this event name
  *         char name[len];              The event name itself
  *     };
+ *
+ * Metadata representation:
+ *     struct {
+ *         uint64_t nodepage[6];        The node pages new nodes go in, by
+ *                                      size
+ *         uint64_t nodenext;           The next unused page of the region
+ *                                      they're in
+ *         uint64_t nodesend;           The end of that region
+ *         uint64_t freenodes[6];       Lists of free nodes, by size
+ *         uint64_t free[6];            Lists of free extents, by size
+ *         uint64_t generation;         Goes up by one with every change to
+ *                                      the events, 0 in files from before
+ *                                      it was added
+ *     };
+ *
+ * Free extent representation:
+ *     struct {
+ *         uint64_t next;               The next extent in the same list
+ *         uint64_t len;                The length of this extent, including
+ *                                      these 16 bytes
+ *     };
+ *
+ * Allocation:
+ *   Nodes go in 4 KiB node pages, which are aligned to 4 KiB in the file and
+ *   handed out from 64 KiB regions. Version 4 nodes in node pages have room
+ *   for 3, 5, 9, 17, 33, or 63 slots (48 to 528 bytes), and all of the
+ *   nodes in a page have the same size. Version 0 nodes only come in one
+ *   size, and only use the first of each list in the metadata. A new node
+ *   goes in the same page as its parent if it has the same size and there's
+ *   room, otherwise it goes in `nodepage` for its size, or `nodenext` up to
+ *   `nodesend`, or a new region at the end of the file. Nodes in a node page
+ *   have the DF_NODE_PAGED flag set, and since they're never taken out of a
+ *   page, the used slots are always the first ones. A node that needs more
+ *   slots than it has room for moves to a new node of the smallest size with
+ *   room, and its old space is freed.
+ *
+ *   Events and event data are appended to the end of the file. Each event
+ *   is read together with its data, and keeping them next to each other
+ *   saves more reads than packing either of them does.
+ *
+ *   dateremove gives the space of an event's data and event structs back as
+ *   free extents, merging the ones next to each other (which is usually all
+ *   of them, since they were appended together). free[i] lists the extents
+ *   from 32 << i bytes up to twice that, and free[5] everything from 1 KiB
+ *   up. New events and event data are carved out of the end of a free
+ *   extent before anything is appended, and leftovers too small for an
+ *   event are dropped. Whole blocks in the middle of a free extent are
+ *   punched out of the file where the filesystem supports it.
+ *
+ *   Nodes that are left without events or children are freed too. A freed
+ *   node in a node page keeps its DF_NODE_PAGED flag and its size so the
+ *   page stays packed, and goes in the `freenodes` list for its size through
+ *   its first child pointer. New nodes reuse those before they start a new
+ *   page. Freed nodes outside of node pages just become free extents.
+ *
+ *   Files get metadata the first time something is added to them, and
+ *   datedefrag packs everything together again, so the copy starts without
+ *   any pages or free space, and every node in it has exactly the room it
+ *   needs. Nodes left with a single child stay until datedefrag compresses
+ *   them.
  * */
 
+/* The number of free extent lists, see "Allocation" above */
+#define DF_FREE_BINS 6
+/* The number of node sizes, see "Allocation" above */
+#define DF_NODE_CLASSES 6
+
 #define NAMESPACE df_
 #define STRUCTS \
 	X(header, \
 		Y(PADDING, magic, 8) \
 		Y(PTR, bit1, node) \
 		Y(U8, bitn, ~) \
-		Y(PADDING, reserved, 16) \
+		Y(U8, version, ~) \
+		Y(PTR, meta, meta) \
+		Y(PADDING, reserved, 7) \
 	) \
 	X(node, \
 		Y(PTR, child0, node) \
 		Y(PTR, child1, node) \
 		Y(PTR, event, event) \
-		Y(PADDING, reserved, 16) \
+		Y(U64, key, ~) \
+		Y(U8, skip, ~) \
+		Y(U8, flags, ~) \
+		Y(PADDING, reserved, 6) \
+	) \
+	X(cnode, \
+		Y(U64, key, ~) \
+		Y(U64, map, ~) \
+		Y(U8, skip, ~) \
+		Y(U8, flags, ~) \
+		Y(U8, size, ~) \
+		Y(PADDING, reserved, 5) \
 	) \
 	X(event, \
 		Y(PTR, next, event) \
-		Y(PTR, prev, event) \
+		Y(U64, prev, ~) \
 		Y(PTR, nextsm, event) \
 		Y(PTR, ptr, event_data) \
 		Y(PADDING, reserved, 16) \
@@ -149,563 +306,6181 @@
 		Y(I64, start, ~) \
 		Y(I64, end, ~) \
 		Y(STR, name, ~) \
+	) \
+	X(meta, \
+		Y(U64S, nodepage, DF_NODE_CLASSES) \
+		Y(U64, nodenext, ~) \
+		Y(U64, nodesend, ~) \
+		Y(U64S, freenodes, DF_NODE_CLASSES) \
+		Y(U64S, free, DF_FREE_BINS) \
+		Y(U64, generation, ~) \
+	) \
+	X(extent, \
+		Y(U64, next, ~) \
+		Y(U64, len, ~) \
 	)
 
 #include "filestruct.h"
 #undef STRUCTS
 #undef NAMESPACE
 
+#define DF_VERSION_BINARY 0
+#define DF_VERSION_NATIVE 4
+#define DF_VERSION_LATEST DF_VERSION_NATIVE
+
+/* Where everything in a version 4 file starts a multiple of */
+#define DF_NATIVE_ALIGN 8
+
+/* The number of bits a version 4 node consumes */
+#define DF_WIDE_BITS 4
+
+/* Where each kind of slot starts in the map of a version 4 node */
+#define DF_SLOT_CHILD 0
+#define DF_SLOT_EVENT 16
+#define DF_SLOT_STARTS 32
+#define DF_SLOT_ENDS 48
+/* The most slots a node can have, which the root always has room for */
+#define DF_SLOTS_MAX 63
+
+/* Node flags */
+#define DF_NODE_PAGED 1
+
+#define DF_NODE_PAGE_SIZE 4096
+#define DF_NODE_REGION_SIZE (1 << 16)
+
 /* Creates a datefile. This function will truncate `path` */
 static int datecreate(char *path, datefile *ret);
+/* Writes the header and an empty root node of a new datefile */
+static int dateinit(int fd, uint8_t version, uint64_t *rootret);
+
+/* A node of either version, as the tree code sees it, with every slot a
+ * version 4 node could have. Binary nodes only have two children and one event
+ * list, and no counts. `map` and `size` are the ones of version 4 nodes, and
+ * say where each slot is on disk, see slotpos(). */
+struct treenode {
+	uint64_t offset;
+	uint64_t child[1 << DF_WIDE_BITS];
+	uint64_t event[(1 << DF_WIDE_BITS) - 1];
+	uint64_t starts[1 << DF_WIDE_BITS];
+	uint64_t ends[1 << DF_WIDE_BITS];
+	uint64_t map;
+	uint64_t key;
+	int skip;
+	int flags;
+	int size;
+};
+
+/* The metadata of a file */
+struct datealloc {
+	struct df_meta meta;
+	/* Free space set aside for the event dateadd is adding */
+	uint64_t next;
+	uint64_t end;
+};
 
-/* Add a date with a certain prefix */
-static int dateaddbit(datefile *file, uint64_t prefix, int precision,
+/* The nodes from the root down to some node in the tree. nodes[0] is the
+ * root, and nodes[len-1] is the node at the end of the path, where prefixes
+ * of `precision` bits starting with `prefix` go. A len of 0 means nothing
+ * has been read yet. */
+struct datepath {
+	int len;
+	uint64_t prefix;
+	int precision;
+	struct {
+		struct treenode node;
+		int depth;
+	} nodes[65];
+};
+
+/* Gets the insertion cursor of a file, which is kept between calls so that
+ * inserts close to the previous one don't have to start from the root */
+static struct datepath *getcursor(datefile *file);
+/* Forgets everything a cursor knows, for when the tree changes without it */
+static inline void pathreset(struct datepath *path) {
+	if (path != NULL) {
+		path->len = 0;
+	}
+}
+/* Moves the end of the path to the node with a certain prefix, creating nodes
+ * as needed. Only the part of the path that differs is read again. */
+static int pathseek(datefile *file, struct datepath *path,
+		uint64_t prefix, int precision);
+/* Adds an event at the end of the path */
+static int pathaddevent(datefile *file, struct datepath *path,
 		uint64_t dataptr, uint64_t nextsmptr, uint64_t *newnextsmptr);
+/* Counts an event from start-end in the nodes on the path, if the end of the
+ * path is its first or last prefix */
+static int pathcount(datefile *file, struct datepath *path,
+		uint64_t start, uint64_t end);
 
-static int datesearchrecursive(datefile *file, struct eventlist *events,
-		uint64_t start, uint64_t end,
-		uint64_t prefix, uint8_t precision,
-		uint64_t ptr);
-static int readtime(datefile *file, struct eventlist *events, uint64_t ptr);
+/* Calls `report` with the smallest set of prefixes that covers start-end
+ * inclusive, in increasing order */
+static int coverrange(uint64_t start, uint64_t end,
+		int (*report)(uint64_t prefix, int precision, void *arg),
+		void *arg);
+
+static int mirrorsearch(datefile *file, struct eventlist *events,
+		uint64_t start, uint64_t end);
+static void mirrorchanged(datefile *file, int failed,
+		uint64_t start, uint64_t end, uint64_t removed);
+static void mirrorreload(datefile *file);
+static void mirrorfree(struct datemirror *mirror);
+static int indexopen(datefile *file, int writable);
+static void indexclose(datefile *file);
+static int indexdrop(datefile *file);
+static int indexusable(datefile *file);
+static void indexstart(struct datesearch *search);
+static int indexnext(struct datesearch *search, uint64_t *dataret);
 static int eventremove(datefile *file, uint64_t id, uint64_t *nextsmret);
+/* Every public function that reads the file holds the commit lock shared */
+static int beginread(datefile *file);
+static void endread(datefile *file);
+static void parallelfree(struct dateparallel *parallel);
 
-static inline uint64_t fill1(int n) {
-	/* Undefined behavior :( */
-	if (n >= 64) {
-		return UINT64_MAX;
-	}
-	return ((uint64_t) 1ull << n)-1;
+/* Version 4 files are little endian with every structure aligned, so that
+ * they can be read in place. Version 0 files are big endian and packed
+ * together. */
+static inline int islittle(uint8_t version) {
+	return version != DF_VERSION_BINARY;
 }
 
-int dateopen(char *path, datefile *ret) {
-	FILE *file = fopen(path, "rb+");
-	struct df_header header;
-	if (file == NULL) {
-		return datecreate(path, ret);
+static inline uint64_t recordalign(uint8_t version) {
+	return version != DF_VERSION_BINARY ? DF_NATIVE_ALIGN : 1;
+}
+
+/* Rounds a position or size up to where the next structure can go */
+static inline uint64_t recordsize(datefile *file, uint64_t size) {
+	uint64_t align = recordalign(file->version);
+	return (size + align - 1) / align * align;
+}
+
+/* Every read of a datefile goes through here, so that it sees writes that
+ * haven't been committed yet. Mapped files are read from the mapping. */
+static int readat(datefile *file, uint64_t pos, void *buf, size_t len) {
+	if (file->map != NULL) {
+		if (pos > file->maplen || len > file->maplen - pos) {
+			return -1;
+		}
+		memcpy(buf, file->map + pos, len);
+		return 0;
 	}
+	if (file->wal != NULL) {
+		return walread(file->wal, pos, buf, len);
+	}
+	return cacheread(&file->cache, pos, buf, len);
+}
 
-	if (read_df_header(&header, file)) {
+/* Every write to a datefile goes through here so that the page cache stays in
+ * sync with the file. Files with a log hold on to their writes until the next
+ * commit. */
+static int writeat(datefile *file, uint64_t pos, const void *buf, size_t len) {
+	if (file->wal != NULL) {
+		return walwrite(file->wal, pos, buf, len);
+	}
+	if (pwriteall(file->fd, pos, buf, len)) {
 		return -1;
 	}
+	cachewrote(&file->cache, pos, buf, len);
+	return 0;
+}
 
-	if (memcmp(header.magic, "datefile", sizeof header.magic)) {
+static int write64at(datefile *file, uint64_t pos, uint64_t val) {
+	unsigned char data[8];
+	struct filestruct_wbuf buf = {
+		.data = data,
+		.base = pos,
+		.len = sizeof data,
+		.pos = 0,
+		.little = islittle(file->version),
+	};
+	if (bwriteu64(val, &buf)) {
 		return -1;
 	}
+	return writeat(file, pos, data, sizeof data);
+}
 
-	if ((ret->path = strdup(path)) == NULL) {
+static int fileend(datefile *file, uint64_t *ret) {
+	struct stat st;
+	if (file->wal != NULL) {
+		*ret = walend(file->wal);
+		return 0;
+	}
+	if (fstat(file->fd, &st) == -1) {
 		return -1;
 	}
+	*ret = (uint64_t) st.st_size;
+	return 0;
+}
 
-	ret->file = file;
-	ret->bit1 = header.bit1;
-	ret->bitn = header.bitn;
+/* A filestruct_io that goes through readat and writeat */
+static int ioread(void *file, uint64_t pos, void *buf, size_t len) {
+	return readat(file, pos, buf, len);
+}
+static int iowrite(void *file, uint64_t pos, const void *buf, size_t len) {
+	return writeat(file, pos, buf, len);
+}
+static inline struct filestruct_io fileio(datefile *file) {
+	struct filestruct_io ret = {
+		.read = ioread,
+		.write = iowrite,
+		.ctx = file,
+		.little = islittle(file->version),
+	};
+	return ret;
+}
 
-	return 0;
+/* A datefile mapped into memory as a filestruct_buf at `ptr` */
+static inline struct filestruct_buf mapbuf(datefile *file, uint64_t ptr) {
+	struct filestruct_buf ret = {
+		.data = file->map,
+		.base = 0,
+		.len = file->maplen,
+		.pos = ptr,
+		.little = islittle(file->version),
+	};
+	return ret;
 }
 
-static int datecreate(char *path, datefile *ret) {
-	FILE *file = fopen(path, "w+");
-	struct df_header header;
-	struct df_node bit1;
+/* Reads a structure at `ptr`. If the file is memory mapped, the structure is
+ * decoded straight from the mapping without any syscalls, otherwise it comes
+ * from the page cache. */
+#define READ_AT(name) \
+	static int readat_##name(datefile *file, uint64_t ptr, \
+			struct df_##name *ret) { \
+		struct filestruct_io io; \
+		struct filestruct_buf buf; \
+\
+		if (file->map != NULL) { \
+			buf = mapbuf(file, ptr); \
+			return bread_df_##name(ret, &buf); \
+		} \
+		io = fileio(file); \
+		return read_df_##name(ret, ptr, &io); \
+	}
+READ_AT(node)
+READ_AT(cnode)
+READ_AT(event)
+READ_AT(event_data)
+READ_AT(meta)
+READ_AT(extent)
+#undef READ_AT
 
-	if (file == NULL) {
+/* The header is in the byte order of its own version, which has to be looked at
+ * before anything else in it */
+static int breadheader(struct df_header *ret, struct filestruct_buf *buf) {
+	const uint64_t version = offsetof(struct df_header_layout, version);
+	if (buf->pos > buf->len || buf->len - buf->pos <= version) {
 		return -1;
 	}
+	buf->little = islittle(buf->data[buf->pos + version]);
+	return bread_df_header(ret, buf);
+}
 
-	memcpy(header.magic, "datefile", sizeof header.magic);
-	header.bit1 = 0; /* to be overwritten later */
-	header.bitn = 64;
-	memset(header.reserved, 0, sizeof header.reserved);
+static int readat_header(datefile *file, uint64_t ptr,
+		struct df_header *ret) {
+	unsigned char data[sizeof(struct df_header_layout)];
+	struct filestruct_buf buf;
 
-	if (write_df_header(&header, file) == -1) {
+	if (file->map != NULL) {
+		buf = mapbuf(file, ptr);
+		return breadheader(ret, &buf);
+	}
+	if (readat(file, ptr, data, sizeof data)) {
 		return -1;
 	}
+	buf.data = data;
+	buf.base = ptr;
+	buf.len = sizeof data;
+	buf.pos = 0;
+	return breadheader(ret, &buf);
+}
 
-	bit1.child0 = bit1.child1 = bit1.event = 0;
-	memset(bit1.reserved, 0, sizeof bit1.reserved);
-	if (write_df_node(&bit1, file) == -1) {
-		return -1;
+/* Writes a structure at `ptr`, or at the end of the file for append_. This
+ * sets the offset and _pos members of `val`. */
+#define WRITE_AT(name) \
+	static int writeat_##name(datefile *file, uint64_t ptr, \
+			struct df_##name *val) { \
+		struct filestruct_io io = fileio(file); \
+		return write_df_##name(val, ptr, &io); \
+	} \
+	static int append_##name(datefile *file, struct df_##name *val) { \
+		uint64_t end; \
+		if (fileend(file, &end)) { \
+			return -1; \
+		} \
+		return writeat_##name(file, recordsize(file, end), val); \
 	}
+WRITE_AT(header)
+WRITE_AT(node)
+WRITE_AT(event)
+WRITE_AT(event_data)
+WRITE_AT(meta)
+WRITE_AT(extent)
+#undef WRITE_AT
 
-	if (seek(file, header.bit1_pos, SEEK_SET) == -1 ||
-	    writeu64(bit1.offset, file) == -1) {
-		return -1;
+static inline uint64_t fill1(int n) {
+	/* Undefined behavior :( */
+	if (n >= 64) {
+		return UINT64_MAX;
 	}
+	return ((uint64_t) 1ull << n)-1;
+}
 
-	if ((ret->path = strdup(path)) == NULL) {
-		return -1;
+/* Gets bits `from` through `to` (exclusive) of a key, counting from the most
+ * significant bit, right aligned */
+static inline uint64_t keybits(datefile *file, uint64_t key, int from, int to) {
+	if (to <= from) {
+		return 0;
 	}
+	return (key >> (file->bitn - to)) & fill1(to - from);
+}
 
-	ret->file = file;
-	ret->bit1 = bit1.offset;
-	ret->bitn = header.bitn;
+/* The number of bits each node consumes */
+static inline int versionbits(uint8_t version) {
+	return version != DF_VERSION_BINARY ? DF_WIDE_BITS : 1;
+}
 
-	return 0;
+static inline int nodebits(datefile *file) {
+	return versionbits(file->version);
 }
 
-static int dateaddbit(datefile *file, uint64_t prefix, int precision,
-		uint64_t dataptr, uint64_t nextsmptr, uint64_t *newnextsmptr) {
-	if (seek(file->file, file->bit1, SEEK_SET) == -1) {
-		return -1;
+/* The index of the event list in a node for prefixes `sublen` bits longer
+ * than the node, whose last `sublen` bits are `subkey` */
+static inline int listindex(int sublen, uint64_t subkey) {
+	return (1 << sublen) - 1 + (int) subkey;
+}
+
+/* The slot of the counts of a node at `depth` that `time` goes in, see
+ * version 4 above */
+static inline int countslot(datefile *file, uint64_t time, int depth) {
+	int bits = nodebits(file);
+	if (depth + bits > file->bitn) {
+		return 0;
 	}
+	return (int) keybits(file, time, depth, depth + bits);
+}
 
-	/* For each bit */
-	for (int i = 0; i < precision; ++i) {
-		uint64_t mask = 1llu << (file->bitn-1-i);
-		int bit = !!(prefix & mask);
-		uint64_t next;
-		struct df_node node;
+static inline uint64_t countsum(const uint64_t *counts) {
+	uint64_t sum = 0;
+	for (int i = 0; i < 1 << DF_WIDE_BITS; ++i) {
+		sum += counts[i];
+	}
+	return sum;
+}
 
-		/* Read the node */
-		if (read_df_node(&node, file->file)) {
-			return -1;
+static inline int hasevents(datefile *file, struct treenode *node) {
+	for (int i = 0; i < (1 << nodebits(file)) - 1; ++i) {
+		if (node->event[i] != 0) {
+			return 1;
 		}
-		next = bit ? node.child1 : node.child0;
-
-		/* If the next node down doesn't exist yet, create it */
-		if (next == 0) {
-			uint64_t new_pos;
-			struct df_node new_node;
+	}
+	return 0;
+}
 
-			/* Go to the end of the file (where new nodes are
-			 * added) */
-			if (seek(file->file, 0, SEEK_END) == -1) {
-				return -1;
-			}
+static inline void emptynode(struct treenode *node) {
+	memset(node, 0, sizeof *node);
+}
 
-			/* Remember the location of the new node*/
-			if (tell(file->file, &new_pos) == -1) {
-				return -1;
-			}
+/* The field of a node that a slot of a version 4 node holds */
+static inline uint64_t *nodeslot(struct treenode *node, int slot) {
+	if (slot < DF_SLOT_EVENT) {
+		return &node->child[slot - DF_SLOT_CHILD];
+	}
+	if (slot < DF_SLOT_STARTS) {
+		return &node->event[slot - DF_SLOT_EVENT];
+	}
+	if (slot < DF_SLOT_ENDS) {
+		return &node->starts[slot - DF_SLOT_STARTS];
+	}
+	return &node->ends[slot - DF_SLOT_ENDS];
+}
 
-			/* Write the new node */
-			new_node.child0 = 0;
-			new_node.child1 = 0;
-			new_node.event = 0;
-			memset(new_node.reserved, 0, sizeof new_node.reserved);
-			if (write_df_node(&new_node, file->file)) {
-				return -1;
-			}
+/* Whether a node has a place on disk for a slot */
+static inline int hasslot(datefile *file, struct treenode *node, int slot) {
+	return file->version == DF_VERSION_BINARY || (node->map >> slot & 1);
+}
 
-			/* Update the old node */
-			if (bit) {
-				node.child1 = new_pos;
-			}
-			else {
-				node.child0 = new_pos;
-			}
-			if (seek(file->file, node.offset, SEEK_SET) == -1) {
-				return -1;
-			}
-			if (write_df_node(&node, file->file)) {
-				return -1;
-			}
+/* Where a slot of a node is on disk, if it has it. Version 0 nodes have
+ * child0, child1, and event in that order. */
+static inline uint64_t slotpos(datefile *file, struct treenode *node,
+		int slot) {
+	if (file->version == DF_VERSION_BINARY) {
+		return node->offset +
+			8 * (uint64_t) (slot < DF_SLOT_EVENT ? slot : 2);
+	}
+	return node->offset + sizeof(struct df_cnode_layout) +
+		8 * (uint64_t) __builtin_popcountll(node->map & fill1(slot));
+}
 
-			/* Get back to the new (child) node */
-			if (seek(file->file, new_pos, SEEK_SET) == -1) {
-				return -1;
-			}
-		}
-		/* If the child node does exist, just go to it */
-		else {
-			if (seek(file->file, next, SEEK_SET) == -1) {
-				return -1;
-			}
+/* The map of the slots of a version 4 node that aren't 0 */
+static uint64_t usedslots(struct treenode *node) {
+	uint64_t map = 0;
+	for (int i = 0; i <= DF_SLOTS_MAX; ++i) {
+		if (i != DF_SLOT_STARTS - 1 && *nodeslot(node, i) != 0) {
+			map |= (uint64_t) 1 << i;
 		}
 	}
+	return map;
+}
 
-	/* We are at the dest node */
+/* The room nodes in node pages have, in slots, see "Allocation" above */
+static const int nodeclasses[DF_NODE_CLASSES] = {3, 5, 9, 17, 33, DF_SLOTS_MAX};
 
-	struct df_node node;
-	struct df_event event;
+/* The smallest node size with room for `slots` slots. Version 0 nodes only
+ * come in one size. */
+static int nodeclass(datefile *file, int slots) {
+	int class = 0;
+	if (file->version == DF_VERSION_BINARY) {
+		return 0;
+	}
+	while (class < DF_NODE_CLASSES - 1 && nodeclasses[class] < slots) {
+		++class;
+	}
+	return class;
+}
 
-	/* Read the node */
-	if (read_df_node(&node, file->file)) {
-		return -1;
+/* The space a node with room for `size` slots takes up */
+static uint64_t nodebytes(datefile *file, int size) {
+	if (file->version == DF_VERSION_BINARY) {
+		struct df_node node = {0};
+		return size_df_node(&node);
 	}
+	return sizeof(struct df_cnode_layout) + 8 * (uint64_t) size;
+}
 
-	/* Create a new event struct */
-	event.next = node.event;
-	event.prev = node.event_pos;
-	event.nextsm = nextsmptr;
-	event.ptr = dataptr;
-	memset(event.reserved, 0, sizeof event.reserved);
+/* Reads a version 4 node, leaving its counts alone unless `counts` is set.
+ * cnode is only the part before the slots, which are decoded here. The counts
+ * are the last slots, so walks that never write a node back don't have to read
+ * them. */
+static int readcnode(datefile *file, uint64_t ptr, struct treenode *ret,
+		int counts) {
+	unsigned char slots[8 * DF_SLOTS_MAX];
+	struct df_cnode node;
+	uint64_t map;
+	int len;
 
-	/* Write event data */
-	if (seek(file->file, 0, SEEK_END) == -1 || /* Get to the EOF */
-	    write_df_event(&event, file->file) == -1) { /* Write event */
+	if (readat_cnode(file, ptr, &node)) {
 		return -1;
 	}
-	/* Get new nextsm */
-	*newnextsmptr = event.offset;
-
-	/* Update the old timestamp head's prev value */
-	if (node.event != 0 &&
-	    ((seek(file->file, node.event + 8, SEEK_SET) == -1 ||
-	     writeu64(event.offset, file->file)))) {
+	map = counts ? node.map : node.map & fill1(DF_SLOT_STARTS);
+	len = __builtin_popcountll(map);
+	if (node.size > DF_SLOTS_MAX || (node.map >> (DF_SLOT_STARTS-1) & 1) ||
+	    __builtin_popcountll(node.map) > node.size) {
 		return -1;
 	}
-
-	/* Update timestamp head pointer */
-	if (seek(file->file, node.event_pos, SEEK_SET) == -1 ||
-	    writeu64(*newnextsmptr, file->file)) {
+	if (len > 0 && readat(file, ptr + sizeof(struct df_cnode_layout),
+				slots, 8 * (size_t) len)) {
 		return -1;
 	}
 
+	memset(ret->child, 0, sizeof ret->child);
+	memset(ret->event, 0, sizeof ret->event);
+	if (counts) {
+		memset(ret->starts, 0, sizeof ret->starts);
+		memset(ret->ends, 0, sizeof ret->ends);
+	}
+	for (int i = 0; map != 0; map &= map - 1, ++i) {
+		*nodeslot(ret, __builtin_ctzll(map)) =
+			load64(slots + 8 * i, islittle(file->version));
+	}
+	ret->map = node.map;
+	ret->key = node.key;
+	ret->skip = node.skip;
+	ret->flags = node.flags;
+	ret->size = node.size;
+	ret->offset = ptr;
 	return 0;
-
 }
 
-int dateadd(struct event *event, datefile *file) {
-	if (file->bitn > 64) {
-		return -1;
-	}
+/* Reads a node without its counts, which are left alone */
+static int readlinks(datefile *file, uint64_t ptr, struct treenode *ret) {
+	struct df_node node;
 
-	if (seek(file->file, 0, SEEK_END) == -1) {
-		return -1;
+	if (file->version != DF_VERSION_BINARY) {
+		return readcnode(file, ptr, ret, 0);
 	}
-
-	uint64_t id;
-	if (tell(file->file, &id) == -1) {
+	if (readat_node(file, ptr, &node)) {
 		return -1;
 	}
+	ret->child[0] = node.child0;
+	ret->child[1] = node.child1;
+	ret->event[0] = node.event;
+	ret->map = 0;
+	ret->key = node.key;
+	ret->skip = node.skip;
+	ret->flags = node.flags;
+	ret->size = 0;
+	ret->offset = ptr;
+	return 0;
+}
 
-	size_t eventlen = strlen(event->name);
-	struct df_event_data data;
-	data.functions = 0;
-	data.firstev = 0;
-	data.start = event->start;
-	data.end = event->end;
-	data.name_len = eventlen;
-	data.name = event->name;
-
-	/* Write event data */
-	if (write_df_event_data(&data, file->file) == -1) {
-		return -1;
+static int readnode(datefile *file, uint64_t ptr, struct treenode *ret) {
+	if (file->version == DF_VERSION_BINARY) {
+		memset(ret->starts, 0, sizeof ret->starts);
+		memset(ret->ends, 0, sizeof ret->ends);
+		return readlinks(file, ptr, ret);
 	}
-	event->id = id;
-
-	uint64_t nextsmptr = 0;
+	return readcnode(file, ptr, ret, 1);
+}
 
-	uint64_t start = su64(event->start);
-	uint64_t end = su64(event->end);
-	uint64_t lower = start;
+/* Writes a node at `ptr`, setting its offset. Version 4 nodes get the slots
+ * in their map. */
+static int writenode(datefile *file, uint64_t ptr, struct treenode *val) {
+	if (file->version != DF_VERSION_BINARY) {
+		unsigned char data[sizeof(struct df_cnode_layout) +
+			8 * DF_SLOTS_MAX];
+		struct filestruct_wbuf buf = {
+			.data = data,
+			.base = ptr,
+			.len = sizeof data,
+			.pos = 0,
+			.little = islittle(file->version),
+		};
+		struct df_cnode node;
 
-	/* Some dark magic I thought of at midnight while trying to go to
-	 * sleep. This code generates the smallest possible set of binary string
-	 * prefixes that fully encompasses a range. Here's how it works:
-	 *
-	 * Let's simplify this problem and try to find the smallest set of
-	 * prefixes that goes from some number `n` to 0xffffff... Let's say,
-	 * for example, n=0b00110100
-	 *
-	 * You can find the lower bound of a binary string prefix by setting all
-	 * the non-captured bits to zero and the upper bound by setting all the
-	 * non-captured bits to one. Since we only care about the lower bound,
-	 * we want the largest possible prefix where all the non-captured bits
-	 * are already zero. In this case, 0b00110100/6
-	 *
-	 * That string captures 0b00110100-0b00110111 inclusive. Now the goal is
-	 * to find the set of prefixes that capture 0b00111000-0b11111111. In
-	 * this case, that's 0b00111000/5.
-	 *
-	 * We can continue on like this forever. That last group captures
-	 * 0b00111000-0b00111111, so our next prefix has to start at 0b01000000.
-	 * Algorithmically, the next prefix is always the least precise prefix
-	 * where the non-captured bits of the lower bound are all zero. Then,
-	 * we fill the non-captured bits with ones, add one, and that's the new
-	 * lower bound. That code looks like this:
-	 *
-	 * 	uint64_t lower = start;
-	 * 	for (;;) {
-	 * 		uint64_t bit = 1;
-	 * 		int precision = 64;
-	 *
-	 * 		// While the iterated bit is zero
-	 * 		while (lower ^ bit > lower) {
-	 *			// For efficiency, we fill the uncaptured bits
-	 *			// with ones as we check them
-	 *			lower ^= bit;
-	 *
-	 * 			// Iterate to the next bit
-	 *			bit <<= 1;
-	 *			--precision;
-	 * 		}
-	 * 		
-	 * 		report_prefix(lower, precision);
-	 * 		++lower;
-	 * 	}
-	 *
-	 * The code below is just a golfed version of this with a check to make
-	 * sure we don't go too big. The separate `bit` and `precision`
-	 * variables are combined, and the while loop is turned to a for.
-	 *
-	 * This code runs in O(b^2) time where b is the width of the integer.
-	 * This is because for each prefix we may loop b times, and there may be
-	 * b prefixes. This can be seen in the prefixes for 0x1-0xffffff...
-	 *
-	 * In theory this could be reduced to O(b log b) by using binary search
-	 * to find the maximum precision of a prefix, or even O(b) by memoizing
-	 * the precision of the previous prefix, but that would make the code
-	 * far more complicated.
-	 * */
-	while (lower <= end) {
-		int precision;
-		for (precision = 0; /* For each bit */
-				/* Make sure we're not leaving uncaptured
-				 * ones */
-				(lower ^ (1llu << precision)) > lower &&
-				/* Make sure we don't go too high */
-				(lower ^ (1llu << precision)) <= end;
-				++precision) {
-			/* Fill uncaptured bits with ones */
-			lower ^= (1llu << precision);
+		node.key = val->key;
+		node.map = val->map;
+		node.skip = (uint8_t) val->skip;
+		node.flags = (uint8_t) val->flags;
+		node.size = (uint8_t) val->size;
+		memset(node.reserved, 0, sizeof node.reserved);
+		if (__builtin_popcountll(val->map) > val->size ||
+		    bwrite_df_cnode(&node, &buf)) {
+			return -1;
 		}
-		/* Report a prefix */
-		if (dateaddbit(file, lower, 64-precision,
-					id, nextsmptr, &nextsmptr)) {
+		for (uint64_t map = val->map; map != 0; map &= map - 1) {
+			if (bwriteu64(*nodeslot(val, __builtin_ctzll(map)),
+					&buf)) {
+				return -1;
+			}
+		}
+		if (writeat(file, ptr, data, buf.pos)) {
+			return -1;
+		}
+	}
+	else {
+		struct df_node node;
+		node.child0 = val->child[0];
+		node.child1 = val->child[1];
+		node.event = val->event[0];
+		node.key = val->key;
+		node.skip = (uint8_t) val->skip;
+		node.flags = (uint8_t) val->flags;
+		memset(node.reserved, 0, sizeof node.reserved);
+		if (writeat_node(file, ptr, &node)) {
 			return -1;
 		}
-		/* Update lower bound */
-		++lower;
 	}
+	val->offset = ptr;
+	return 0;
+}
 
-	/* Set event data head */
-	if (seek(file->file, data.firstev_pos, SEEK_SET) == -1 ||
-	    writeu64(nextsmptr, file->file) == -1) {
+/* Makes room for `size` bytes at the end of the file, starting at a multiple
+ * of `align` */
+static int reserve(datefile *file, uint64_t size, uint64_t align,
+		uint64_t *ret) {
+	uint64_t end;
+	if (fileend(file, &end)) {
 		return -1;
 	}
-
+	end = (end + align - 1) / align * align;
+	if (writeat(file, end + size - 1, "", 1)) {
+		return -1;
+	}
+	*ret = end;
 	return 0;
 }
 
-struct eventlist *datesearch(datefile *file, int64_t start, int64_t end) {
-	struct eventlist *ret;
-	int status;
-	if ((ret = malloc(sizeof *ret)) == NULL) {
-		return NULL;
+/* Gets the metadata of a file, adding it if the file doesn't have any yet */
+static struct datealloc *getalloc(datefile *file) {
+	struct datealloc *alloc;
+	struct df_header header;
+
+	if (file->alloc != NULL) {
+		return file->alloc;
 	}
-	ret->len = 0;
-	ret->alloc = 20;
-	if ((ret->events = malloc(ret->alloc * sizeof *ret->events)) == NULL) {
-		free(ret);
+	if ((alloc = malloc(sizeof *alloc)) == NULL) {
 		return NULL;
 	}
+	alloc->next = alloc->end = 0;
 
-	status = datesearchrecursive(file, ret, su64(start), su64(end),
-			0, 0, file->bit1);
-	if (status) {
-		freeeventlist(ret);
-		return NULL;
+	if (readat_header(file, 0, &header)) {
+		goto error;
+	}
+	if (header.meta != 0) {
+		if (readat_meta(file, header.meta, &alloc->meta)) {
+			goto error;
+		}
+	}
+	else {
+		memset(&alloc->meta, 0, sizeof alloc->meta);
+		if (append_meta(file, &alloc->meta) ||
+		    write64at(file, header.meta_pos, alloc->meta.offset)) {
+			goto error;
+		}
 	}
 
-	return ret;
+	file->alloc = alloc;
+	return alloc;
+error:
+	free(alloc);
+	return NULL;
 }
 
-static int datesearchrecursive(datefile *file, struct eventlist *events,
-		uint64_t start, uint64_t end,
-		uint64_t prefix, uint8_t precision,
-		uint64_t ptr) {
-	/* Sanitize invalid pointers */
-	if (ptr == 0) {
-		return 0;
+/* Sets the generation of a file, see "Metadata representation" above */
+static int setgeneration(datefile *file, uint64_t generation) {
+	struct datealloc *alloc;
+	if ((alloc = getalloc(file)) == NULL) {
+		return -1;
 	}
+	alloc->meta.generation = generation;
+	return writeat_meta(file, alloc->meta.offset, &alloc->meta);
+}
 
-	/* Earliest and latest possible times given the current prefix and
-	 * precision */
-	uint64_t early, late;
+static int readgeneration(datefile *file, uint64_t *ret) {
+	struct df_header header;
+	struct df_meta meta;
 
-	/* Make sure we're still within the bounds */
-	early = prefix;
-	late = prefix | fill1(file->bitn-precision);
-	if (early > end || late < start) {
+	if (file->alloc != NULL) {
+		*ret = file->alloc->meta.generation;
 		return 0;
 	}
-
-	/* Sanity check */
-	if (precision > file->bitn) {
+	if (readat_header(file, 0, &header)) {
 		return -1;
 	}
-
-	/* Read the fields */
-	if (seek(file->file, ptr, SEEK_SET) == -1) {
-		return -1;
+	if (header.meta == 0) {
+		*ret = 0;
+		return 0;
 	}
-	struct df_node node;
-	if (read_df_node(&node, file->file) == -1) {
+	if (readat_meta(file, header.meta, &meta)) {
 		return -1;
 	}
+	*ret = meta.generation;
+	return 0;
+}
 
-	/* If there is an event, read it */
-	if (node.event != 0) {
-		readtime(file, events, node.event);
+int dategeneration(datefile *file, uint64_t *ret) {
+	int status;
+	if (beginread(file)) {
+		return -1;
 	}
+	status = readgeneration(file, ret);
+	endread(file);
+	return status;
+}
 
-	/* Recurse with one more level of precision */
-	if (datesearchrecursive(file, events, start, end,
-				prefix,
-				precision+1, node.child0) ||
-	    datesearchrecursive(file, events, start, end,
-				prefix | (1lu << (file->bitn-precision-1)),
-				precision+1, node.child1)) {
+/* Marks a change to the events of a file */
+static int bumpgeneration(datefile *file) {
+	uint64_t generation;
+	if (readgeneration(file, &generation)) {
 		return -1;
 	}
+	return setgeneration(file, generation + 1);
+}
+
+/* Finds the first free slot in a node page whose nodes have room for `size`
+ * slots, or 0 if it's full or its nodes are another size */
+static int pageslot(datefile *file, uint64_t page, int size, uint64_t *ret) {
+	uint64_t bytes = nodebytes(file, size);
+	uint64_t low = 0, high = DF_NODE_PAGE_SIZE / bytes;
+	struct treenode node;
 
+	*ret = 0;
+	/* Pages start with a node as soon as they're used */
+	if (readlinks(file, page, &node)) {
+		return -1;
+	}
+	if (file->version != DF_VERSION_BINARY && node.size != size) {
+		return 0;
+	}
+	/* The used slots are always the first ones */
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		if (readlinks(file, page + mid * bytes, &node)) {
+			return -1;
+		}
+		if (node.flags & DF_NODE_PAGED) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	*ret = low < DF_NODE_PAGE_SIZE / bytes ? page + low * bytes : 0;
 	return 0;
 }
 
-/* Reads an event struct */
-static int readtime(datefile *file, struct eventlist *events, uint64_t ptr) {
-	if (seek(file->file, ptr, SEEK_SET) == -1) {
+/* Writes a new node with room for the slots in its map and any that aren't
+ * 0, in the same page as its parent if possible */
+static int newnode(datefile *file, struct treenode *parent,
+		struct treenode *val) {
+	struct datealloc *alloc;
+	uint64_t pos = 0;
+	int class;
+
+	if (file->version != DF_VERSION_BINARY) {
+		val->map |= usedslots(val);
+	}
+	class = nodeclass(file, __builtin_popcountll(val->map));
+	val->size = nodeclasses[class];
+	if ((alloc = getalloc(file)) == NULL) {
 		return -1;
 	}
-
-	for (;;) {
-		/* Reallocate events if OOM */
-		if (events->len >= events->alloc) {
-			struct event *newevents;
-			size_t newalloc;
-			newalloc = events->alloc * 2;
-			newevents = realloc(events->events,
-					newalloc * sizeof *newevents);
-			if (newevents == NULL) {
+	if ((parent->flags & DF_NODE_PAGED) &&
+	    pageslot(file, parent->offset - parent->offset % DF_NODE_PAGE_SIZE,
+		    val->size, &pos)) {
+		return -1;
+	}
+	if (pos == 0 && alloc->meta.freenodes[class] != 0) {
+		struct treenode freed;
+		if (readlinks(file, alloc->meta.freenodes[class], &freed)) {
+			return -1;
+		}
+		pos = alloc->meta.freenodes[class];
+		alloc->meta.freenodes[class] = freed.child[0];
+		if (writeat_meta(file, alloc->meta.offset, &alloc->meta)) {
+			return -1;
+		}
+	}
+	if (pos == 0 && alloc->meta.nodepage[class] != 0 &&
+	    pageslot(file, alloc->meta.nodepage[class], val->size, &pos)) {
+		return -1;
+	}
+	if (pos == 0) {
+		/* Move on to the next page of the region, or a new region */
+		pos = alloc->meta.nodenext;
+		if (pos == 0 || pos >= alloc->meta.nodesend) {
+			if (reserve(file, DF_NODE_REGION_SIZE,
+					DF_NODE_PAGE_SIZE, &pos)) {
 				return -1;
 			}
-			events->alloc = newalloc;
-			events->events = newevents;
+			alloc->meta.nodesend = pos + DF_NODE_REGION_SIZE;
 		}
-
-		/* uint64_t prev, next, nextsm, dataptr; */
-		struct df_event rawevent;
-		if (read_df_event(&rawevent, file->file) == -1) {
+		alloc->meta.nodenext = pos + DF_NODE_PAGE_SIZE;
+		alloc->meta.nodepage[class] = pos;
+		if (writeat_meta(file, alloc->meta.offset, &alloc->meta)) {
 			return -1;
 		}
+	}
+
+	val->flags |= DF_NODE_PAGED;
+	return writenode(file, pos, val);
+}
+
+/* The smallest free extent worth keeping, nothing smaller than an event is
+ * ever allocated */
+static uint64_t freemin(void) {
+	struct df_event event = {0};
+	return size_df_event(&event);
+}
+
+/* The free list that extents of `len` bytes go in */
+static int freebin(uint64_t len) {
+	int bin = 63 - __builtin_clzll(len) - 5;
+	if (bin < 0) {
+		return 0;
+	}
+	return bin < DF_FREE_BINS ? bin : DF_FREE_BINS - 1;
+}
+
+/* Gives `len` bytes at `pos` back, punching out the blocks they cover */
+static int freeextent(datefile *file, uint64_t pos, uint64_t len) {
+	struct datealloc *alloc;
+	struct df_extent extent;
+	int bin;
+
+	if (len < freemin()) {
+		return 0;
+	}
+	if ((alloc = getalloc(file)) == NULL) {
+		return -1;
+	}
+	bin = freebin(len);
+	extent.next = alloc->meta.free[bin];
+	extent.len = len;
+	if (writeat_extent(file, pos, &extent)) {
+		return -1;
+	}
+	alloc->meta.free[bin] = pos;
+	if (writeat_meta(file, alloc->meta.offset, &alloc->meta)) {
+		return -1;
+	}
+
+	/* The extent header has to stay. A crash before the next commit might
+	 * still need the rest, so the log punches it out after that. */
+	uint64_t start = (pos + size_df_extent(&extent) + DF_NODE_PAGE_SIZE - 1)
+		/ DF_NODE_PAGE_SIZE * DF_NODE_PAGE_SIZE;
+	uint64_t end = (pos + len) / DF_NODE_PAGE_SIZE * DF_NODE_PAGE_SIZE;
+	if (file->wal != NULL && start < end &&
+	    walpunch(file->wal, start, end - start)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Maximum number of extents looked at in a list that might not fit */
+#define FREE_SEARCH 8
 
-		/* Make sure we're not duplicating values
-		 * TODO: Use a hashmap or some other O(1) data structure for
-		 * this */
-		for (int i = 0; i < events->len; ++i) {
-			if (events->events[i].id == rawevent.ptr) {
-				goto next;
+/* Takes `size` bytes out of a free extent, or sets `ret` to 0 if there isn't
+ * one big enough */
+static int takefree(datefile *file, uint64_t size, uint64_t *ret) {
+	struct datealloc *alloc;
+	struct df_extent extent;
+	uint64_t prev, iter;
+
+	*ret = 0;
+	if ((alloc = getalloc(file)) == NULL) {
+		return -1;
+	}
+	for (int bin = freebin(size); bin < DF_FREE_BINS; ++bin) {
+		prev = 0;
+		iter = alloc->meta.free[bin];
+		for (int i = 0; iter != 0 && i < FREE_SEARCH; ++i) {
+			if (readat_extent(file, iter, &extent)) {
+				return -1;
 			}
+			if (extent.len >= size) {
+				goto found;
+			}
+			prev = iter;
+			iter = extent.next;
 		}
+	}
+	return 0;
 
-		if (seek(file->file, rawevent.ptr, SEEK_SET) == -1) {
-			return -1;
-		}
+found:
+	/* Usually what's left still belongs in the same list, and only the
+	 * length has to change */
+	if (extent.len - size >= freemin() &&
+	    freebin(extent.len - size) == freebin(extent.len)) {
+		*ret = iter + extent.len - size;
+		return write64at(file, extent.len_pos, extent.len - size);
+	}
 
-		struct event *event = events->events + (events->len++);
-		struct df_event_data data;
-		if (read_df_event_data(&data, file->file) == -1) {
+	if (prev == 0) {
+		alloc->meta.free[freebin(extent.len)] = extent.next;
+		if (writeat_meta(file, alloc->meta.offset, &alloc->meta)) {
 			return -1;
 		}
-		/* uint64_t functions, firstev, start, end, len; */
-		event->start = data.start;
-		event->end = data.end;
-		event->name = data.name;
-		event->id = rawevent.ptr;
+	}
+	else if (write64at(file, prev, extent.next)) {
+		return -1;
+	}
 
-next:
-		if (rawevent.next == 0) {
-			break;
-		}
-		if (seek(file->file, rawevent.next, SEEK_SET) == -1) {
-			return -1;
-		}
+	/* Take the end, so the rest stays where it is */
+	if (extent.len - size < freemin()) {
+		*ret = iter;
+		return 0;
 	}
+	*ret = iter + extent.len - size;
+	return freeextent(file, iter, extent.len - size);
+}
+
+static int countprefix(uint64_t prefix, int precision, void *arg) {
+	++*(int *) arg;
 	return 0;
 }
 
-void freeeventlist(struct eventlist *list) {
-	if (list == NULL) {
-		return;
+/* Takes `size` bytes out of the space set aside by setaside(), or out of a
+ * free extent if that's used up. Sets `ret` to 0 if there's nothing free. */
+static int takespace(datefile *file, uint64_t size, uint64_t *ret) {
+	struct datealloc *alloc;
+	if ((alloc = getalloc(file)) == NULL) {
+		return -1;
 	}
-	for (int i = 0; i < list->len; ++i) {
-		free(list->events[i].name);
+	if (alloc->end - alloc->next >= size) {
+		*ret = alloc->next;
+		alloc->next += size;
+		return 0;
 	}
-	free(list->events);
-	free(list);
+	return takefree(file, size, ret);
 }
 
-int dateremove(datefile *file, uint64_t id) {
-	uint64_t iter;
-	struct df_event_data data;
+/* Sets aside free space for an event and all of its event structs, so that
+ * they stay together like they would at the end of the file */
+static int setaside(datefile *file, struct event *event) {
+	struct datealloc *alloc;
+	struct df_event_data data = {0};
+	struct df_event ev = {0};
+	uint64_t size, pos;
+	int count = 0;
 
-	/* Go to the event data */
-	if (seek(file->file, id, SEEK_SET) == -1) {
+	if ((alloc = getalloc(file)) == NULL) {
+		return -1;
+	}
+	coverrange(su64(event->start), su64(event->end), countprefix, &count);
+	data.name_len = strlen(event->name);
+	size = recordsize(file, size_df_event_data(&data)) +
+		(uint64_t) count * recordsize(file, size_df_event(&ev));
+	if (takefree(file, size, &pos)) {
 		return -1;
 	}
+	alloc->next = pos;
+	alloc->end = pos == 0 ? 0 : pos + size;
+	return 0;
+}
+
+/* Gives up on whatever setaside() set aside. Anything left over is lost until
+ * the next datedefrag. */
+static void putaside(datefile *file) {
+	if (file->alloc != NULL) {
+		file->alloc->next = file->alloc->end = 0;
+	}
+}
 
-	/* Read the event data */
-	if (read_df_event_data(&data, file->file)) {
+/* Writes a new event, in freed space if there is any */
+static int newevent(datefile *file, struct df_event *event) {
+	uint64_t pos;
+	if (takespace(file, recordsize(file, size_df_event(event)), &pos)) {
 		return -1;
 	}
+	if (pos == 0) {
+		return append_event(file, event);
+	}
+	return writeat_event(file, pos, event);
+}
 
-	/* Remove pointers to every event that points to this event data */
-	iter = data.firstev;
-	while (iter != 0) {
-		if (eventremove(file, iter, &iter)) {
+/* Writes new event data, in freed space if there is any */
+static int newdata(datefile *file, struct df_event_data *data) {
+	uint64_t pos;
+	if (takespace(file, recordsize(file, size_df_event_data(data)),
+			&pos)) {
+		return -1;
+	}
+	if (pos == 0) {
+		return append_event_data(file, data);
+	}
+	return writeat_event_data(file, pos, data);
+}
+
+/* Gives the space of a node that isn't linked anymore back. Freed nodes in
+ * pages keep their size. */
+static int freenode(datefile *file, struct treenode *node) {
+	struct datealloc *alloc;
+	struct treenode freed;
+	int class = nodeclass(file, node->size);
+
+	if (!(node->flags & DF_NODE_PAGED)) {
+		return freeextent(file, node->offset,
+				nodebytes(file, node->size));
+	}
+	if ((alloc = getalloc(file)) == NULL) {
+		return -1;
+	}
+	emptynode(&freed);
+	freed.flags = DF_NODE_PAGED;
+	freed.child[0] = alloc->meta.freenodes[class];
+	freed.map = (uint64_t) 1 << DF_SLOT_CHILD;
+	freed.size = node->size;
+	if (writenode(file, node->offset, &freed)) {
+		return -1;
+	}
+	alloc->meta.freenodes[class] = node->offset;
+	return writeat_meta(file, alloc->meta.offset, &alloc->meta);
+}
+
+/* Points the first event of each list of `node` back at where the list is
+ * now, if it was somewhere else in `old` */
+static int movelists(datefile *file, struct treenode *old,
+		struct treenode *node) {
+	for (int i = 0; i < (1 << nodebits(file)) - 1; ++i) {
+		int slot = DF_SLOT_EVENT + i;
+		uint64_t pos = slotpos(file, node, slot);
+		if (node->event[i] == 0 || (hasslot(file, old, slot) &&
+				slotpos(file, old, slot) == pos)) {
+			continue;
+		}
+		if (write64at(file, node->event[i] +
+				offsetof(struct df_event_layout, prev), pos)) {
 			return -1;
 		}
 	}
 	return 0;
 }
 
-static int eventremove(datefile *file, uint64_t id, uint64_t *nextsmret) {
-	struct df_event event;
-	/* Read the event */
-	if (seek(file->file, id, SEEK_SET) == -1 ||
-	    read_df_event(&event, file->file) == -1) {
+/* Sets a slot of `node`, the child of `parent` or the root if that's NULL.
+ * A slot the node doesn't have yet is added to it, which moves the node if
+ * it doesn't have room for it. */
+static int nodeset(datefile *file, struct treenode *parent,
+		struct treenode *node, int slot, uint64_t val) {
+	struct treenode old;
+
+	if (hasslot(file, node, slot)) {
+		*nodeslot(node, slot) = val;
+		return write64at(file, slotpos(file, node, slot), val);
+	}
+	if (val == 0) {
+		return 0;
+	}
+
+	old = *node;
+	node->map |= (uint64_t) 1 << slot;
+	*nodeslot(node, slot) = val;
+	if (__builtin_popcountll(node->map) <= node->size) {
+		if (writenode(file, node->offset, node)) {
+			return -1;
+		}
+		return movelists(file, &old, node);
+	}
+
+	/* The root has room for every slot, so this is never it */
+	if (parent == NULL) {
 		return -1;
 	}
-	*nextsmret = event.nextsm;
+	node->flags &= ~DF_NODE_PAGED;
+	if (newnode(file, parent, node) || movelists(file, &old, node) ||
+	    freenode(file, &old)) {
+		return -1;
+	}
+	for (int i = 0; i < 1 << nodebits(file); ++i) {
+		if (parent->child[i] == old.offset) {
+			return nodeset(file, NULL, parent, DF_SLOT_CHILD + i,
+					node->offset);
+		}
+	}
+	return -1;
+}
 
-	/* Update the previous node's next pointer */
-	if (seek(file->file, event.prev, SEEK_SET) == -1 ||
-	    writeu64(event.next, file->file) == -1) {
+/* Checks whether we know how to read a file with this header */
+static int badheader(struct df_header *header) {
+	if (memcmp(header->magic, "datefile", sizeof header->magic) ||
+	    header->bitn > 64) {
+		return 1;
+	}
+	if (header->version == DF_VERSION_BINARY) {
+		return 0;
+	}
+	return header->version != DF_VERSION_NATIVE ||
+		header->bitn % DF_WIDE_BITS != 0;
+}
+
+/* The path of a file that goes with a datefile, like its log at ".wal" */
+static char *siblingpath(char *path, char *suffix) {
+	char *ret;
+	if ((ret = malloc(strlen(path) + strlen(suffix) + 1)) == NULL) {
+		return NULL;
+	}
+	strcpy(ret, path);
+	strcat(ret, suffix);
+	return ret;
+}
+
+/* Removes a file that goes with a datefile, if there is one */
+static int unlinksibling(char *path, char *suffix) {
+	char *sibling;
+	int ret;
+
+	if ((sibling = siblingpath(path, suffix)) == NULL) {
 		return -1;
 	}
-	/* Update the next node's prev pointer*/
-	if (event.next != 0 &&
-	    (seek(file->file, event.next+8, SEEK_SET) == -1 ||
-	    writeu64(event.prev, file->file))) {
+	ret = unlink(sibling) == -1 && errno != ENOENT ? -1:0;
+	free(sibling);
+	return ret;
+}
+
+/* Opens the log of a datefile, finishing whatever a crash interrupted */
+static int openwal(datefile *file) {
+	char *path;
+	int ret;
+
+	if ((file->wal = malloc(sizeof *file->wal)) == NULL) {
 		return -1;
 	}
-	return 0;
+	if ((path = siblingpath(file->path, ".wal")) == NULL) {
+		free(file->wal);
+		file->wal = NULL;
+		return -1;
+	}
+	ret = walopen(file->wal, path, file->fd, &file->cache);
+	free(path);
+	if (ret) {
+		free(file->wal);
+		file->wal = NULL;
+	}
+	return ret;
 }
 
-int datedefrag(datefile *file) {
-	FILE *tmp, *newfile;
-	if ((tmp = tmpfile()) == NULL) {
+/* Opens the lock file of a datefile */
+static int openlock(datefile *file, int writable) {
+	char *path;
+	int ret;
+
+	if ((file->lock = malloc(sizeof *file->lock)) == NULL) {
 		return -1;
 	}
-	if (defrag_df_header(0, file->file, tmp)) {
+	if ((path = siblingpath(file->path, ".lock")) == NULL) {
+		free(file->lock);
+		file->lock = NULL;
 		return -1;
 	}
-	if ((newfile = fopen(file->path, "wb+")) == NULL) {
+	ret = lockopen(file->lock, path, writable);
+	free(path);
+	if (ret) {
+		free(file->lock);
+		file->lock = NULL;
+	}
+	return ret;
+}
+
+/* Maps all of a read only datefile, in place of whatever was mapped before */
+static int datemap(datefile *file) {
+	struct stat st;
+	void *map;
+
+	if (fstat(file->fd, &st) == -1 || st.st_size <= 0) {
 		return -1;
 	}
-	if (fseek(tmp, 0, SEEK_SET) == -1) {
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED,
+			file->fd, 0);
+	if (map == MAP_FAILED) {
 		return -1;
 	}
-	for (;;) {
-		int c;
-		c = fgetc(tmp);
-		if (c == EOF) {
-			break;
-		}
-		if (fputc(c, newfile) == EOF) {
-			fclose(tmp);
-			fclose(newfile);
+	if (file->map != NULL) {
+		munmap(file->map, (size_t) file->maplen);
+	}
+	file->map = map;
+	file->maplen = (uint64_t) st.st_size;
+	return 0;
+}
+
+/* Catches up with whatever other datefiles committed while this one wasn't
+ * holding a lock, which can be anything from a few changed nodes to a whole
+ * new file from datedefrag. Everything we remember about the file is
+ * dropped. */
+static int datesync(datefile *file) {
+	struct df_header header;
+	struct stat st, pathst;
+	int newfd, replaced;
+
+	if (fstat(file->fd, &st) == -1 || stat(file->path, &pathst) == -1) {
+		return -1;
+	}
+	replaced = st.st_dev != pathst.st_dev || st.st_ino != pathst.st_ino;
+	if (replaced) {
+		newfd = open(file->path, file->map != NULL ? O_RDONLY : O_RDWR);
+		if (newfd == -1) {
 			return -1;
 		}
+		close(file->fd);
+		file->fd = newfd;
+		file->cache.fd = newfd;
+		if (file->wal != NULL) {
+			file->wal->fd = newfd;
+		}
+	}
+	/* Changes in place show up in the mapping by themselves, but the file
+	 * growing or being replaced doesn't */
+	if (file->map != NULL && (replaced ||
+	    (uint64_t) pathst.st_size != file->maplen) && datemap(file)) {
+		return -1;
+	}
+	if (file->wal != NULL && walsync(file->wal)) {
+		return -1;
+	}
+	cacheclear(&file->cache);
+	pathreset(file->cursor);
+	free(file->alloc);
+	file->alloc = NULL;
+
+	if (readat_header(file, 0, &header) || badheader(&header)) {
+		return -1;
+	}
+	file->bit1 = header.bit1;
+	file->bitn = header.bitn;
+	file->version = header.version;
+
+	mirrorreload(file);
+	indexclose(file);
+	return indexopen(file, file->map == NULL);
+}
+
+/* Reads hold the commit lock shared, so that no commit changes the file in
+ * the middle of one. It's only held for one call at a time, anything that
+ * lasts longer has to check the count of commits again instead. */
+static int beginread(datefile *file) {
+	int changed;
+	if (file->lock == NULL) {
+		return 0;
+	}
+	if (lockread(file->lock, &changed)) {
+		return -1;
+	}
+	if (changed && datesync(file)) {
+		unlockread(file->lock);
+		return -1;
 	}
-	fclose(tmp);
 	return 0;
 }
 
-#ifdef NREM_TESTS
-int datestest(int *passed, int *total) {
+static void endread(datefile *file) {
+	if (file->lock != NULL) {
+		unlockread(file->lock);
+	}
+}
+
+/* Changes hold the writer lock until they're committed */
+static int beginwrite(datefile *file) {
+	int changed;
+	if (file->lock == NULL || file->lock->writing) {
+		return 0;
+	}
+	if (lockwrite(file->lock, &changed)) {
+		return -1;
+	}
+	/* Even without any commits, the log could have been checkpointed */
+	if (changed ? datesync(file) :
+			file->wal != NULL && walsync(file->wal)) {
+		unlockwrite(file->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/* Lets the next writer in, unless there's still something to commit */
+static void endwrite(datefile *file) {
+	if (file->lock != NULL &&
+	    (file->wal == NULL || file->wal->len == 0)) {
+		unlockwrite(file->lock);
+	}
+}
+
+/* Commits hold the commit lock exclusively, and once they're done every
+ * other datefile knows to catch up if `changed` is set */
+static int begincommit(datefile *file) {
+	return file->lock == NULL ? 0 : lockcommit(file->lock);
+}
+
+static int endcommit(datefile *file, int changed) {
+	return file->lock == NULL ? 0 : unlockcommit(file->lock, changed);
+}
+
+/* Runs `commit` on the log of a file with the writer lock held */
+static int commitwal(datefile *file, int (*commit)(struct wal *wal)) {
+	int changed, ret;
+
+	if (file->wal == NULL) {
+		return 0;
+	}
+	changed = file->wal->len != 0;
+	if (begincommit(file)) {
+		return -1;
+	}
+	ret = commit(file->wal);
+	return endcommit(file, changed) || ret ? -1:0;
+}
+
+int dateopen(char *path, datefile *ret) {
+	struct df_header header;
+	char *log;
+	int changed, pending;
+
+	ret->fd = -1;
+	ret->map = NULL;
+	ret->maplen = 0;
+	ret->cursor = NULL;
+	ret->alloc = NULL;
+	ret->wal = NULL;
+	ret->mirror = NULL;
+	ret->index = NULL;
+	ret->lock = NULL;
+	ret->parallel = NULL;
+	cacheinit(&ret->cache, -1, 0);
+	if ((ret->path = strdup(path)) == NULL) {
+		return -1;
+	}
+
+	/* Nobody else can be creating the file, changing it, or replaying its
+	 * log while we open it */
+	if (openlock(ret, 1) || lockwrite(ret->lock, &changed) ||
+	    lockcommit(ret->lock)) {
+		goto error;
+	}
+	if ((ret->fd = open(path, O_RDWR)) == -1) {
+		if (datecreate(path, ret)) {
+			goto error;
+		}
+		pending = 1;
+	}
+	else {
+		if ((log = siblingpath(path, ".wal")) == NULL) {
+			goto error;
+		}
+		pending = walpending(log);
+		free(log);
+		if (cacheinit(&ret->cache, ret->fd, DATE_CACHE_PAGES) ||
+		    openwal(ret)) {
+			goto error;
+		}
+
+		/* The header is only worth reading after the log is
+		 * replayed */
+		if (readat_header(ret, 0, &header) || badheader(&header)) {
+			goto error;
+		}
+		ret->bit1 = header.bit1;
+		ret->bitn = header.bitn;
+		ret->version = header.version;
+		if (indexopen(ret, 1)) {
+			goto error;
+		}
+	}
+
+	/* Replaying the log could have changed the file */
+	if (unlockcommit(ret->lock, pending)) {
+		goto error;
+	}
+	unlockwrite(ret->lock);
+	return 0;
+error:
+	dateclose(ret);
+	return -1;
+}
+
+int dateopenro(char *path, datefile *ret) {
+	struct filestruct_buf buf;
+	struct df_header header;
+	char *log;
+	int changed;
+
+	ret->fd = -1;
+	ret->map = NULL;
+	ret->maplen = 0;
+	ret->cursor = NULL;
+	ret->alloc = NULL;
+	ret->wal = NULL;
+	ret->mirror = NULL;
+	ret->index = NULL;
+	ret->lock = NULL;
+	ret->parallel = NULL;
+	cacheinit(&ret->cache, -1, 0);
+	if ((ret->path = strdup(path)) == NULL) {
+		return -1;
+	}
+	/* Nothing can be committed while the file is mapped and the header is
+	 * read, after that every read takes the lock for itself */
+	if (openlock(ret, 0) || lockread(ret->lock, &changed)) {
+		goto error;
+	}
+
+	/* Until the log is replayed the file alone could be out of date, and
+	 * only a writable datefile can replay it. A writer that's still
+	 * around has already written everything in the log to the file,
+	 * whatever was left by a crash was replayed when it opened. */
+	if ((log = siblingpath(path, ".wal")) == NULL) {
+		goto error;
+	}
+	if (walpending(log) && !lockbusy(ret->lock)) {
+		free(log);
+		goto error;
+	}
+	free(log);
+
+	if ((ret->fd = open(path, O_RDONLY)) == -1 || datemap(ret)) {
+		goto error;
+	}
+	buf.data = ret->map;
+	buf.base = 0;
+	buf.len = ret->maplen;
+	buf.pos = 0;
+	if (breadheader(&header, &buf) || badheader(&header)) {
+		goto error;
+	}
+	ret->bit1 = header.bit1;
+	ret->bitn = header.bitn;
+	ret->version = header.version;
+
+	/* Everything comes from the mapping, there's no need for a cache */
+	if (cacheinit(&ret->cache, ret->fd, 0) || indexopen(ret, 0)) {
+		goto error;
+	}
+	unlockread(ret->lock);
+	return 0;
+error:
+	dateclose(ret);
+	return -1;
+}
+
+int dateclose(datefile *file) {
+	int changed, ret = 0;
+
+	if (file->map != NULL) {
+		munmap(file->map, (size_t) file->maplen);
+	}
+	/* Nothing left needs these to be up to date */
+	mirrorfree(file->mirror);
+	file->mirror = NULL;
+	parallelfree(file->parallel);
+	file->parallel = NULL;
+	if (file->wal != NULL) {
+		/* Checkpointing empties the log, which can't happen in the
+		 * middle of anybody else's commit */
+		changed = file->wal->len != 0;
+		if (file->lock != NULL && !file->lock->committing &&
+		    (beginwrite(file) || lockcommit(file->lock))) {
+			ret = -1;
+		}
+		if (walclose(file->wal)) {
+			ret = -1;
+		}
+		free(file->wal);
+		if (endcommit(file, changed)) {
+			ret = -1;
+		}
+	}
+	indexclose(file);
+	cachefree(&file->cache);
+	free(file->cursor);
+	free(file->alloc);
+	if (file->lock != NULL) {
+		lockclose(file->lock);
+		free(file->lock);
+	}
+	if (file->fd != -1 && close(file->fd) == -1) {
+		ret = -1;
+	}
+	free(file->path);
+	return ret;
+}
+
+int datesetcache(datefile *file, size_t pages) {
+	if (file->map != NULL) {
+		return -1;
+	}
+	return cacheresize(&file->cache, pages);
+}
+
+void datecachestats(datefile *file, uint64_t *hits, uint64_t *misses) {
+	*hits = file->cache.hits;
+	*misses = file->cache.misses;
+}
+
+/* How many subtrees per thread a parallel search aims for. Subtrees can be
+ * very different sizes, so a thread that got a big one shouldn't be the only
+ * one left working at the end. */
+#define PARALLEL_SPLIT 8
+
+struct dateparallel {
+	struct pool pool;
+	size_t split;
+	/* One per thread. Only the datefile's own cache hears about writes, so
+	 * these are emptied at the start of every search. */
+	struct pagecache *caches;
+};
+
+static void parallelfree(struct dateparallel *parallel) {
+	if (parallel == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < parallel->pool.nthreads; ++i) {
+		cachefree(parallel->caches + i);
+	}
+	poolfree(&parallel->pool);
+	free(parallel->caches);
+	free(parallel);
+}
+
+int datesetparallel(datefile *file, int threads, int split) {
+	struct dateparallel *parallel;
+
+	if (threads < 1 || split < 0) {
+		return -1;
+	}
+	parallelfree(file->parallel);
+	file->parallel = NULL;
+	if (threads == 1) {
+		return 0;
+	}
+
+	if ((parallel = malloc(sizeof *parallel)) == NULL) {
+		return -1;
+	}
+	parallel->split = split == 0 ? PARALLEL_SPLIT : (size_t) split;
+	parallel->caches = malloc((size_t) threads * sizeof *parallel->caches);
+	if (parallel->caches == NULL) {
+		goto errorcaches;
+	}
+	/* Searches size these like the datefile's cache when they start */
+	for (int i = 0; i < threads; ++i) {
+		cacheinit(parallel->caches + i, file->fd, 0);
+	}
+	if (poolinit(&parallel->pool, (size_t) threads)) {
+		goto errorpool;
+	}
+	file->parallel = parallel;
+	return 0;
+errorpool:
+	free(parallel->caches);
+errorcaches:
+	free(parallel);
+	return -1;
+}
+
+static int dateinit(int fd, uint8_t version, uint64_t *rootret) {
+	struct filestruct_io io = fdio(&fd);
+	struct df_header header;
+	uint64_t root, align;
+
+	io.little = islittle(version);
+	memcpy(header.magic, "datefile", sizeof header.magic);
+	header.bit1 = 0; /* to be overwritten later */
+	header.bitn = 64;
+	header.version = version;
+	header.meta = 0;
+	memset(header.reserved, 0, sizeof header.reserved);
+
+	if (write_df_header(&header, 0, &io) == -1) {
+		return -1;
+	}
+
+	/* The root goes right after the header */
+	align = recordalign(version);
+	root = (size_df_header(&header) + align - 1) / align * align;
+	if (version != DF_VERSION_BINARY) {
+		struct df_cnode bit1 = {0};
+		uint64_t end = root + sizeof(struct df_cnode_layout) +
+			8 * DF_SLOTS_MAX;
+		/* The root has room for every slot so it never has to move */
+		bit1.size = DF_SLOTS_MAX;
+		if (write_df_cnode(&bit1, root, &io) == -1 ||
+		    io.write(io.ctx, end - 1, "", 1) == -1) {
+			return -1;
+		}
+	}
+	else {
+		struct df_node bit1 = {0};
+		if (write_df_node(&bit1, root, &io) == -1) {
+			return -1;
+		}
+	}
+
+	if (writeu64at(&io, header.bit1_pos, root) == -1) {
+		return -1;
+	}
+	*rootret = root;
+	return 0;
+}
+
+/* Fills in the rest of a datefile for a new file at `path`. On failure the
+ * datefile still has to be closed. */
+static int datecreate(char *path, datefile *ret) {
+	uint64_t bit1;
+
+	if ((ret->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1 ||
+	    dateinit(ret->fd, DF_VERSION_LATEST, &bit1)) {
+		return -1;
+	}
+
+	ret->bit1 = bit1;
+	ret->bitn = 64;
+	ret->version = DF_VERSION_LATEST;
+
+	if (cacheinit(&ret->cache, ret->fd, DATE_CACHE_PAGES)) {
+		return -1;
+	}
+
+	/* A log left behind by an older file of the same name must not be
+	 * replayed over this one, and neither can an index of one be used */
+	if (unlinksibling(path, ".wal") || unlinksibling(path, ".idx")) {
+		return -1;
+	}
+	return openwal(ret) || indexopen(ret, 1) ? -1:0;
+}
+
+static struct datepath *getcursor(datefile *file) {
+	if (file->cursor == NULL) {
+		if ((file->cursor = malloc(sizeof *file->cursor)) == NULL) {
+			return NULL;
+		}
+		pathreset(file->cursor);
+	}
+	return file->cursor;
+}
+
+static int pathseek(datefile *file, struct datepath *path,
+		uint64_t prefix, int precision) {
+	int bits = nodebits(file);
+	int common;
+
+	if (path->len == 0) {
+		if (readnode(file, file->bit1, &path->nodes[0].node)) {
+			return -1;
+		}
+		path->nodes[0].depth = 0;
+		path->len = 1;
+		path->prefix = 0;
+	}
+
+	/* Back up to the longest common prefix of where we are and where we're
+	 * going. Timestamps are left aligned, so this is just the number of
+	 * leading zeros. */
+	common = path->prefix == prefix ? 64 :
+		__builtin_clzll(path->prefix ^ prefix);
+	if (common > precision) {
+		common = precision;
+	}
+	while (path->nodes[path->len-1].depth > common) {
+		--path->len;
+	}
+
+	for (;;) {
+		struct treenode *node = &path->nodes[path->len-1].node;
+		int depth = path->nodes[path->len-1].depth;
+		struct treenode *child = &path->nodes[path->len].node;
+		int index, skip, cdepth, limit, matched;
+		uint64_t next, wanted, have;
+
+		/* The prefix goes in this node's list */
+		if (precision < depth + bits) {
+			break;
+		}
+
+		index = (int) keybits(file, prefix, depth, depth+bits);
+		next = node->child[index];
+
+		/* If the next node down doesn't exist yet, create it at the
+		 * end of the file. Path compressed files only need one node
+		 * for the rest of the way down. */
+		if (next == 0) {
+			emptynode(child);
+			if (file->version != DF_VERSION_BINARY) {
+				cdepth = precision - precision % bits;
+				child->skip = cdepth - depth - bits;
+				child->key = keybits(file, prefix, depth+bits,
+						cdepth);
+			}
+			if (newnode(file, node, child)) {
+				return -1;
+			}
+			goto link;
+		}
+
+		if (readnode(file, next, child)) {
+			return -1;
+		}
+		skip = child->skip;
+		cdepth = depth + bits + skip;
+
+		/* Compare as many of the skipped bits as we can */
+		limit = (cdepth < precision ? cdepth : precision) - depth - bits;
+		wanted = keybits(file, prefix, depth+bits, depth+bits+limit);
+		have = child->key >> (skip - limit);
+		if (wanted == have && cdepth <= precision) {
+			path->nodes[path->len++].depth = cdepth;
+			continue;
+		}
+
+		/* The prefix ends or diverges partway through the child's
+		 * skip, so split the skip with a new node where that
+		 * happens (or just before, nodes only go at multiples of
+		 * `bits`) */
+		struct treenode old = *child;
+		int oldindex;
+		matched = wanted == have ? limit :
+			limit - (64 - __builtin_clzll(wanted ^ have));
+		matched -= matched % bits;
+
+		/* Everything the old node counted is under one child of the
+		 * new one */
+		emptynode(child);
+		child->skip = matched;
+		child->key = old.key >> (skip - matched);
+		oldindex = (int) ((old.key >> (skip - matched - bits)) &
+				fill1(bits));
+		child->child[oldindex] = old.offset;
+		child->starts[oldindex] = countsum(old.starts);
+		child->ends[oldindex] = countsum(old.ends);
+		old.skip = skip - matched - bits;
+		old.key &= fill1(old.skip);
+		if (writenode(file, old.offset, &old) ||
+		    newnode(file, node, child)) {
+			return -1;
+		}
+
+link:
+		/* Update the old node */
+		if (nodeset(file, path->len > 1 ?
+				&path->nodes[path->len-2].node : NULL,
+				node, DF_SLOT_CHILD + index, child->offset)) {
+			return -1;
+		}
+		path->nodes[path->len].depth = depth + bits + child->skip;
+		++path->len;
+	}
+
+	path->prefix = prefix & ~fill1(file->bitn - precision);
+	path->precision = precision;
+	return 0;
+}
+
+static int pathaddevent(datefile *file, struct datepath *path,
+		uint64_t dataptr, uint64_t nextsmptr, uint64_t *newnextsmptr) {
+	struct treenode *node = &path->nodes[path->len-1].node;
+	struct treenode *parent = path->len > 1 ?
+		&path->nodes[path->len-2].node : NULL;
+	int depth = path->nodes[path->len-1].depth;
+	int list = listindex(path->precision - depth, keybits(file,
+				path->prefix, depth, path->precision));
+	int slot = DF_SLOT_EVENT + list;
+	uint64_t head = node->event[list];
+	struct df_event event;
+
+	/* Create a new event struct. A list the node has no slot for yet gets
+	 * one after, which points the event back at it. */
+	event.next = head;
+	event.prev = hasslot(file, node, slot) ? slotpos(file, node, slot) : 0;
+	event.nextsm = nextsmptr;
+	event.ptr = dataptr;
+	memset(event.reserved, 0, sizeof event.reserved);
+
+	/* Write event data */
+	if (newevent(file, &event) == -1) {
+		return -1;
+	}
+	/* Get new nextsm */
+	*newnextsmptr = event.offset;
+
+	/* Update the old timestamp head's prev value */
+	if (head != 0 &&
+	    write64at(file, head + 8, event.offset)) {
+		return -1;
+	}
+
+	/* Update timestamp head pointer */
+	return nodeset(file, parent, node, slot, event.offset);
+}
+
+static int pathcount(datefile *file, struct datepath *path,
+		uint64_t start, uint64_t end) {
+	int first = path->prefix == start;
+	int last = (path->prefix |
+			fill1(file->bitn - path->precision)) == end;
+
+	if (file->version == DF_VERSION_BINARY || (!first && !last)) {
+		return 0;
+	}
+	for (int i = 0; i < path->len; ++i) {
+		struct treenode *node = &path->nodes[i].node;
+		struct treenode *parent = i > 0 ? &path->nodes[i-1].node : NULL;
+		int depth = path->nodes[i].depth;
+		int slot;
+		if (first) {
+			slot = countslot(file, start, depth);
+			if (nodeset(file, parent, node, DF_SLOT_STARTS + slot,
+					node->starts[slot] + 1)) {
+				return -1;
+			}
+		}
+		if (last) {
+			slot = countslot(file, end, depth);
+			if (nodeset(file, parent, node, DF_SLOT_ENDS + slot,
+					node->ends[slot] + 1)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int coverrange(uint64_t start, uint64_t end,
+		int (*report)(uint64_t prefix, int precision, void *arg),
+		void *arg) {
+	uint64_t lower = start;
+
+	/* Some dark magic I thought of at midnight while trying to go to
+	 * sleep. This code generates the smallest possible set of binary string
+	 * prefixes that fully encompasses a range. Here's how it works:
+	 *
+	 * Let's simplify this problem and try to find the smallest set of
+	 * prefixes that goes from some number `n` to 0xffffff... Let's say,
+	 * for example, n=0b00110100
+	 *
+	 * You can find the lower bound of a binary string prefix by setting all
+	 * the non-captured bits to zero and the upper bound by setting all the
+	 * non-captured bits to one. Since we only care about the lower bound,
+	 * we want the largest possible prefix where all the non-captured bits
+	 * are already zero. In this case, 0b00110100/6
+	 *
+	 * That string captures 0b00110100-0b00110111 inclusive. Now the goal is
+	 * to find the set of prefixes that capture 0b00111000-0b11111111. In
+	 * this case, that's 0b00111000/5.
+	 *
+	 * We can continue on like this forever. That last group captures
+	 * 0b00111000-0b00111111, so our next prefix has to start at 0b01000000.
+	 * Algorithmically, the next prefix is always the least precise prefix
+	 * where the non-captured bits of the lower bound are all zero. Then,
+	 * we fill the non-captured bits with ones, add one, and that's the new
+	 * lower bound. The naive code looks like this:
+	 *
+	 * 	uint64_t lower = start;
+	 * 	for (;;) {
+	 * 		uint64_t bit = 1;
+	 * 		int precision = 64;
+	 *
+	 * 		// While the iterated bit is zero
+	 * 		while (lower ^ bit > lower) {
+	 *			// For efficiency, we fill the uncaptured bits
+	 *			// with ones as we check them
+	 *			lower ^= bit;
+	 *
+	 * 			// Iterate to the next bit
+	 *			bit <<= 1;
+	 *			--precision;
+	 * 		}
+	 * 		
+	 * 		report_prefix(lower, precision);
+	 * 		++lower;
+	 * 	}
+	 *
+	 * This runs in O(b^2) time where b is the width of the integer,
+	 * because for each prefix we may loop b times, and there may be b
+	 * prefixes. This can be seen in the prefixes for 0x1-0xffffff...
+	 *
+	 * The code below gets that down to O(b) by remembering the size of the
+	 * previous prefix instead of starting from scratch every time. The
+	 * prefixes only ever get bigger until one of them bumps into `end`,
+	 * after which they only ever get smaller:
+	 *
+	 *   - While growing, adding a block of size 2^k to a lower bound
+	 *     that's aligned to 2^k but not 2^(k+1) makes it aligned to
+	 *     2^(k+1), so we just check whether the next size up fits.
+	 *   - Once a prefix is limited by `end`, every later lower bound is
+	 *     aligned to anything that fits, so we only ever shrink.
+	 *
+	 * The size only goes up b times and down b times in total. We also
+	 * report the lower bound with the uncaptured bits set to zero rather
+	 * than one, which is what the tree code wants anyways.
+	 * */
+	int bits = 0; /* The prefix captures 2^bits timestamps */
+
+	if (start > end) {
+		return 0;
+	}
+
+	for (;;) {
+		/* Grow while the lower bound is aligned and we fit */
+		while (bits < 64 && (lower & fill1(bits+1)) == 0 &&
+				fill1(bits+1) <= end - lower) {
+			++bits;
+		}
+		/* Shrink until we fit */
+		while (fill1(bits) > end - lower) {
+			--bits;
+		}
+
+		/* Report a prefix */
+		if (report(lower, 64-bits, arg)) {
+			return -1;
+		}
+
+		/* Checking this way avoids overflowing at 0xffffff... */
+		if (fill1(bits) == end - lower) {
+			return 0;
+		}
+		lower += fill1(bits) + 1;
+	}
+}
+
+/* Writes the data for an event, and sets the event's id */
+static int writeeventdata(datefile *file, struct event *event,
+		struct df_event_data *data) {
+	data->functions = 0;
+	data->firstev = 0;
+	data->start = event->start;
+	data->end = event->end;
+	data->name_len = strlen(event->name);
+	data->name = event->name;
+
+	if (newdata(file, data) == -1) {
+		return -1;
+	}
+	event->id = data->offset;
+	return 0;
+}
+
+struct addarg {
+	datefile *file;
+	struct datepath *cursor;
+	uint64_t id;
+	uint64_t nextsmptr;
+	uint64_t start;
+	uint64_t end;
+};
+
+static int addprefix(uint64_t prefix, int precision, void *arg) {
+	struct addarg *add = arg;
+	if (pathseek(add->file, add->cursor, prefix, precision) ||
+	    pathaddevent(add->file, add->cursor,
+			add->id, add->nextsmptr, &add->nextsmptr) ||
+	    pathcount(add->file, add->cursor, add->start, add->end)) {
+		/* We don't know what made it to the disk */
+		pathreset(add->cursor);
+		return -1;
+	}
+	return 0;
+}
+
+int datecommit(datefile *file) {
+	int ret;
+
+	/* Nothing can be waiting without the writer lock */
+	if (file->wal == NULL ||
+	    (file->lock != NULL && !file->lock->writing)) {
+		return 0;
+	}
+	ret = commitwal(file, walcommit);
+	endwrite(file);
+	return ret;
+}
+
+/* Commits on its own once enough has changed, so that callers which never
+ * commit still only hold a bounded number of pages in the log */
+static int groupcommit(datefile *file) {
+	if (file->wal == NULL || file->wal->len < WAL_GROUP_PAGES) {
+		return 0;
+	}
+	return commitwal(file, walcommit);
+}
+
+static int addevent(struct event *event, datefile *file) {
+	struct df_event_data data;
+	struct addarg add;
+	int ret;
+
+	if (file->bitn > 64 || file->map != NULL || indexdrop(file)) {
+		return -1;
+	}
+
+	if ((add.cursor = getcursor(file)) == NULL ||
+	    setaside(file, event)) {
+		return -1;
+	}
+
+	/* Write event data */
+	ret = -1;
+	if (writeeventdata(file, event, &data)) {
+		goto end;
+	}
+
+	add.file = file;
+	add.id = event->id;
+	add.nextsmptr = 0;
+	add.start = su64(event->start);
+	add.end = su64(event->end);
+	if (coverrange(add.start, add.end, addprefix, &add)) {
+		goto end;
+	}
+
+	/* Set event data head */
+	ret = write64at(file, data.firstev_pos, add.nextsmptr) ||
+		bumpgeneration(file) || groupcommit(file) ? -1:0;
+end:
+	putaside(file);
+	mirrorchanged(file, ret, su64(event->start), su64(event->end), 0);
+	return ret;
+}
+
+int dateadd(struct event *event, datefile *file) {
+	int ret;
+	if (file->map != NULL || beginwrite(file)) {
+		return -1;
+	}
+	ret = addevent(event, file);
+	endwrite(file);
+	return ret;
+}
+
+/* A prefix that some event in a batch has to be added to */
+struct batchprefix {
+	uint64_t prefix;
+	int precision;
+	size_t event;
+};
+
+struct batcharg {
+	struct batchprefix *prefixes;
+	size_t len;
+	size_t alloc;
+	size_t event;
+};
+
+static int batchprefix(uint64_t prefix, int precision, void *arg) {
+	struct batcharg *batch = arg;
+	if (batch->len >= batch->alloc) {
+		struct batchprefix *newprefixes;
+		size_t newalloc = batch->alloc * 2;
+		newprefixes = realloc(batch->prefixes,
+				newalloc * sizeof *newprefixes);
+		if (newprefixes == NULL) {
+			return -1;
+		}
+		batch->prefixes = newprefixes;
+		batch->alloc = newalloc;
+	}
+	batch->prefixes[batch->len].prefix = prefix;
+	batch->prefixes[batch->len].precision = precision;
+	batch->prefixes[batch->len].event = batch->event;
+	++batch->len;
+	return 0;
+}
+
+/* Sorting by prefix and then precision puts the prefixes in the order a depth
+ * first walk of the tree would visit them */
+static int cmpprefix(const void *a, const void *b) {
+	const struct batchprefix *pa = a, *pb = b;
+	if (pa->prefix != pb->prefix) {
+		return pa->prefix < pb->prefix ? -1:1;
+	}
+	if (pa->precision != pb->precision) {
+		return pa->precision < pb->precision ? -1:1;
+	}
+	return 0;
+}
+
+/* Bounds the memory used for prefixes in a batch. An event never has more than
+ * 128 prefixes, so we always make progress. */
+#define BATCH_PREFIXES (1 << 16)
+
+static int addbatch(struct event *events, size_t n, datefile *file) {
+	struct batcharg batch;
+	struct datepath *cursor;
+	struct df_event_data *data;
+	uint64_t *nextsm;
+	size_t first;
+	int ret;
+
+	if (file->bitn > 64 || file->map != NULL || indexdrop(file)) {
+		return -1;
+	}
+
+	ret = -1;
+	batch.alloc = 256;
+	batch.prefixes = malloc(batch.alloc * sizeof *batch.prefixes);
+	data = malloc(n * sizeof *data);
+	nextsm = calloc(n, sizeof *nextsm);
+	if (batch.prefixes == NULL || data == NULL || nextsm == NULL ||
+	    (cursor = getcursor(file)) == NULL) {
+		goto end;
+	}
+
+	for (first = 0; first < n;) {
+		size_t last;
+
+		/* Gather the prefixes for as many events as we can */
+		batch.len = 0;
+		for (last = first; last < n &&
+				batch.len < BATCH_PREFIXES; ++last) {
+			if (writeeventdata(file, events + last, data + last)) {
+				goto end;
+			}
+			batch.event = last;
+			if (coverrange(su64(events[last].start),
+						su64(events[last].end),
+						batchprefix, &batch)) {
+				goto end;
+			}
+		}
+
+		/* Add them all in one walk of the tree */
+		qsort(batch.prefixes, batch.len, sizeof *batch.prefixes,
+				cmpprefix);
+		for (size_t i = 0; i < batch.len; ++i) {
+			struct batchprefix *prefix = batch.prefixes + i;
+			if (pathseek(file, cursor,
+					prefix->prefix, prefix->precision) ||
+			    pathaddevent(file, cursor,
+					events[prefix->event].id,
+					nextsm[prefix->event],
+					nextsm + prefix->event) ||
+			    pathcount(file, cursor,
+					su64(events[prefix->event].start),
+					su64(events[prefix->event].end))) {
+				pathreset(cursor);
+				goto end;
+			}
+		}
+
+		/* Set event data heads */
+		for (; first < last; ++first) {
+			if (write64at(file, data[first].firstev_pos,
+						nextsm[first]) == -1) {
+				goto end;
+			}
+		}
+		if (bumpgeneration(file) || groupcommit(file)) {
+			goto end;
+		}
+	}
+
+	ret = 0;
+end:
+	free(batch.prefixes);
+	free(data);
+	free(nextsm);
+	mirrorreload(file);
+	return ret;
+}
+#undef BATCH_PREFIXES
+
+int dateaddbatch(struct event *events, size_t n, datefile *file) {
+	int ret;
+	if (file->map != NULL || beginwrite(file)) {
+		return -1;
+	}
+	ret = addbatch(events, n, file);
+	endwrite(file);
+	return ret;
+}
+
+static struct eventlist *neweventlist(void) {
+	struct eventlist *ret;
+	if ((ret = malloc(sizeof *ret)) == NULL) {
+		return NULL;
+	}
+	ret->len = 0;
+	ret->alloc = 20;
+	ret->names = NULL;
+	ret->nameslen = 0;
+	ret->namesalloc = 0;
+	if ((ret->events = malloc(ret->alloc * sizeof *ret->events)) == NULL) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/* Makes room for one more event at the end of `events` */
+static struct event *newresult(struct eventlist *events) {
+	if (events->len >= events->alloc) {
+		struct event *newevents;
+		size_t newalloc = events->alloc * 2;
+		newevents = realloc(events->events,
+				newalloc * sizeof *newevents);
+		if (newevents == NULL) {
+			return NULL;
+		}
+		events->alloc = newalloc;
+		events->events = newevents;
+	}
+	return events->events + events->len;
+}
+
+/* Makes room for a name `len` bytes long and its terminator at the end of the
+ * names of `events`. The names move when there isn't room, so the events
+ * already in the list are pointed at their new place. */
+static char *resultname(struct eventlist *events, uint64_t len) {
+	char *ret;
+
+	if (len >= SIZE_MAX / 2 - events->nameslen) {
+		return NULL;
+	}
+	if (events->nameslen + len + 1 > events->namesalloc) {
+		char *newnames;
+		size_t newalloc = events->namesalloc == 0 ?
+			256 : events->namesalloc * 2;
+		while (newalloc < events->nameslen + len + 1) {
+			newalloc *= 2;
+		}
+		if ((newnames = malloc(newalloc)) == NULL) {
+			return NULL;
+		}
+		if (events->nameslen > 0) {
+			memcpy(newnames, events->names, events->nameslen);
+		}
+		for (size_t i = 0; i < events->len; ++i) {
+			events->events[i].name = newnames +
+				(events->events[i].name - events->names);
+		}
+		free(events->names);
+		events->names = newnames;
+		events->namesalloc = newalloc;
+	}
+	ret = events->names + events->nameslen;
+	events->nameslen += (size_t) len + 1;
+	return ret;
+}
+
+/* readat_event_data, but leaves out the name so that addresult can read it
+ * straight into a list. `name` is NULL afterwards. */
+static int readdatafields(datefile *file, uint64_t ptr,
+		struct df_event_data *ret) {
+	union {
+		struct df_event_data_native native;
+		unsigned char data[sizeof(struct df_event_data_layout)];
+	} stack;
+	const struct df_event_data_native *native;
+	struct filestruct_buf buf;
+	uint64_t start, end;
+
+	if (file->map != NULL) {
+		buf = mapbuf(file, ptr);
+	}
+	else {
+		/* The layout of event data is everything before the name */
+		if (readat(file, ptr, stack.data, sizeof stack.data)) {
+			return -1;
+		}
+		buf.data = stack.data;
+		buf.base = ptr;
+		buf.len = sizeof stack.data;
+		buf.pos = 0;
+		buf.little = islittle(file->version);
+	}
+
+	ret->offset = ptr;
+	ret->name_pos = ptr + offsetof(struct df_event_data_layout, name);
+	ret->name = NULL;
+	if ((native = view_df_event_data(&buf)) != NULL) {
+		ret->functions = native->functions;
+		ret->firstev = native->firstev;
+		ret->start = native->start;
+		ret->end = native->end;
+		ret->name_len = native->name_len;
+		return 0;
+	}
+
+	/* The fields in the order of event_data above */
+	if (breadu64(&ret->functions, &buf) ||
+	    breadu64(&ret->firstev, &buf) ||
+	    breadu64(&start, &buf) ||
+	    breadu64(&end, &buf) ||
+	    breadu64(&ret->name_len, &buf)) {
+		return -1;
+	}
+	ret->start = buf.little ? (int64_t) start : us64(start);
+	ret->end = buf.little ? (int64_t) end : us64(end);
+	return 0;
+}
+
+/* Adds the event with the data in `data` from readdatafields to `events`,
+ * reading its name into the names of the list. Names can't be left in the
+ * mapping of a read only file, since a commit could change them as soon as
+ * the read is over. */
+static int addresult(datefile *file, struct df_event_data *data,
+		struct eventlist *events) {
+	uint64_t namepos = data->name_pos + 8;
+	struct event *event;
+	char *name;
+
+	if ((event = newresult(events)) == NULL ||
+	    (name = resultname(events, data->name_len)) == NULL) {
+		return -1;
+	}
+	if (readat(file, namepos, name, (size_t) data->name_len)) {
+		events->nameslen -= (size_t) data->name_len + 1;
+		return -1;
+	}
+	name[data->name_len] = '\0';
+
+	event->start = data->start;
+	event->end = data->end;
+	event->name = name;
+	event->id = data->offset;
+	++events->len;
+	return 0;
+}
+
+/* Catches an event list that goes around in a circle, which only a broken
+ * file has, so that going through it fails instead of never ending. This is
+ * Brent's algorithm: the list loops if it comes back to the event it was at
+ * the last time the number of steps hit a power of two. */
+struct loopcheck {
+	uint64_t saved;
+	uint64_t steps;
+	uint64_t power;
+};
+
+static inline void loopinit(struct loopcheck *check) {
+	check->saved = 0;
+	check->steps = 0;
+	check->power = 1;
+}
+
+/* Takes a step to `ptr`. Returns -1 if the list has been there before. */
+static inline int loopstep(struct loopcheck *check, uint64_t ptr) {
+	if (ptr != 0 && ptr == check->saved) {
+		return -1;
+	}
+	if (++check->steps == check->power) {
+		check->saved = ptr;
+		check->steps = 0;
+		check->power *= 2;
+	}
+	return 0;
+}
+
+/* The ids a search has found so far, as an open addressing hash set kept at
+ * most half full. 0 marks an empty slot, no event data is ever at offset 0. An
+ * event is in the list of every prefix it covers, so a search of the tree finds
+ * most of them many times over. */
+struct seenset {
+	uint64_t *ids;
+	size_t size;
+	size_t len;
+};
+
+static size_t seenhash(struct seenset *seen, uint64_t id) {
+	return (size_t) ((id * 0x9e3779b97f4a7c15llu) >> 32) &
+		(seen->size - 1);
+}
+
+/* Adds `id` to the set. Returns 1 if it was already there, 0 if it wasn't, and
+ * -1 on failure. */
+static int seenadd(struct seenset *seen, uint64_t id) {
+	size_t i;
+
+	if ((seen->len + 1) * 2 > seen->size) {
+		uint64_t *old = seen->ids;
+		size_t oldsize = seen->size;
+		size_t newsize = oldsize == 0 ? 64 : oldsize * 2;
+		if ((seen->ids = calloc(newsize, sizeof *old)) == NULL) {
+			seen->ids = old;
+			return -1;
+		}
+		seen->size = newsize;
+		for (size_t j = 0; j < oldsize; ++j) {
+			if (old[j] == 0) {
+				continue;
+			}
+			i = seenhash(seen, old[j]);
+			while (seen->ids[i] != 0) {
+				i = (i + 1) & (newsize - 1);
+			}
+			seen->ids[i] = old[j];
+		}
+		free(old);
+	}
+
+	i = seenhash(seen, id);
+	while (seen->ids[i] != 0) {
+		if (seen->ids[i] == id) {
+			return 1;
+		}
+		i = (i + 1) & (seen->size - 1);
+	}
+	seen->ids[i] = id;
+	++seen->len;
+	return 0;
+}
+
+/* The most nodes a walk of the tree can be in at once, one per bit of the
+ * prefix and the root */
+#define SEARCH_DEPTH 65
+
+/* A node that a search is going through. `next` counts through the event
+ * lists of the node and then its children. */
+struct searchframe {
+	struct treenode node;
+	uint64_t prefix;
+	int precision;
+	int next;
+};
+
+struct datesearch {
+	datefile *file;
+	uint64_t start;
+	uint64_t end;
+	/* datesearchmulti only goes through the parts of start-end that are in
+	 * one of its ranges */
+	struct daterange *ranges;
+	size_t nranges;
+
+	/* Searches of the index go through its entries in order, and don't
+	 * need the seen set because every event is in there once */
+	int useindex;
+	uint64_t indexpos;
+	uint64_t indexcount;
+
+	/* Searches of the tree go through it depth first, one event list at a
+	 * time. `iter` is the next event in the current list, 0 if there
+	 * isn't one. */
+	struct searchframe stack[SEARCH_DEPTH];
+	int depth;
+	uint64_t iter;
+	struct loopcheck loop;
+	struct seenset seen;
+
+	/* The name of the last event */
+	char *name;
+	size_t namealloc;
+
+	/* Searches from datesearchopen hand out their events from here. A
+	 * search split between threads finds all of them when it's opened,
+	 * any other one finds SEARCH_BATCH at a time. NULL for searches inside
+	 * dates.c. */
+	struct eventlist *found;
+	size_t foundpos;
+	int done;                   /* Whether `found` has all that's left */
+
+	/* The file can change between batches, and then the search starts
+	 * over. It can only tell which events it already found if the file
+	 * is the same one. */
+	uint64_t commits;
+	dev_t dev;
+	ino_t ino;
+};
+
+/* How many events a search from datesearchopen finds with the commit lock
+ * held, before it gives it back */
+#define SEARCH_BATCH 256
+
+/* Finds the first of `n` sorted ranges that doesn't end before `time` */
+static size_t firstrange(struct daterange *ranges, size_t n, uint64_t time) {
+	size_t low = 0, high = n;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (su64(ranges[mid].end) < time) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/* Whether a search could find events between `early` and `late` */
+static int searchoverlaps(struct datesearch *search,
+		uint64_t early, uint64_t late) {
+	size_t i;
+	if (early > search->end || late < search->start) {
+		return 0;
+	}
+	if (search->ranges == NULL) {
+		return 1;
+	}
+	i = firstrange(search->ranges, search->nranges, early);
+	return i < search->nranges && su64(search->ranges[i].start) <= late;
+}
+
+/* Starts going through the node at `ptr` if it could have events in the search
+ * range */
+static int searchpush(struct datesearch *search, uint64_t ptr,
+		uint64_t prefix, int precision) {
+	datefile *file = search->file;
+	struct searchframe *frame;
+	uint64_t early, late;
+	int bits = nodebits(file);
+
+	/* Sanitize invalid pointers */
+	if (ptr == 0) {
+		return 0;
+	}
+
+	/* Earliest and latest possible times given the current prefix and
+	 * precision */
+	early = prefix;
+	late = prefix | fill1(file->bitn-precision);
+	if (!searchoverlaps(search, early, late)) {
+		return 0;
+	}
+
+	if (search->depth >= SEARCH_DEPTH) {
+		return -1;
+	}
+	frame = search->stack + search->depth;
+	if (readlinks(file, ptr, &frame->node) == -1) {
+		return -1;
+	}
+
+	/* Sanity check */
+	if (precision + frame->node.skip > file->bitn ||
+	    (precision + frame->node.skip) % bits != 0) {
+		return -1;
+	}
+
+	/* Path compressed nodes know more of the prefix than we do, which
+	 * might put them out of bounds after all */
+	if (frame->node.skip != 0) {
+		precision += frame->node.skip;
+		prefix |= frame->node.key << (file->bitn - precision);
+		early = prefix;
+		late = prefix | fill1(file->bitn-precision);
+		if (!searchoverlaps(search, early, late)) {
+			return 0;
+		}
+	}
+
+	frame->prefix = prefix;
+	frame->precision = precision;
+	frame->next = 0;
+	++search->depth;
+	return 0;
+}
+
+/* Whether event list `i` of the node in `frame` has anything in it that could
+ * be in range. Lists for longer prefixes than the node's might not be. */
+static int searchlist(struct datesearch *search, struct searchframe *frame,
+		int i) {
+	datefile *file = search->file;
+	uint64_t early, late, subkey;
+	int sublen = 0, shift;
+
+	if (frame->node.event[i] == 0) {
+		return 0;
+	}
+	while ((2 << sublen) - 1 <= i) {
+		++sublen;
+	}
+	subkey = (uint64_t) (i - listindex(sublen, 0));
+	shift = file->bitn - frame->precision - sublen;
+	/* The root's own list has no key, and shifting by 64 is undefined */
+	early = frame->prefix | (shift >= 64 ? 0 : subkey << shift);
+	late = early | fill1(shift);
+	return searchoverlaps(search, early, late);
+}
+
+/* Finds the next event list or child of the node on top of the stack that is
+ * in range. Returns 0 once the whole tree has been gone through. */
+static int searchstep(struct datesearch *search) {
+	datefile *file = search->file;
+	int bits = nodebits(file);
+	int lists = (1 << bits) - 1;
+
+	while (search->depth > 0) {
+		struct searchframe *frame = search->stack + search->depth - 1;
+		int next = frame->next++;
+
+		if (next < lists) {
+			if (searchlist(search, frame, next)) {
+				search->iter = frame->node.event[next];
+				loopinit(&search->loop);
+				return 1;
+			}
+			continue;
+		}
+
+		/* Then the children, with `bits` more bits of precision */
+		if (next < lists + (1 << bits) &&
+		    frame->precision < file->bitn) {
+			uint64_t i = (uint64_t) (next - lists);
+			if (searchpush(search, frame->node.child[i],
+					frame->prefix | (i << (file->bitn -
+						frame->precision - bits)),
+					frame->precision + bits)) {
+				return -1;
+			}
+			continue;
+		}
+		--search->depth;
+	}
+	return 0;
+}
+
+/* Starts a search from the top of the index or the tree */
+static int searchstart(struct datesearch *search) {
+	datefile *file = search->file;
+
+	search->depth = 0;
+	search->iter = 0;
+	search->useindex = indexusable(file);
+	if (search->useindex) {
+		indexstart(search);
+		return 0;
+	}
+	return searchpush(search, file->bit1, 0, 0);
+}
+
+/* datesearchopen, but always on the calling thread and all within one read */
+static struct datesearch *searchopen(datefile *file,
+		int64_t start, int64_t end) {
+	struct datesearch *ret;
+
+	if ((ret = malloc(sizeof *ret)) == NULL) {
+		return NULL;
+	}
+	ret->file = file;
+	ret->start = su64(start);
+	ret->end = su64(end);
+	ret->ranges = NULL;
+	ret->nranges = 0;
+	ret->depth = 0;
+	ret->iter = 0;
+	ret->seen.ids = NULL;
+	ret->seen.size = 0;
+	ret->seen.len = 0;
+	ret->name = NULL;
+	ret->namealloc = 0;
+	ret->found = NULL;
+	ret->foundpos = 0;
+	ret->done = 0;
+	ret->commits = 0;
+	if (searchstart(ret)) {
+		datesearchclose(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/* Reads the event data at `ptr` into `ret` */
+static int searchread(struct datesearch *search, uint64_t ptr,
+		struct event *ret) {
+	datefile *file = search->file;
+	struct df_event_data data;
+	uint64_t namepos;
+
+	if (readdatafields(file, ptr, &data)) {
+		return -1;
+	}
+	namepos = data.name_pos + 8;
+	if (data.name_len >= search->namealloc) {
+		char *newname;
+		size_t newalloc = (size_t) data.name_len + 1;
+		if (data.name_len >= SIZE_MAX ||
+		    (newname = realloc(search->name, newalloc)) == NULL) {
+			return -1;
+		}
+		search->name = newname;
+		search->namealloc = newalloc;
+	}
+	if (readat(file, namepos, search->name, (size_t) data.name_len)) {
+		return -1;
+	}
+	search->name[data.name_len] = '\0';
+	ret->name = search->name;
+	ret->start = data.start;
+	ret->end = data.end;
+	ret->id = ptr;
+	return 0;
+}
+
+/* Finds the event data of the next event, the same way datesearchnext does */
+static int searchnextdata(struct datesearch *search, uint64_t *ret) {
+	int status;
+
+	if (search->useindex) {
+		return indexnext(search, ret);
+	}
+
+	for (;;) {
+		struct df_event rawevent;
+		if (search->iter == 0) {
+			if ((status = searchstep(search)) != 1) {
+				return status;
+			}
+		}
+		if (loopstep(&search->loop, search->iter) ||
+		    readat_event(search->file, search->iter, &rawevent)) {
+			return -1;
+		}
+		search->iter = rawevent.next;
+
+		/* Events already found don't need their data read again */
+		if ((status = seenadd(&search->seen, rawevent.ptr)) == -1) {
+			return -1;
+		}
+		if (status == 0) {
+			*ret = rawevent.ptr;
+			return 1;
+		}
+	}
+}
+
+/* Adds a copy of an event found by a search to `list` */
+static int copyresult(struct eventlist *list, struct event *event) {
+	struct event *new;
+	size_t len = strlen(event->name);
+	if ((new = newresult(list)) == NULL) {
+		return -1;
+	}
+	*new = *event;
+	if ((new->name = resultname(list, len)) == NULL) {
+		return -1;
+	}
+	memcpy(new->name, event->name, len + 1);
+	++list->len;
+	return 0;
+}
+
+/* Finds the next event of a search inside dates.c, the same way
+ * datesearchnext does */
+static int searchnext(struct datesearch *search, struct event *ret) {
+	uint64_t data;
+	int status;
+
+	if ((status = searchnextdata(search, &data)) != 1) {
+		return status;
+	}
+	return searchread(search, data, ret) ? -1:1;
+}
+
+/* A piece of the tree for one of the threads of a parallel search */
+struct searchtask {
+	uint64_t ptr;
+	uint64_t prefix;
+	int precision;
+	int list; /* Whether `ptr` is an event list instead of a node */
+};
+
+struct searchworker {
+	/* The datefile as this thread sees it, with its own cache and none
+	 * of the parts that can't be shared */
+	datefile view;
+	struct datesearch search;
+	struct eventlist *found;
+	int status;
+};
+
+struct searchjob {
+	struct searchtask *tasks;
+	size_t ntasks;
+	atomic_size_t next;
+	struct searchworker *workers;
+};
+
+/* Whether a search can be split between the threads from datesetparallel.
+ * Uncommitted changes are only in the log, which the threads can't share. */
+static int parallelusable(struct datesearch *search) {
+	datefile *file = search->file;
+	return file->parallel != NULL && !search->useindex &&
+		(file->wal == NULL || file->wal->len == 0);
+}
+
+/* Cuts the part of the tree in range into at least `want` subtrees if it can.
+ * Times tend to be bunched up in a small corner of the tree, so this goes
+ * down a level at a time until there are enough. The event lists of the nodes
+ * it goes through are left as tasks of their own. */
+static int splitsearch(struct datesearch *search, size_t want,
+		struct searchtask **ret, size_t *nret) {
+	datefile *file = search->file;
+	int bits = nodebits(file);
+	int lists = (1 << bits) - 1;
+	struct searchtask *tasks, *next;
+	size_t len, subtrees, nextlen;
+
+	if ((tasks = malloc(sizeof *tasks)) == NULL) {
+		return -1;
+	}
+	tasks[0].ptr = file->bit1;
+	tasks[0].prefix = 0;
+	tasks[0].precision = 0;
+	tasks[0].list = 0;
+	len = subtrees = 1;
+
+	while (subtrees > 0 && subtrees < want) {
+		next = malloc((len + subtrees * (size_t) (lists + (1 << bits))) *
+				sizeof *next);
+		if (next == NULL) {
+			goto error;
+		}
+		nextlen = subtrees = 0;
+		for (size_t i = 0; i < len; ++i) {
+			struct searchframe *frame = search->stack;
+			if (tasks[i].list) {
+				next[nextlen++] = tasks[i];
+				continue;
+			}
+
+			search->depth = 0;
+			if (searchpush(search, tasks[i].ptr, tasks[i].prefix,
+					tasks[i].precision)) {
+				free(next);
+				goto error;
+			}
+			if (search->depth == 0) {
+				continue;
+			}
+			for (int j = 0; j < lists; ++j) {
+				if (searchlist(search, frame, j)) {
+					next[nextlen].ptr = frame->node.event[j];
+					next[nextlen].prefix = 0;
+					next[nextlen].precision = 0;
+					next[nextlen++].list = 1;
+				}
+			}
+			if (frame->precision >= file->bitn) {
+				continue;
+			}
+			for (uint64_t j = 0; j < (uint64_t) 1 << bits; ++j) {
+				struct searchtask *task = next + nextlen;
+				task->ptr = frame->node.child[j];
+				task->precision = frame->precision + bits;
+				task->prefix = frame->prefix | (j <<
+					(file->bitn - task->precision));
+				task->list = 0;
+				if (task->ptr == 0 || !searchoverlaps(search,
+						task->prefix, task->prefix |
+						fill1(file->bitn -
+							task->precision))) {
+					continue;
+				}
+				++nextlen;
+				++subtrees;
+			}
+		}
+		free(tasks);
+		tasks = next;
+		len = nextlen;
+	}
+
+	search->depth = 0;
+	*ret = tasks;
+	*nret = len;
+	return 0;
+error:
+	search->depth = 0;
+	free(tasks);
+	return -1;
+}
+
+/* Takes tasks until there are none left, reading the events it finds into the
+ * thread's own list */
+static void searchworker(void *arg, size_t index) {
+	struct searchjob *job = arg;
+	struct searchworker *worker = job->workers + index;
+	struct datesearch *search = &worker->search;
+	struct df_event_data data;
+	uint64_t ptr;
+	size_t i;
+	int status;
+
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->ntasks) {
+		struct searchtask *task = job->tasks + i;
+		search->depth = 0;
+		search->iter = 0;
+		if (task->list) {
+			search->iter = task->ptr;
+			loopinit(&search->loop);
+		}
+		else if (searchpush(search, task->ptr, task->prefix,
+				task->precision)) {
+			goto error;
+		}
+		while ((status = searchnextdata(search, &ptr)) == 1) {
+			if (readdatafields(&worker->view, ptr, &data) ||
+			    addresult(&worker->view, &data, worker->found)) {
+				goto error;
+			}
+		}
+		if (status == -1) {
+			goto error;
+		}
+	}
+	return;
+error:
+	worker->status = -1;
+	/* Nobody else has to bother once the search has failed */
+	atomic_store(&job->next, job->ntasks);
+}
+
+/* Finds every event `search` would on the threads from datesetparallel, in no
+ * particular order. An event can be in subtrees that different threads went
+ * through, so it's only added to `ret` the first time it turns up. */
+static int searchparallel(struct datesearch *search, struct eventlist *ret) {
+	datefile *file = search->file;
+	struct dateparallel *parallel = file->parallel;
+	size_t nthreads = parallel->pool.nthreads, ready = 0;
+	struct seenset seen = {NULL, 0, 0};
+	struct searchjob job;
+	int status = -1;
+
+	job.tasks = NULL;
+	if ((job.workers = malloc(nthreads * sizeof *job.workers)) == NULL ||
+	    splitsearch(search, nthreads * parallel->split,
+			&job.tasks, &job.ntasks)) {
+		goto end;
+	}
+	atomic_init(&job.next, 0);
+
+	for (ready = 0; ready < nthreads; ++ready) {
+		struct searchworker *worker = job.workers + ready;
+		struct pagecache *cache = parallel->caches + ready;
+
+		cache->fd = file->fd;
+		if (cache->capacity == file->cache.capacity) {
+			cacheclear(cache);
+		}
+		else if (cacheresize(cache, file->cache.capacity)) {
+			goto end;
+		}
+		if ((worker->found = neweventlist()) == NULL) {
+			goto end;
+		}
+		worker->view = *file;
+		worker->view.cache = *cache;
+		worker->view.cursor = NULL;
+		worker->view.alloc = NULL;
+		worker->view.wal = NULL;
+		worker->view.mirror = NULL;
+		worker->view.index = NULL;
+		worker->view.lock = NULL;
+		worker->view.parallel = NULL;
+		worker->search = *search;
+		worker->search.file = &worker->view;
+		worker->search.seen.ids = NULL;
+		worker->search.seen.size = 0;
+		worker->search.seen.len = 0;
+		worker->search.name = NULL;
+		worker->search.namealloc = 0;
+		worker->search.found = NULL;
+		worker->status = 0;
+	}
+
+	poolrun(&parallel->pool, searchworker, &job);
+
+	status = 0;
+	for (size_t i = 0; i < nthreads; ++i) {
+		struct searchworker *worker = job.workers + i;
+		/* The cache lives on for the next search */
+		parallel->caches[i] = worker->view.cache;
+		if (worker->status) {
+			status = -1;
+		}
+		for (size_t j = 0; status == 0 && j < worker->found->len;
+				++j) {
+			struct event *event = worker->found->events + j;
+			int found = seenadd(&seen, event->id);
+			if (found == -1 || (found == 0 &&
+					copyresult(ret, event))) {
+				status = -1;
+			}
+		}
+	}
+end:
+	for (size_t i = 0; i < ready; ++i) {
+		free(job.workers[i].search.seen.ids);
+		freeeventlist(job.workers[i].found);
+	}
+	free(job.workers);
+	free(job.tasks);
+	free(seen.ids);
+	return status;
+}
+
+struct datesearch *datesearchopen(datefile *file, int64_t start, int64_t end) {
+	struct datesearch *ret;
+	struct stat st;
+
+	if (beginread(file)) {
+		return NULL;
+	}
+	if ((ret = searchopen(file, start, end)) == NULL) {
+		endread(file);
+		return NULL;
+	}
+	if (fstat(file->fd, &st) == -1 ||
+	    (ret->found = neweventlist()) == NULL) {
+		goto error;
+	}
+	ret->commits = file->lock == NULL ? 0 : file->lock->seen;
+	ret->dev = st.st_dev;
+	ret->ino = st.st_ino;
+	if (parallelusable(ret)) {
+		if (searchparallel(ret, ret->found)) {
+			goto error;
+		}
+		ret->done = 1;
+	}
+	endread(file);
+	return ret;
+error:
+	endread(file);
+	datesearchclose(ret);
+	return NULL;
+}
+
+/* Starts a search over after a commit, since whatever it remembers of the tree
+ * could be gone. The seen set stays, so the events it already handed out
+ * aren't found again, but their ids only mean anything in the same file. */
+static int searchrestart(struct datesearch *search) {
+	datefile *file = search->file;
+	struct stat st;
+
+	if (fstat(file->fd, &st) == -1 ||
+	    st.st_dev != search->dev || st.st_ino != search->ino) {
+		return -1;
+	}
+	search->commits = file->lock->seen;
+	return searchstart(search);
+}
+
+/* Finds the next batch of events of a search from datesearchopen */
+static int searchfill(struct datesearch *search) {
+	datefile *file = search->file;
+	struct eventlist *batch = search->found;
+	struct df_event_data data;
+	uint64_t ptr;
+	int status = 0;
+
+	batch->len = 0;
+	batch->nameslen = 0;
+	search->foundpos = 0;
+	if (beginread(file)) {
+		return -1;
+	}
+	if (file->lock != NULL && file->lock->seen != search->commits &&
+	    searchrestart(search)) {
+		endread(file);
+		return -1;
+	}
+	while (batch->len < SEARCH_BATCH) {
+		if ((status = searchnextdata(search, &ptr)) != 1) {
+			search->done = 1;
+			break;
+		}
+		/* The tree does this by itself, but the index only needs to
+		 * once the search has started over */
+		if (search->useindex &&
+		    (status = seenadd(&search->seen, ptr)) != 0) {
+			if (status == -1) {
+				break;
+			}
+			continue;
+		}
+		if ((status = readdatafields(file, ptr, &data)) ||
+		    (status = addresult(file, &data, batch))) {
+			break;
+		}
+	}
+	endread(file);
+	return status == -1 ? -1:0;
+}
+
+int datesearchnext(struct datesearch *search, struct event *ret) {
+	if (search->foundpos >= search->found->len) {
+		if (search->done) {
+			return 0;
+		}
+		if (searchfill(search)) {
+			return -1;
+		}
+		if (search->found->len == 0) {
+			return 0;
+		}
+	}
+	*ret = search->found->events[search->foundpos++];
+	return 1;
+}
+
+void datesearchclose(struct datesearch *search) {
+	if (search == NULL) {
+		return;
+	}
+	free(search->seen.ids);
+	free(search->name);
+	freeeventlist(search->found);
+	free(search);
+}
+
+struct eventlist *datesearch(datefile *file, int64_t start, int64_t end) {
+	struct datesearch *search;
+	struct eventlist *ret;
+	struct df_event_data data;
+	uint64_t ptr;
+	int status;
+
+	if ((ret = neweventlist()) == NULL) {
+		return NULL;
+	}
+	/* Catching up with other writers can load or drop the mirror */
+	if (beginread(file)) {
+		freeeventlist(ret);
+		return NULL;
+	}
+
+	if (file->mirror != NULL) {
+		if (mirrorsearch(file, ret, su64(start), su64(end))) {
+			goto error;
+		}
+		endread(file);
+		return ret;
+	}
+
+	if ((search = searchopen(file, start, end)) == NULL) {
+		goto error;
+	}
+	if (parallelusable(search)) {
+		status = searchparallel(search, ret);
+	}
+	else {
+		while ((status = searchnextdata(search, &ptr)) == 1) {
+			if (readdatafields(file, ptr, &data) ||
+			    addresult(file, &data, ret)) {
+				status = -1;
+				break;
+			}
+		}
+	}
+	datesearchclose(search);
+	if (status == -1) {
+		goto error;
+	}
+	endread(file);
+	return ret;
+error:
+	endread(file);
+	freeeventlist(ret);
+	return NULL;
+}
+
+/* Adds `event` to the list of every range it overlaps */
+static int rangeresult(struct daterange *ranges, size_t n,
+		struct eventlist **ret, struct event *event) {
+	for (size_t i = firstrange(ranges, n, su64(event->start));
+			i < n && ranges[i].start <= event->end; ++i) {
+		if (copyresult(ret[i], event)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int datesearchmulti(datefile *file, struct daterange *ranges, size_t n,
+		struct eventlist **ret) {
+	struct datesearch *search = NULL;
+	struct eventlist *found = NULL;
+	struct event event;
+	size_t i;
+	int status;
+
+	for (i = 0; i < n; ++i) {
+		ret[i] = NULL;
+	}
+	for (i = 0; i < n; ++i) {
+		if (ranges[i].start > ranges[i].end ||
+		    (i > 0 && ranges[i].start <= ranges[i-1].end)) {
+			return -1;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+	if (beginread(file)) {
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		if ((ret[i] = neweventlist()) == NULL) {
+			goto error;
+		}
+	}
+
+	if (file->mirror != NULL) {
+		for (i = 0; i < n; ++i) {
+			if (mirrorsearch(file, ret[i], su64(ranges[i].start),
+						su64(ranges[i].end))) {
+				goto error;
+			}
+		}
+		endread(file);
+		return 0;
+	}
+
+	/* One search over all of the ranges finds every event once, and then
+	 * it goes in each range it overlaps */
+	search = searchopen(file, ranges[0].start, ranges[n-1].end);
+	if (search == NULL) {
+		goto error;
+	}
+	search->ranges = ranges;
+	search->nranges = n;
+	if (parallelusable(search)) {
+		if ((found = neweventlist()) == NULL ||
+		    searchparallel(search, found)) {
+			goto error;
+		}
+		for (i = 0; i < found->len; ++i) {
+			if (rangeresult(ranges, n, ret,
+					found->events + i)) {
+				goto error;
+			}
+		}
+	}
+	else {
+		while ((status = searchnext(search, &event)) == 1) {
+			if (rangeresult(ranges, n, ret, &event)) {
+				goto error;
+			}
+		}
+		if (status == -1) {
+			goto error;
+		}
+	}
+	freeeventlist(found);
+	datesearchclose(search);
+	endread(file);
+	return 0;
+error:
+	freeeventlist(found);
+	datesearchclose(search);
+	endread(file);
+	for (i = 0; i < n; ++i) {
+		freeeventlist(ret[i]);
+		ret[i] = NULL;
+	}
+	return -1;
+}
+
+/* Counts the events that start after `time`, or with `ends` the ones that end
+ * before it, from the counts on the path to `time` */
+static int countpast(datefile *file, uint64_t time, int ends,
+		uint64_t *ret) {
+	struct treenode node;
+	int bits = nodebits(file);
+	uint64_t ptr = file->bit1, prefix = 0, early, late;
+	int precision = 0, slot;
+
+	*ret = 0;
+	while (ptr != 0) {
+		if (readnode(file, ptr, &node) ||
+		    precision + node.skip > file->bitn) {
+			return -1;
+		}
+
+		/* All of a compressed node's events can be on one side of
+		 * `time` */
+		if (node.skip != 0) {
+			precision += node.skip;
+			prefix |= node.key << (file->bitn - precision);
+			early = prefix;
+			late = prefix | fill1(file->bitn - precision);
+			if (time < early) {
+				*ret += ends ? 0 : countsum(node.starts);
+				return 0;
+			}
+			if (time > late) {
+				*ret += ends ? countsum(node.ends) : 0;
+				return 0;
+			}
+		}
+
+		slot = countslot(file, time, precision);
+		for (int i = 0; i < 1 << bits; ++i) {
+			if (ends ? i < slot : i > slot) {
+				*ret += ends ? node.ends[i] : node.starts[i];
+			}
+		}
+		if (precision + bits > file->bitn) {
+			return 0;
+		}
+		ptr = node.child[slot];
+		prefix |= (uint64_t) slot << (file->bitn - precision - bits);
+		precision += bits;
+	}
+	return 0;
+}
+
+static int countrange(datefile *file, int64_t start, int64_t end,
+		uint64_t *ret) {
+	struct datesearch *search;
+	struct treenode root;
+	uint64_t data, after, before;
+	int status;
+
+	/* Version 0 files have to go through the events, but at least not
+	 * their data */
+	if (file->version == DF_VERSION_BINARY) {
+		if ((search = searchopen(file, start, end)) == NULL) {
+			return -1;
+		}
+		while ((status = searchnextdata(search, &data)) == 1) {
+			++*ret;
+		}
+		datesearchclose(search);
+		return status;
+	}
+
+	/* Every event overlaps the range unless it starts after it or ends
+	 * before it, and it can't do both */
+	if (readnode(file, file->bit1, &root) ||
+	    countpast(file, su64(end), 0, &after) ||
+	    countpast(file, su64(start), 1, &before)) {
+		return -1;
+	}
+	*ret = countsum(root.starts) - after - before;
+	return 0;
+}
+
+int datecount(datefile *file, int64_t start, int64_t end, uint64_t *ret) {
+	int status;
+
+	*ret = 0;
+	if (start > end) {
+		return 0;
+	}
+	if (beginread(file)) {
+		return -1;
+	}
+	status = countrange(file, start, end, ret);
+	endread(file);
+	return status;
+}
+
+void freeeventlist(struct eventlist *list) {
+	if (list == NULL) {
+		return;
+	}
+	free(list->events);
+	free(list->names);
+	free(list);
+}
+
+/* The mirror is a copy of the tree in memory, see datemirror. Nodes, the
+ * events in their lists, and event data each live in one array, and refer to
+ * each other by index into those arrays instead of by offset. Index 0 is never
+ * used, so it stands for nothing like offset 0 does in the file. Every node
+ * and event remembers its offset in the file, which is how changes to the
+ * file are found again. */
+struct mirrornode {
+	uint64_t offset;
+	uint64_t key;
+	uint32_t child[1 << DF_WIDE_BITS];
+	uint32_t event[(1 << DF_WIDE_BITS) - 1];
+	int skip;
+};
+
+struct mirrorevent {
+	uint64_t offset;
+	uint32_t next;
+	uint32_t data;
+};
+
+struct mirrordata {
+	uint64_t id;
+	int64_t start;
+	int64_t end;
+	/* Where the name is in `names` */
+	uint32_t name;
+	uint32_t namelen;
+	/* The number of events that point here. Once that's 0, `name` is the
+	 * next free data instead. */
+	uint32_t refs;
+	/* The last search that found this, so that it's only found once */
+	uint32_t stamp;
+};
+
+struct datemirror {
+	struct mirrornode *nodes;
+	struct mirrorevent *events;
+	struct mirrordata *data;
+	uint32_t nodelen, nodealloc, freenodes;
+	uint32_t eventlen, eventalloc, freeevents;
+	uint32_t datalen, dataalloc, freedata;
+
+	/* Indices of data by id, with linear probing */
+	uint32_t *table;
+	uint32_t tablesize;
+	uint32_t tablelen;
+
+	/* Names of removed events stay here until the mirror is loaded again */
+	char *names;
+	uint32_t nameslen, namesalloc;
+
+	uint32_t root;
+	uint32_t stamp;
+};
+
+/* Makes room for `more` elements at the end of one of the arrays of the
+ * mirror, which is passed as a pointer to the array pointer */
+static int mirrorgrow(void *array, uint32_t len, uint32_t *alloc,
+		uint32_t more, size_t size) {
+	void *old, *new;
+	uint32_t newalloc = *alloc;
+
+	if (more > UINT32_MAX - len) {
+		return -1;
+	}
+	while (len + more > newalloc) {
+		if (newalloc > UINT32_MAX / 2) {
+			return -1;
+		}
+		newalloc *= 2;
+	}
+	if (newalloc == *alloc) {
+		return 0;
+	}
+	memcpy(&old, array, sizeof old);
+	if ((new = realloc(old, newalloc * size)) == NULL) {
+		return -1;
+	}
+	memcpy(array, &new, sizeof new);
+	*alloc = newalloc;
+	return 0;
+}
+
+static uint32_t newmnode(struct datemirror *mirror) {
+	uint32_t ret = mirror->freenodes;
+	if (ret != 0) {
+		mirror->freenodes = mirror->nodes[ret].child[0];
+	}
+	else if (mirrorgrow(&mirror->nodes, mirror->nodelen,
+				&mirror->nodealloc, 1, sizeof *mirror->nodes)) {
+		return 0;
+	}
+	else {
+		ret = mirror->nodelen++;
+	}
+	memset(mirror->nodes + ret, 0, sizeof *mirror->nodes);
+	return ret;
+}
+
+static uint32_t newmevent(struct datemirror *mirror) {
+	uint32_t ret = mirror->freeevents;
+	if (ret != 0) {
+		mirror->freeevents = mirror->events[ret].next;
+	}
+	else if (mirrorgrow(&mirror->events, mirror->eventlen,
+				&mirror->eventalloc, 1, sizeof *mirror->events)) {
+		return 0;
+	}
+	else {
+		ret = mirror->eventlen++;
+	}
+	return ret;
+}
+
+static uint32_t newmdata(struct datemirror *mirror) {
+	uint32_t ret = mirror->freedata;
+	if (ret != 0) {
+		mirror->freedata = mirror->data[ret].name;
+	}
+	else if (mirrorgrow(&mirror->data, mirror->datalen,
+				&mirror->dataalloc, 1, sizeof *mirror->data)) {
+		return 0;
+	}
+	else {
+		ret = mirror->datalen++;
+	}
+	return ret;
+}
+
+static uint32_t mirrorhash(struct datemirror *mirror, uint64_t id) {
+	return (uint32_t) ((id * 0x9e3779b97f4a7c15llu) >> 32) &
+		(mirror->tablesize - 1);
+}
+
+/* The slot of the table where the data with some id is, or where it would go
+ * if it isn't there */
+static uint32_t *mirrorslot(struct datemirror *mirror, uint64_t id) {
+	uint32_t i = mirrorhash(mirror, id);
+	while (mirror->table[i] != 0 && mirror->data[mirror->table[i]].id != id) {
+		i = (i + 1) & (mirror->tablesize - 1);
+	}
+	return mirror->table + i;
+}
+
+static int mirrorinsert(struct datemirror *mirror, uint32_t data) {
+	if ((mirror->tablelen + 1) * 2 > mirror->tablesize) {
+		uint32_t *old = mirror->table, oldsize = mirror->tablesize;
+		if (oldsize > UINT32_MAX / 2 ||
+		    (mirror->table = calloc(oldsize * 2, sizeof *old)) ==
+				NULL) {
+			mirror->table = old;
+			return -1;
+		}
+		mirror->tablesize = oldsize * 2;
+		for (uint32_t i = 0; i < oldsize; ++i) {
+			if (old[i] != 0) {
+				*mirrorslot(mirror, mirror->data[old[i]].id) =
+					old[i];
+			}
+		}
+		free(old);
+	}
+	*mirrorslot(mirror, mirror->data[data].id) = data;
+	++mirror->tablelen;
+	return 0;
+}
+
+/* Takes some data out of the table, moving anything after it that was pushed
+ * past its own slot back so that nothing gets lost behind the hole */
+static void mirrorerase(struct datemirror *mirror, uint64_t id) {
+	uint32_t mask = mirror->tablesize - 1;
+	uint32_t i = (uint32_t) (mirrorslot(mirror, id) - mirror->table);
+	if (mirror->table[i] == 0) {
+		return;
+	}
+	for (uint32_t j = (i + 1) & mask; mirror->table[j] != 0;
+			j = (j + 1) & mask) {
+		uint32_t home = mirrorhash(mirror,
+				mirror->data[mirror->table[j]].id);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			mirror->table[i] = mirror->table[j];
+			i = j;
+		}
+	}
+	mirror->table[i] = 0;
+	--mirror->tablelen;
+}
+
+/* Finds the data with some id, reading it from the file if the mirror doesn't
+ * have it yet */
+static int mirrordata(datefile *file, struct datemirror *mirror, uint64_t id,
+		uint32_t *ret) {
+	struct df_event_data data;
+	struct mirrordata *new;
+	uint32_t index;
+
+	if ((*ret = *mirrorslot(mirror, id)) != 0) {
+		return 0;
+	}
+	if (readat_event_data(file, id, &data)) {
+		return -1;
+	}
+	if (data.name_len > UINT32_MAX ||
+	    mirrorgrow(&mirror->names, mirror->nameslen, &mirror->namesalloc,
+			(uint32_t) data.name_len, 1) ||
+	    (index = newmdata(mirror)) == 0) {
+		free(data.name);
+		return -1;
+	}
+	new = mirror->data + index;
+	new->id = id;
+	new->start = data.start;
+	new->end = data.end;
+	new->name = mirror->nameslen;
+	new->namelen = (uint32_t) data.name_len;
+	new->refs = 0;
+	new->stamp = 0;
+	memcpy(mirror->names + mirror->nameslen, data.name, new->namelen);
+	mirror->nameslen += new->namelen;
+	free(data.name);
+	if (mirrorinsert(mirror, index)) {
+		new->name = mirror->freedata;
+		mirror->freedata = index;
+		return -1;
+	}
+	*ret = index;
+	return 0;
+}
+
+static void mirrorunref(struct datemirror *mirror, uint32_t data) {
+	if (--mirror->data[data].refs == 0) {
+		mirrorerase(mirror, mirror->data[data].id);
+		mirror->data[data].name = mirror->freedata;
+		mirror->freedata = data;
+	}
+}
+
+static void mirrorfreeevent(struct datemirror *mirror, uint32_t event) {
+	mirrorunref(mirror, mirror->events[event].data);
+	mirror->events[event].next = mirror->freeevents;
+	mirror->freeevents = event;
+}
+
+static void mirrorfreenode(struct datemirror *mirror, uint32_t node) {
+	struct mirrornode *n = mirror->nodes + node;
+	for (int i = 0; i < (1 << DF_WIDE_BITS) - 1; ++i) {
+		uint32_t iter = n->event[i];
+		while (iter != 0) {
+			uint32_t next = mirror->events[iter].next;
+			mirrorfreeevent(mirror, iter);
+			iter = next;
+		}
+	}
+	for (int i = 0; i < 1 << DF_WIDE_BITS; ++i) {
+		if (n->child[i] != 0) {
+			mirrorfreenode(mirror, n->child[i]);
+		}
+	}
+	n->child[0] = mirror->freenodes;
+	mirror->freenodes = node;
+}
+
+/* Reads the events of a list in the file from `head` up to the one at
+ * `stop`, and puts them in front of `tail`. Fails if the list ends before it
+ * gets to `stop`, since then the mirror doesn't match the file anymore. */
+static int mirrorlist(datefile *file, struct datemirror *mirror,
+		uint64_t head, uint64_t stop, uint32_t tail, uint32_t *ret) {
+	struct loopcheck loop;
+	uint32_t first = 0, last = 0;
+
+	loopinit(&loop);
+	while (head != stop) {
+		struct df_event event;
+		uint32_t index, data;
+		if (head == 0 || loopstep(&loop, head) ||
+		    readat_event(file, head, &event) ||
+		    mirrordata(file, mirror, event.ptr, &data) ||
+		    (index = newmevent(mirror)) == 0) {
+			return -1;
+		}
+		mirror->events[index].offset = head;
+		mirror->events[index].next = 0;
+		mirror->events[index].data = data;
+		++mirror->data[data].refs;
+		if (last != 0) {
+			mirror->events[last].next = index;
+		}
+		else {
+			first = index;
+		}
+		last = index;
+		head = event.next;
+	}
+	if (last != 0) {
+		mirror->events[last].next = tail;
+		*ret = first;
+	}
+	else {
+		*ret = tail;
+	}
+	return 0;
+}
+
+/* Loads the node at `offset` and everything under it. If a split put a new
+ * node above one the mirror already has, that one is passed as `reuse` and
+ * `*reused` is set when it turns up under the new one. */
+static int mirrornode(datefile *file, struct datemirror *mirror,
+		uint64_t offset, uint32_t reuse, int *reused, uint32_t *ret) {
+	struct treenode node;
+	uint32_t index, list, child;
+	int bits = nodebits(file);
+
+	if (readlinks(file, offset, &node)) {
+		return -1;
+	}
+	if (reuse != 0 && mirror->nodes[reuse].offset == offset) {
+		mirror->nodes[reuse].key = node.key;
+		mirror->nodes[reuse].skip = node.skip;
+		*reused = 1;
+		*ret = reuse;
+		return 0;
+	}
+	if ((index = newmnode(mirror)) == 0) {
+		return -1;
+	}
+	mirror->nodes[index].offset = offset;
+	mirror->nodes[index].key = node.key;
+	mirror->nodes[index].skip = node.skip;
+	*ret = index;
+
+	for (int i = 0; i < (1 << bits) - 1; ++i) {
+		if (mirrorlist(file, mirror, node.event[i], 0, 0, &list)) {
+			return -1;
+		}
+		mirror->nodes[index].event[i] = list;
+	}
+	for (int i = 0; i < 1 << bits; ++i) {
+		if (node.child[i] == 0) {
+			continue;
+		}
+		if (mirrornode(file, mirror, node.child[i], reuse, reused,
+				&child)) {
+			return -1;
+		}
+		mirror->nodes[index].child[i] = child;
+	}
+	return 0;
+}
+
+/* Catches the mirror up with an add or remove of an event from start-end. Only
+ * nodes that prunerange would visit can have changed, so only those are read
+ * again. Events with the data `removed` are taken out of their lists. */
+static int mirrorsync(datefile *file, struct datemirror *mirror, uint32_t index,
+		uint64_t start, uint64_t end,
+		uint64_t prefix, int precision, uint64_t removed) {
+	struct treenode node;
+	int bits = nodebits(file);
+	uint64_t early, late, parent;
+
+	if (readlinks(file, mirror->nodes[index].offset, &node)) {
+		return -1;
+	}
+	if (precision + node.skip > file->bitn) {
+		return -1;
+	}
+	mirror->nodes[index].key = node.key;
+	mirror->nodes[index].skip = node.skip;
+	if (node.skip != 0) {
+		precision += node.skip;
+		prefix |= node.key << (file->bitn - precision);
+		if (prefix > end || (prefix | fill1(file->bitn-precision)) <
+				start) {
+			return 0;
+		}
+	}
+
+	/* Removing an event unlinks it, and adding one puts it at the head */
+	for (int i = 0; i < (1 << bits) - 1; ++i) {
+		uint32_t *head = mirror->nodes[index].event + i;
+		uint32_t prev = 0, iter = *head, list;
+		while (removed != 0 && iter != 0) {
+			uint32_t next = mirror->events[iter].next;
+			if (mirror->data[mirror->events[iter].data].id ==
+					removed) {
+				if (prev != 0) {
+					mirror->events[prev].next = next;
+				}
+				else {
+					*head = next;
+				}
+				mirrorfreeevent(mirror, iter);
+			}
+			else {
+				prev = iter;
+			}
+			iter = next;
+		}
+		if (mirrorlist(file, mirror, node.event[i],
+				*head == 0 ? 0 : mirror->events[*head].offset,
+				*head, &list)) {
+			return -1;
+		}
+		mirror->nodes[index].event[i] = list;
+	}
+
+	for (uint64_t i = 0; precision < file->bitn && i < (1 << bits); ++i) {
+		int cprecision = precision + bits;
+		uint32_t child = mirror->nodes[index].child[i];
+		if (node.child[i] == 0) {
+			if (child != 0) {
+				mirrorfreenode(mirror, child);
+				mirror->nodes[index].child[i] = 0;
+			}
+			continue;
+		}
+		if (child == 0 || mirror->nodes[child].offset != node.child[i]) {
+			uint32_t old = child;
+			int reused = 0;
+			if (mirrornode(file, mirror, node.child[i], old,
+					&reused, &child)) {
+				return -1;
+			}
+			if (old != 0 && !reused) {
+				mirrorfreenode(mirror, old);
+			}
+			mirror->nodes[index].child[i] = child;
+			/* The rest of the event may have gone under the
+			 * node that was split */
+		}
+		early = prefix | (i << (file->bitn - cprecision));
+		late = early | fill1(file->bitn - cprecision);
+		parent = early & ~fill1(file->bitn - cprecision + 1);
+		if (early > end || late < start ||
+		    (parent >= start &&
+		     (parent | fill1(file->bitn - cprecision + 1)) <= end)) {
+			continue;
+		}
+		if (mirrorsync(file, mirror, child, start, end,
+				early, cprecision, removed)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void mirrorfree(struct datemirror *mirror) {
+	if (mirror == NULL) {
+		return;
+	}
+	free(mirror->nodes);
+	free(mirror->events);
+	free(mirror->data);
+	free(mirror->table);
+	free(mirror->names);
+	free(mirror);
+}
+
+static struct datemirror *mirrorload(datefile *file) {
+	struct datemirror *ret;
+	int reused;
+
+	if ((ret = calloc(1, sizeof *ret)) == NULL) {
+		return NULL;
+	}
+	/* Index 0 is taken from the start */
+	ret->nodelen = ret->eventlen = ret->datalen = 1;
+	ret->nodealloc = ret->eventalloc = ret->dataalloc = 64;
+	ret->namesalloc = 1024;
+	ret->tablesize = 64;
+	ret->nodes = malloc(ret->nodealloc * sizeof *ret->nodes);
+	ret->events = malloc(ret->eventalloc * sizeof *ret->events);
+	ret->data = malloc(ret->dataalloc * sizeof *ret->data);
+	ret->names = malloc(ret->namesalloc);
+	ret->table = calloc(ret->tablesize, sizeof *ret->table);
+	if (ret->nodes == NULL || ret->events == NULL || ret->data == NULL ||
+	    ret->names == NULL || ret->table == NULL ||
+	    mirrornode(file, ret, file->bit1, 0, &reused, &ret->root)) {
+		mirrorfree(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+int datemirror(datefile *file) {
+	int ret = 0;
+	if (beginread(file)) {
+		return -1;
+	}
+	if (file->mirror == NULL && (file->mirror = mirrorload(file)) == NULL) {
+		ret = -1;
+	}
+	endread(file);
+	return ret;
+}
+
+/* Keeps the mirror up to date after something changed start-end. A mirror
+ * that can't be trusted anymore is dropped, and searches go back to the file.
+ * `failed` is set when the change itself failed partway. */
+static void mirrorchanged(datefile *file, int failed,
+		uint64_t start, uint64_t end, uint64_t removed) {
+	if (file->mirror == NULL) {
+		return;
+	}
+	if (failed || mirrorsync(file, file->mirror, file->mirror->root,
+				start, end, 0, 0, removed)) {
+		mirrorfree(file->mirror);
+		file->mirror = NULL;
+	}
+}
+
+/* Loads the mirror again after the whole tree might have changed */
+static void mirrorreload(datefile *file) {
+	if (file->mirror != NULL) {
+		mirrorfree(file->mirror);
+		file->mirror = mirrorload(file);
+	}
+}
+
+static int mirrorreadlist(struct datemirror *mirror,
+		struct eventlist *events, uint32_t iter) {
+	for (; iter != 0; iter = mirror->events[iter].next) {
+		struct mirrordata *data =
+			mirror->data + mirror->events[iter].data;
+		struct event *event;
+		if (data->stamp == mirror->stamp) {
+			continue;
+		}
+		data->stamp = mirror->stamp;
+
+		if ((event = newresult(events)) == NULL ||
+		    (event->name = resultname(events, data->namelen)) == NULL) {
+			return -1;
+		}
+		memcpy(event->name, mirror->names + data->name, data->namelen);
+		event->name[data->namelen] = '\0';
+		event->start = data->start;
+		event->end = data->end;
+		event->id = data->id;
+		++events->len;
+	}
+	return 0;
+}
+
+/* datesearchrecursive, but for the mirror */
+static int mirrorsearchrecursive(datefile *file, struct eventlist *events,
+		uint64_t start, uint64_t end,
+		uint64_t prefix, int precision, uint32_t index) {
+	struct datemirror *mirror = file->mirror;
+	struct mirrornode *node;
+	int bits = nodebits(file);
+	uint64_t early, late;
+
+	if (index == 0) {
+		return 0;
+	}
+	early = prefix;
+	late = prefix | fill1(file->bitn-precision);
+	if (early > end || late < start) {
+		return 0;
+	}
+
+	node = mirror->nodes + index;
+	if (node->skip != 0) {
+		precision += node->skip;
+		prefix |= node->key << (file->bitn - precision);
+		early = prefix;
+		late = prefix | fill1(file->bitn-precision);
+		if (early > end || late < start) {
+			return 0;
+		}
+	}
+
+	for (int sublen = 0; sublen < bits; ++sublen) {
+		for (uint64_t subkey = 0; subkey < (1 << sublen); ++subkey) {
+			uint32_t head = node->event[listindex(sublen, subkey)];
+			if (head == 0) {
+				continue;
+			}
+			early = prefix |
+				(subkey << (file->bitn - precision - sublen));
+			late = early | fill1(file->bitn - precision - sublen);
+			if (early > end || late < start) {
+				continue;
+			}
+			if (mirrorreadlist(mirror, events, head)) {
+				return -1;
+			}
+		}
+	}
+
+	if (precision >= file->bitn) {
+		return 0;
+	}
+	for (uint64_t i = 0; i < (1 << bits); ++i) {
+		if (mirrorsearchrecursive(file, events, start, end,
+				prefix | (i << (file->bitn-precision-bits)),
+				precision+bits, node->child[i])) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int mirrorsearch(datefile *file, struct eventlist *events,
+		uint64_t start, uint64_t end) {
+	struct datemirror *mirror = file->mirror;
+
+	/* Data found before the stamp came around again would look like it
+	 * was already found */
+	if (++mirror->stamp == 0) {
+		for (uint32_t i = 0; i < mirror->datalen; ++i) {
+			mirror->data[i].stamp = 0;
+		}
+		mirror->stamp = 1;
+	}
+	return mirrorsearchrecursive(file, events, start, end,
+			0, 0, mirror->root);
+}
+
+/* Frees the nodes under `ptr` that removing an event from start-end left
+ * without events or children. Only the children that start-end cuts through,
+ * or that are exactly one of its prefixes, can have held the event, so this
+ * only goes down about two paths. Sets `freed` if the node at `ptr` itself
+ * was freed. */
+static int prunerange(datefile *file, uint64_t ptr,
+		uint64_t start, uint64_t end,
+		uint64_t prefix, int precision, int *freed) {
+	struct treenode node;
+	int bits = nodebits(file);
+	uint64_t early, late, parent;
+	int childfreed;
+
+	*freed = 0;
+	if (readnode(file, ptr, &node)) {
+		return -1;
+	}
+	if (precision + node.skip > file->bitn) {
+		return -1;
+	}
+	if (node.skip != 0) {
+		precision += node.skip;
+		prefix |= node.key << (file->bitn - precision);
+		if (prefix > end || (prefix | fill1(file->bitn-precision)) <
+				start) {
+			return 0;
+		}
+	}
+
+	for (uint64_t i = 0; precision < file->bitn && i < (1 << bits); ++i) {
+		int cprecision = precision + bits;
+		if (node.child[i] == 0) {
+			continue;
+		}
+		early = prefix | (i << (file->bitn - cprecision));
+		late = early | fill1(file->bitn - cprecision);
+		parent = early & ~fill1(file->bitn - cprecision + 1);
+		if (early > end || late < start ||
+		    (parent >= start &&
+		     (parent | fill1(file->bitn - cprecision + 1)) <= end)) {
+			continue;
+		}
+		if (prunerange(file, node.child[i], start, end,
+				early, cprecision, &childfreed)) {
+			return -1;
+		}
+		if (childfreed) {
+			node.child[i] = 0;
+			if (write64at(file, slotpos(file, &node,
+					DF_SLOT_CHILD + (int) i), 0)) {
+				return -1;
+			}
+		}
+	}
+
+	/* The root always stays */
+	if (ptr == file->bit1 || hasevents(file, &node)) {
+		return 0;
+	}
+	for (int i = 0; i < (1 << bits); ++i) {
+		if (node.child[i] != 0) {
+			return 0;
+		}
+	}
+	*freed = 1;
+	return freenode(file, &node);
+}
+
+/* A piece of a removed event that's given back as a free extent */
+struct removed {
+	uint64_t pos;
+	uint64_t len;
+};
+
+static int cmpremoved(const void *a, const void *b) {
+	const struct removed *ra = a, *rb = b;
+	if (ra->pos != rb->pos) {
+		return ra->pos < rb->pos ? -1:1;
+	}
+	return 0;
+}
+
+/* Frees the removed pieces, merging the ones that are next to each other */
+static int freeremoved(datefile *file, struct removed *removed, size_t len) {
+	size_t i, j;
+
+	qsort(removed, len, sizeof *removed, cmpremoved);
+	for (i = 0; i < len; i = j) {
+		uint64_t end = removed[i].pos + removed[i].len;
+		for (j = i + 1; j < len && removed[j].pos == end; ++j) {
+			end += removed[j].len;
+		}
+		if (freeextent(file, removed[i].pos, end - removed[i].pos)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* The first and last prefix of an event */
+struct endsarg {
+	uint64_t first;
+	uint64_t last;
+	int firstprecision;
+	int lastprecision;
+	int found;
+};
+
+static int endsprefix(uint64_t prefix, int precision, void *arg) {
+	struct endsarg *ends = arg;
+	if (!ends->found) {
+		ends->first = prefix;
+		ends->firstprecision = precision;
+		ends->found = 1;
+	}
+	ends->last = prefix;
+	ends->lastprecision = precision;
+	return 0;
+}
+
+/* Takes an event out of the starts (or ends) counts of the nodes from the root
+ * to the one with the list of `prefix`, where `time` is its start (or end) */
+static int uncountprefix(datefile *file, uint64_t prefix, int precision,
+		uint64_t time, int ends) {
+	struct treenode node;
+	int bits = nodebits(file);
+	uint64_t ptr = file->bit1;
+	uint64_t *counts;
+	int depth = 0, slot;
+
+	for (;;) {
+		if (ptr == 0 || readnode(file, ptr, &node)) {
+			return -1;
+		}
+		depth += node.skip;
+		if (depth > precision) {
+			return -1;
+		}
+		slot = countslot(file, time, depth);
+		counts = ends ? node.ends : node.starts;
+		if (counts[slot] == 0 ||
+		    write64at(file, slotpos(file, &node, slot +
+				    (ends ? DF_SLOT_ENDS : DF_SLOT_STARTS)),
+				counts[slot] - 1)) {
+			return -1;
+		}
+		if (precision < depth + bits) {
+			return 0;
+		}
+		ptr = node.child[keybits(file, prefix, depth, depth + bits)];
+		depth += bits;
+	}
+}
+
+/* Takes the event from start-end out of the counts */
+static int uncount(datefile *file, uint64_t start, uint64_t end) {
+	struct endsarg ends = {0};
+
+	if (file->version == DF_VERSION_BINARY) {
+		return 0;
+	}
+	if (coverrange(start, end, endsprefix, &ends)) {
+		return -1;
+	}
+	if (!ends.found) {
+		return 0;
+	}
+	if (uncountprefix(file, ends.first, ends.firstprecision, start, 0) ||
+	    uncountprefix(file, ends.last, ends.lastprecision, end, 1)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Finds the node with the event list of `prefix`. Sets `*ret` to where the
+ * head of the list is kept and `*head` to the head, or `*ret` to 0 if no node
+ * has the list. */
+static int findlist(datefile *file, uint64_t prefix, int precision,
+		uint64_t *ret, uint64_t *head) {
+	struct treenode node;
+	int bits = nodebits(file);
+	uint64_t ptr = file->bit1;
+	int depth = 0, list;
+
+	*ret = 0;
+	for (;;) {
+		if (readlinks(file, ptr, &node)) {
+			return -1;
+		}
+		if (depth + node.skip > precision ||
+		    keybits(file, prefix, depth, depth + node.skip) !=
+				node.key) {
+			return 0;
+		}
+		depth += node.skip;
+		if (precision < depth + bits) {
+			break;
+		}
+		ptr = node.child[keybits(file, prefix, depth, depth + bits)];
+		if (ptr == 0) {
+			return 0;
+		}
+		depth += bits;
+	}
+	list = listindex(precision - depth,
+			keybits(file, prefix, depth, precision));
+	if (hasslot(file, &node, DF_SLOT_EVENT + list)) {
+		*ret = slotpos(file, &node, DF_SLOT_EVENT + list);
+		*head = node.event[list];
+	}
+	return 0;
+}
+
+/* The event structs of an event, found in the lists of the prefixes it
+ * covers. An event covers at most 2 * 64 prefixes. */
+struct linkedarg {
+	datefile *file;
+	uint64_t id;
+	uint64_t events[128];
+	size_t len;
+};
+
+/* Finds the event struct in the list of `prefix` that points to the event
+ * data, making sure the list is linked up properly on the way */
+static int linkedprefix(uint64_t prefix, int precision, void *arg) {
+	struct linkedarg *linked = arg;
+	datefile *file = linked->file;
+	struct df_event event, next;
+	struct loopcheck loop;
+	uint64_t pos, iter;
+
+	if (linked->len >= sizeof linked->events / sizeof *linked->events ||
+	    findlist(file, prefix, precision, &pos, &iter) || pos == 0) {
+		return -1;
+	}
+	loopinit(&loop);
+	for (;;) {
+		if (iter == 0 || loopstep(&loop, iter) ||
+		    readat_event(file, iter, &event) || event.prev != pos) {
+			return -1;
+		}
+		if (event.ptr == linked->id) {
+			break;
+		}
+		pos = iter;
+		iter = event.next;
+	}
+	if (event.next != 0 &&
+	    (readat_event(file, event.next, &next) || next.prev != iter)) {
+		return -1;
+	}
+	linked->events[linked->len++] = iter;
+	return 0;
+}
+
+/* Checks that `id` is the event data of an event that's in the file right
+ * now. Ids come from outside, and one from before a defrag can point
+ * anywhere, so this makes sure every event struct of it is where the tree
+ * says it is before anything is taken apart. */
+static int checkevent(datefile *file, uint64_t id,
+		struct df_event_data *data) {
+	struct linkedarg linked;
+	struct df_event event;
+	struct loopcheck loop;
+	uint64_t end, iter;
+	size_t count, i;
+
+	if (id < file->bit1 || id % recordalign(file->version) != 0 ||
+	    fileend(file, &end) || id >= end ||
+	    size_df_event_data(data) > end - id ||
+	    su64(data->start) > su64(data->end)) {
+		return -1;
+	}
+	linked.file = file;
+	linked.id = id;
+	linked.len = 0;
+	if (coverrange(su64(data->start), su64(data->end),
+				linkedprefix, &linked)) {
+		return -1;
+	}
+
+	/* The event data has to lead to the same event structs */
+	loopinit(&loop);
+	count = 0;
+	for (iter = data->firstev; iter != 0; iter = event.nextsm) {
+		if (count >= linked.len || loopstep(&loop, iter) ||
+		    readat_event(file, iter, &event) || event.ptr != id) {
+			return -1;
+		}
+		for (i = 0; i < linked.len; ++i) {
+			if (linked.events[i] == iter) {
+				break;
+			}
+		}
+		if (i == linked.len) {
+			return -1;
+		}
+		++count;
+	}
+	return count == linked.len ? 0:-1;
+}
+
+static int removeevent(datefile *file, uint64_t id) {
+	struct df_event_data data;
+	struct df_event event = {0};
+	struct removed *removed, *newremoved;
+	size_t len, alloc;
+	uint64_t iter;
+	int ret, freed;
+
+	/* Read the event data. The id comes from outside, so make sure it
+	 * really is an event's data before taking anything apart. */
+	if (file->map != NULL || id == 0 ||
+	    readat_event_data(file, id, &data)) {
+		return -1;
+	}
+	free(data.name);
+	if (checkevent(file, id, &data) || indexdrop(file)) {
+		return -1;
+	}
+
+	alloc = 32;
+	if ((removed = malloc(alloc * sizeof *removed)) == NULL) {
+		return -1;
+	}
+	removed[0].pos = id;
+	removed[0].len = recordsize(file, size_df_event_data(&data));
+	len = 1;
+
+	/* This can change the event lists of nodes the cursor remembers */
+	pathreset(file->cursor);
+
+	ret = -1;
+	if (uncount(file, su64(data.start), su64(data.end))) {
+		goto end;
+	}
+
+	/* Remove pointers to every event that points to this event data */
+	iter = data.firstev;
+	while (iter != 0) {
+		if (len >= alloc) {
+			alloc *= 2;
+			newremoved = realloc(removed, alloc * sizeof *removed);
+			if (newremoved == NULL) {
+				goto end;
+			}
+			removed = newremoved;
+		}
+		removed[len].pos = iter;
+		removed[len].len = recordsize(file, size_df_event(&event));
+		++len;
+		if (eventremove(file, iter, &iter)) {
+			goto end;
+		}
+	}
+
+	/* Nothing points at any of it now, so it can be reused */
+	if (prunerange(file, file->bit1, su64(data.start), su64(data.end),
+				0, 0, &freed)) {
+		goto end;
+	}
+	ret = freeremoved(file, removed, len) || bumpgeneration(file) ||
+		groupcommit(file) ? -1:0;
+end:
+	free(removed);
+	mirrorchanged(file, ret, su64(data.start), su64(data.end), id);
+	return ret;
+}
+
+int dateremove(datefile *file, uint64_t id) {
+	int ret;
+	if (file->map != NULL || beginwrite(file)) {
+		return -1;
+	}
+	ret = removeevent(file, id);
+	endwrite(file);
+	return ret;
+}
+
+static int eventremove(datefile *file, uint64_t id, uint64_t *nextsmret) {
+	struct df_event event;
+	/* Read the event */
+	if (readat_event(file, id, &event) == -1) {
+		return -1;
+	}
+	*nextsmret = event.nextsm;
+
+	/* Update the previous node's next pointer */
+	if (write64at(file, event.prev, event.next) == -1) {
+		return -1;
+	}
+	/* Update the next node's prev pointer*/
+	if (event.next != 0 &&
+	    write64at(file, event.next+8, event.prev)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Treats an open file as a datefile, for working on the temporary files
+ * datedefrag makes. Clean up with dateunwrap(). */
+static int datewrap(int fd, datefile *ret) {
+	struct df_header header;
+
+	ret->fd = fd;
+	ret->path = NULL;
+	ret->map = NULL;
+	ret->maplen = 0;
+	ret->cursor = NULL;
+	ret->alloc = NULL;
+	ret->wal = NULL;
+	ret->mirror = NULL;
+	ret->index = NULL;
+	ret->lock = NULL;
+	ret->parallel = NULL;
+	if (cacheinit(&ret->cache, fd, DATE_CACHE_PAGES)) {
+		return -1;
+	}
+	if (readat_header(ret, 0, &header)) {
+		cachefree(&ret->cache);
+		return -1;
+	}
+	ret->bit1 = header.bit1;
+	ret->bitn = header.bitn;
+	ret->version = header.version;
+	return 0;
+}
+
+/* Frees everything datewrap allocated, but leaves the file open */
+static void dateunwrap(datefile *file) {
+	cachefree(&file->cache);
+	free(file->cursor);
+	free(file->alloc);
+}
+
+/* Offsets in one file mapped to offsets in another, as an open addressing hash
+ * map kept at most half full like a seenset. 0 marks an empty slot, nothing is
+ * ever at offset 0 of either file. */
+struct movemap {
+	struct moveentry {
+		uint64_t from;
+		uint64_t to;
+	} *entries;
+	size_t size;
+	size_t len;
+};
+
+static size_t movehash(struct movemap *map, uint64_t from) {
+	return (size_t) ((from * 0x9e3779b97f4a7c15llu) >> 32) &
+		(map->size - 1);
+}
+
+/* What `from` is mapped to, or 0 if it isn't */
+static uint64_t movesearch(struct movemap *map, uint64_t from) {
+	size_t i;
+	if (map->size == 0) {
+		return 0;
+	}
+	i = movehash(map, from);
+	while (map->entries[i].from != 0) {
+		if (map->entries[i].from == from) {
+			return map->entries[i].to;
+		}
+		i = (i + 1) & (map->size - 1);
+	}
+	return 0;
+}
+
+/* Maps `from` to `to`, unless it's already mapped to something */
+static int moveadd(struct movemap *map, uint64_t from, uint64_t to) {
+	size_t i;
+
+	if (movesearch(map, from) != 0) {
+		return 0;
+	}
+	if ((map->len + 1) * 2 > map->size) {
+		struct moveentry *old = map->entries;
+		size_t oldsize = map->size;
+		size_t newsize = oldsize == 0 ? 64 : oldsize * 2;
+		if ((map->entries = calloc(newsize, sizeof *old)) == NULL) {
+			map->entries = old;
+			return -1;
+		}
+		map->size = newsize;
+		for (size_t j = 0; j < oldsize; ++j) {
+			if (old[j].from == 0) {
+				continue;
+			}
+			i = movehash(map, old[j].from);
+			while (map->entries[i].from != 0) {
+				i = (i + 1) & (newsize - 1);
+			}
+			map->entries[i] = old[j];
+		}
+		free(old);
+	}
+
+	i = movehash(map, from);
+	while (map->entries[i].from != 0) {
+		i = (i + 1) & (map->size - 1);
+	}
+	map->entries[i].from = from;
+	map->entries[i].to = to;
+	++map->len;
+	return 0;
+}
+
+/* A copy of the tree of a version 4 file to a new file, see copyfile() */
+struct treecopy {
+	datefile *in;
+	datefile *out;
+	/* Where the next structure goes in `out` */
+	uint64_t end;
+	/* Where the events and event data of `in` went in `out` */
+	struct movemap moved;
+	/* The pointers in `out` to events of `in` that weren't copied yet when
+	 * the pointers were, by event. Nothing but a single nextsm or firstev
+	 * ever points at an event from outside of its list. */
+	struct movemap waiting;
+};
+
+/* Takes `size` bytes at the end of a copy */
+static uint64_t copyspace(struct treecopy *copy, uint64_t size) {
+	uint64_t ret = copy->end;
+	copy->end = recordsize(copy->out, ret + size);
+	return ret;
+}
+
+/* Points `pos` in the copy at where the event `ptr` of `in` went, or waits
+ * for the event to be copied if it wasn't yet */
+static int copypointer(struct treecopy *copy, uint64_t pos, uint64_t ptr) {
+	uint64_t moved;
+	if (ptr == 0) {
+		return 0;
+	}
+	if ((moved = movesearch(&copy->moved, ptr)) == 0) {
+		return moveadd(&copy->waiting, ptr, pos);
+	}
+	return write64at(copy->out, pos, moved);
+}
+
+/* Copies the event list at `head` to the end of a copy, with the data of each
+ * event right after the first of its event structs that's copied. `prev` is
+ * where the head of the list goes in the copy, and `ret` is set to it. */
+static int copylist(struct treecopy *copy, uint64_t head, uint64_t prev,
+		uint64_t *ret) {
+	struct df_event event, ev = {0};
+	struct df_event_data data;
+	struct loopcheck loop;
+	uint64_t iter, next, nextsm, dataptr, firstev, pos, waiting;
+
+	*ret = head == 0 ? 0 : copy->end;
+	loopinit(&loop);
+	for (iter = head; iter != 0; iter = next) {
+		if (loopstep(&loop, iter) ||
+		    readat_event(copy->in, iter, &event)) {
+			return -1;
+		}
+		pos = copyspace(copy, size_df_event(&ev));
+		if (moveadd(&copy->moved, iter, pos)) {
+			return -1;
+		}
+
+		/* The data goes right after the first event that has it */
+		dataptr = event.ptr;
+		if ((event.ptr = movesearch(&copy->moved, dataptr)) == 0) {
+			if (readat_event_data(copy->in, dataptr, &data)) {
+				return -1;
+			}
+			firstev = data.firstev;
+			data.firstev = 0;
+			event.ptr = copyspace(copy, size_df_event_data(&data));
+			if (moveadd(&copy->moved, dataptr, event.ptr) ||
+			    writeat_event_data(copy->out, event.ptr, &data)) {
+				free(data.name);
+				return -1;
+			}
+			free(data.name);
+			if (copypointer(copy, data.firstev_pos, firstev)) {
+				return -1;
+			}
+		}
+
+		/* The next event goes right after this one and its data */
+		next = event.next;
+		nextsm = event.nextsm;
+		event.next = next == 0 ? 0 : copy->end;
+		event.prev = prev;
+		event.nextsm = 0;
+		if (writeat_event(copy->out, pos, &event) ||
+		    copypointer(copy, event.nextsm_pos, nextsm)) {
+			return -1;
+		}
+		waiting = movesearch(&copy->waiting, iter);
+		if (waiting != 0 &&
+		    write64at(copy->out, waiting, pos)) {
+			return -1;
+		}
+		prev = event.next_pos;
+	}
+	return 0;
+}
+
+/* Copies the subtree at `ptr` to `pos` in a copy, or to the end of it if `pos`
+ * is 0, path compressing it on the way. Every node is followed by its events
+ * and then its children. `ret` is set to where the subtree went, or to 0 if it
+ * doesn't have any events. */
+static int copytree(struct treecopy *copy, uint64_t ptr, uint64_t pos,
+		uint64_t *ret) {
+	struct treenode node, child;
+	int bits = nodebits(copy->in);
+	int children, index;
+
+	if (readnode(copy->in, ptr, &node)) {
+		return -1;
+	}
+
+	/* Nodes with a single child and nothing else are skipped over by the
+	 * child. The root always stays. */
+	for (;;) {
+		children = index = 0;
+		for (int i = 0; i < (1 << bits); ++i) {
+			if (node.child[i] != 0) {
+				++children;
+				index = i;
+			}
+		}
+		if (pos != 0 || children != 1 || hasevents(copy->in, &node)) {
+			break;
+		}
+		if (readnode(copy->in, node.child[index], &child)) {
+			return -1;
+		}
+		child.key |= ((node.key << bits) | (uint64_t) index) <<
+			child.skip;
+		child.skip += node.skip + bits;
+		node = child;
+	}
+	if (pos == 0 && children == 0 && !hasevents(copy->in, &node)) {
+		*ret = 0;
+		return 0;
+	}
+
+	/* The node is written last, once everything it points to is there. It
+	 * gets exactly the room it needs, except for the root. */
+	node.map = usedslots(&node);
+	if (pos == 0) {
+		node.size = __builtin_popcountll(node.map);
+		pos = copyspace(copy, nodebytes(copy->out, node.size));
+	}
+	else {
+		node.size = DF_SLOTS_MAX;
+	}
+	node.offset = pos;
+	for (int i = 0; i < (1 << bits) - 1; ++i) {
+		if (copylist(copy, node.event[i], slotpos(copy->out, &node,
+					DF_SLOT_EVENT + i), &node.event[i])) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < (1 << bits); ++i) {
+		if (node.child[i] != 0 &&
+		    copytree(copy, node.child[i], 0, &node.child[i])) {
+			return -1;
+		}
+	}
+	node.flags = 0;
+	*ret = pos;
+	return writenode(copy->out, pos, &node);
+}
+
+/* Writes a path compressed copy of `in`, a version 4 file, to the empty file
+ * `out` in a single walk of its tree. Events that were removed, nodes that
+ * were cut out, and free space are left behind. */
+static int copyfile(datefile *in, int out) {
+	struct treecopy copy = {0};
+	datefile file;
+	uint64_t root;
+	int ret;
+
+	if (dateinit(out, DF_VERSION_LATEST, &root) || datewrap(out, &file)) {
+		return -1;
+	}
+	copy.in = in;
+	copy.out = &file;
+	copy.end = root;
+	copyspace(&copy, nodebytes(&file, DF_SLOTS_MAX));
+	ret = copytree(&copy, in->bit1, root, &root);
+	free(copy.moved.entries);
+	free(copy.waiting.entries);
+	dateunwrap(&file);
+	return ret;
+}
+
+/* Adds every event in the event list at `head` to `list`. Each event is only
+ * added from the first of its event structs. */
+static int collectlist(datefile *file, uint64_t head,
+		struct eventlist *list) {
+	struct df_event event;
+	struct df_event_data data;
+	struct loopcheck loop;
+	uint64_t iter;
+
+	loopinit(&loop);
+	for (iter = head; iter != 0; iter = event.next) {
+		if (loopstep(&loop, iter) ||
+		    readat_event(file, iter, &event) ||
+		    readdatafields(file, event.ptr, &data)) {
+			return -1;
+		}
+		if (data.firstev == iter && addresult(file, &data, list)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Adds every event in the subtree at `ptr` to `list` */
+static int collectevents(datefile *file, uint64_t ptr,
+		struct eventlist *list) {
+	struct treenode node;
+
+	if (ptr == 0) {
+		return 0;
+	}
+	if (readlinks(file, ptr, &node)) {
+		return -1;
+	}
+
+	for (int i = 0; i < (1 << nodebits(file)) - 1; ++i) {
+		if (collectlist(file, node.event[i], list)) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < (1 << nodebits(file)); ++i) {
+		if (collectevents(file, node.child[i], list)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Builds a new datefile of the latest version in `out` with the same events as
+ * `in`, for version 0 files whose nodes are different */
+static int rebuildfile(datefile *in, int out) {
+	datefile file;
+	struct eventlist *list;
+	uint64_t root;
+	int ret;
+
+	if ((list = neweventlist()) == NULL) {
+		return -1;
+	}
+
+	ret = -1;
+	if (collectevents(in, in->bit1, list) ||
+	    dateinit(out, DF_VERSION_LATEST, &root) ||
+	    datewrap(out, &file)) {
+		goto end;
+	}
+	ret = dateaddbatch(list->events, list->len, &file);
+	dateunwrap(&file);
+end:
+	freeeventlist(list);
+	return ret;
+}
+
+/* Defragments and path compresses `in` into `out`, upgrading it to the latest
+ * version */
+static int defragfile(datefile *in, int out) {
+	datefile file;
+	uint64_t generation;
+	int ret;
+
+	if (readgeneration(in, &generation)) {
+		return -1;
+	}
+	if (in->version == DF_VERSION_BINARY ? rebuildfile(in, out) :
+			copyfile(in, out)) {
+		return -1;
+	}
+	if (datewrap(out, &file)) {
+		return -1;
+	}
+	/* Rebuilt files start counting over, but the generation must never
+	 * go back to one a cache could still have */
+	ret = setgeneration(&file, generation + 1);
+	dateunwrap(&file);
+	return ret;
+}
+
+/* Makes a rename in the directory of `path` survive a crash */
+static int syncdir(char *path) {
+	char *copy;
+	int fd, ret;
+
+	if ((copy = strdup(path)) == NULL) {
+		return -1;
+	}
+	fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+	free(copy);
+	if (fd == -1) {
+		return -1;
+	}
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/* Points `file` at whatever is at its path now */
+static int datereopen(datefile *file) {
+	struct df_header header;
+	int newfd;
+
+	if ((newfd = open(file->path, O_RDWR)) == -1) {
+		return -1;
+	}
+	close(file->fd);
+	file->fd = newfd;
+	file->cache.fd = newfd;
+	if (file->wal != NULL && walreplace(file->wal, newfd)) {
+		return -1;
+	}
+	cacheclear(&file->cache);
+	pathreset(file->cursor);
+	free(file->alloc);
+	file->alloc = NULL;
+
+	if (readat_header(file, 0, &header)) {
+		return -1;
+	}
+	file->bit1 = header.bit1;
+	file->bitn = header.bitn;
+	file->version = header.version;
+	return 0;
+}
+
+static int defrag(datefile *file) {
+	struct stat st;
+	char *tmppath;
+	int fd, ret;
+
+	if (indexdrop(file)) {
+		return -1;
+	}
+	/* The log can't carry over to the new file, so everything in it has
+	 * to be in the old one before it is copied */
+	if (commitwal(file, walcheckpoint) || fstat(file->fd, &st) == -1) {
+		return -1;
+	}
+	if ((tmppath = malloc(strlen(file->path) + sizeof ".XXXXXX")) ==
+			NULL) {
+		return -1;
+	}
+	strcpy(tmppath, file->path);
+	strcat(tmppath, ".XXXXXX");
+	if ((fd = mkstemp(tmppath)) == -1) {
+		free(tmppath);
+		return -1;
+	}
+	if (fchmod(fd, st.st_mode & 07777) == -1 ||
+	    defragfile(file, fd) ||
+	    fsync(fd) == -1) {
+		close(fd);
+		goto error;
+	}
+	if (close(fd) == -1 || begincommit(file)) {
+		goto error;
+	}
+	if (rename(tmppath, file->path) == -1) {
+		endcommit(file, 0);
+		goto error;
+	}
+	free(tmppath);
+
+	/* The old file is gone now, so the handle has to move over even if
+	 * the directory can't be synced. Every other datefile moves over the
+	 * next time it takes a lock. */
+	ret = datereopen(file);
+	if (endcommit(file, 1) || ret) {
+		return -1;
+	}
+	mirrorreload(file);
+	return syncdir(file->path);
+error:
+	unlink(tmppath);
+	free(tmppath);
+	return -1;
+}
+
+int datedefrag(datefile *file) {
+	int ret;
+	if (file->map != NULL || beginwrite(file)) {
+		return -1;
+	}
+	ret = defrag(file);
+	endwrite(file);
+	return ret;
+}
+
+/* Sidecar index
+ *
+ * `nrem cli reindex` writes every event to `<path>.idx` sorted by start time,
+ * so that a search can binary search for the events that start before it ends
+ * instead of walking the tree:
+ *
+ *     struct {
+ *         char magic_number[8];        Always "dateindx"
+ *         uint64_t length;             The length of the datefile this indexes
+ *         uint64_t count;              The number of events
+ *         uint64_t blocklen;           The number of events in a block
+ *         struct {
+ *             uint64_t start;          Stored as a conversion by su64()
+ *             uint64_t end;            Stored as a conversion by su64()
+ *             uint64_t data;           A pointer to the event data
+ *         } events[count];
+ *         uint64_t maxend[];
+ *     };
+ *
+ * maxend is an implicit tree of the latest end in each block: one entry per
+ * block, then one for every two of those, and so on down to a single entry.
+ * Searches skip every part of the tree that ends before they start.
+ *
+ * The tree in the datefile is still what gets changed, so the first change
+ * through a datefile deletes the index, and an index that doesn't have the
+ * length of the datefile is ignored. Like the datefile, the index is big
+ * endian.
+ * */
+#define DF_INDEX_MAGIC "dateindx"
+#define DF_INDEX_HEADER 32
+#define DF_INDEX_ENTRY 24
+#define DF_INDEX_BLOCK 64
+
+struct dateindex {
+	/* The whole index file, or NULL if there isn't a usable one. A
+	 * writable datefile keeps this around anyway so that it knows to
+	 * delete the file when it changes. */
+	unsigned char *map;
+	uint64_t maplen;
+	uint64_t count;
+	uint64_t blocklen;
+	/* Where each level of maxend starts, counted in entries, and how long
+	 * it is. Level 0 has one entry per block. */
+	uint64_t level[64];
+	uint64_t levellen[64];
+	int levels;
+};
+
+static uint64_t indexword(const unsigned char *data) {
+	uint64_t ret = 0;
+	for (int i = 0; i < 8; ++i) {
+		ret = ret << 8 | data[i];
+	}
+	return ret;
+}
+
+/* Lays out the levels of maxend for `count` and `blocklen`, and returns the
+ * number of entries in all of them */
+static uint64_t indexlevels(struct dateindex *index) {
+	uint64_t len, total = 0;
+
+	len = index->count / index->blocklen +
+		(index->count % index->blocklen != 0);
+	index->levels = 0;
+	while (len > 0) {
+		index->level[index->levels] = total;
+		index->levellen[index->levels] = len;
+		++index->levels;
+		total += len;
+		if (len == 1) {
+			break;
+		}
+		len = len / 2 + len % 2;
+	}
+	return total;
+}
+
+static int indexopen(datefile *file, int writable) {
+	struct dateindex *index;
+	struct stat st, filest;
+	char *path;
+	void *map;
+	int fd;
+
+	file->index = NULL;
+	if ((index = calloc(1, sizeof *index)) == NULL) {
+		return -1;
+	}
+	if ((path = siblingpath(file->path, ".idx")) == NULL) {
+		free(index);
+		return -1;
+	}
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1) {
+		goto end;
+	}
+	if (fstat(fd, &st) == -1 || fstat(file->fd, &filest) == -1 ||
+	    st.st_size < DF_INDEX_HEADER) {
+		close(fd);
+		goto end;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		goto end;
+	}
+
+	index->map = map;
+	index->maplen = (uint64_t) st.st_size;
+	index->count = indexword(index->map + 16);
+	index->blocklen = indexword(index->map + 24);
+	if (memcmp(index->map, DF_INDEX_MAGIC, 8) != 0 ||
+	    indexword(index->map + 8) != (uint64_t) filest.st_size ||
+	    index->blocklen == 0 ||
+	    index->count > (index->maplen - DF_INDEX_HEADER) / DF_INDEX_ENTRY ||
+	    (index->maplen - DF_INDEX_HEADER -
+			index->count * DF_INDEX_ENTRY) / 8 !=
+			indexlevels(index)) {
+		munmap(index->map, (size_t) index->maplen);
+		index->map = NULL;
+	}
+end:
+	if (index->map == NULL && !writable) {
+		free(index);
+		return 0;
+	}
+	file->index = index;
+	return 0;
+}
+
+static void indexclose(datefile *file) {
+	if (file->index == NULL) {
+		return;
+	}
+	if (file->index->map != NULL) {
+		munmap(file->index->map, (size_t) file->index->maplen);
+	}
+	free(file->index);
+	file->index = NULL;
+}
+
+static int indexusable(datefile *file) {
+	return file->index != NULL && file->index->map != NULL;
+}
+
+/* Deletes the index before the tree changes and it stops matching */
+static int indexdrop(datefile *file) {
+	char *path;
+	int ret;
+
+	if (file->index == NULL) {
+		return 0;
+	}
+	if ((path = siblingpath(file->path, ".idx")) == NULL) {
+		return -1;
+	}
+	ret = unlink(path) == -1 && errno != ENOENT ? -1:0;
+	free(path);
+	if (ret == 0) {
+		indexclose(file);
+	}
+	return ret;
+}
+
+/* Finds how many entries start by the end of the search, none after them
+ * could be in it */
+static void indexstart(struct datesearch *search) {
+	struct dateindex *index = search->file->index;
+	const unsigned char *entries = index->map + DF_INDEX_HEADER;
+	uint64_t low = 0, high = index->count;
+
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		if (indexword(entries + mid * DF_INDEX_ENTRY) <= search->end) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	search->indexpos = 0;
+	search->indexcount = low;
+}
+
+/* Finds the event data of the next entry that ends at or after the start of the
+ * search. Returns 0 once there aren't any more. */
+static int indexnext(struct datesearch *search, uint64_t *dataret) {
+	struct dateindex *index = search->file->index;
+	const unsigned char *entries = index->map + DF_INDEX_HEADER;
+	const unsigned char *maxend = entries + index->count * DF_INDEX_ENTRY;
+
+	while (search->indexpos < search->indexcount) {
+		uint64_t pos = search->indexpos, block;
+		const unsigned char *entry;
+		int level = 0;
+
+		/* At the start of a block that ends before the search, skip
+		 * the biggest part of the maxend tree that starts with it and
+		 * ends before the search too */
+		block = pos / index->blocklen;
+		if (pos % index->blocklen == 0 &&
+		    indexword(maxend + 8 * (index->level[0] + block)) <
+				search->start) {
+			while (level + 1 < index->levels &&
+			    (block >> (level + 1)) << (level + 1) == block &&
+			    indexword(maxend + 8 * (index->level[level + 1] +
+					(block >> (level + 1)))) <
+					search->start) {
+				++level;
+			}
+			search->indexpos = (block + ((uint64_t) 1 << level)) *
+				index->blocklen;
+			continue;
+		}
+
+		++search->indexpos;
+		entry = entries + pos * DF_INDEX_ENTRY;
+		if (indexword(entry + 8) >= search->start) {
+			*dataret = indexword(entry + 16);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct datalist {
+	uint64_t *data;
+	size_t len;
+	size_t alloc;
+};
+
+/* Adds the event data of every event under `ptr` to `list`, once for every
+ * event that points to it */
+static int collectdata(datefile *file, uint64_t ptr, struct datalist *list) {
+	struct treenode node;
+	if (readlinks(file, ptr, &node)) {
+		return -1;
+	}
+	for (int i = 0; i < (1 << nodebits(file)) - 1; ++i) {
+		uint64_t iter = node.event[i];
+		struct loopcheck loop;
+		loopinit(&loop);
+		while (iter != 0) {
+			struct df_event event;
+			if (loopstep(&loop, iter) ||
+			    readat_event(file, iter, &event)) {
+				return -1;
+			}
+			if (list->len >= list->alloc) {
+				uint64_t *newdata;
+				size_t newalloc = list->alloc * 2;
+				newdata = realloc(list->data,
+						newalloc * sizeof *newdata);
+				if (newdata == NULL) {
+					return -1;
+				}
+				list->data = newdata;
+				list->alloc = newalloc;
+			}
+			list->data[list->len++] = event.ptr;
+			iter = event.next;
+		}
+	}
+	for (int i = 0; i < 1 << nodebits(file); ++i) {
+		if (node.child[i] != 0 &&
+		    collectdata(file, node.child[i], list)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+struct indexentry {
+	uint64_t start;
+	uint64_t end;
+	uint64_t data;
+};
+
+static int cmpu64(const void *a, const void *b) {
+	const uint64_t *ua = a, *ub = b;
+	return *ua < *ub ? -1 : *ua > *ub;
+}
+
+static int cmpindexentry(const void *a, const void *b) {
+	const struct indexentry *ea = a, *eb = b;
+	if (ea->start != eb->start) {
+		return ea->start < eb->start ? -1:1;
+	}
+	return cmpu64(&ea->data, &eb->data);
+}
+
+/* Builds the whole index file in memory */
+static unsigned char *buildindex(datefile *file, uint64_t length,
+		uint64_t *sizeret) {
+	struct datalist list;
+	struct indexentry *entries = NULL;
+	struct dateindex layout;
+	struct filestruct_wbuf buf;
+	uint64_t *maxend = NULL, words, count = 0;
+	unsigned char *ret = NULL;
+
+	list.len = 0;
+	list.alloc = 256;
+	if ((list.data = malloc(list.alloc * sizeof *list.data)) == NULL ||
+	    collectdata(file, file->bit1, &list)) {
+		goto end;
+	}
+
+	/* Every event data is pointed to by each of its prefixes */
+	qsort(list.data, list.len, sizeof *list.data, cmpu64);
+	if ((entries = malloc((list.len + 1) * sizeof *entries)) == NULL) {
+		goto end;
+	}
+	for (size_t i = 0; i < list.len; ++i) {
+		struct df_event_data data;
+		if (i > 0 && list.data[i] == list.data[i - 1]) {
+			continue;
+		}
+		if (readat_event_data(file, list.data[i], &data)) {
+			goto end;
+		}
+		free(data.name);
+		entries[count].start = su64(data.start);
+		entries[count].end = su64(data.end);
+		entries[count].data = list.data[i];
+		++count;
+	}
+	qsort(entries, count, sizeof *entries, cmpindexentry);
+
+	layout.count = count;
+	layout.blocklen = DF_INDEX_BLOCK;
+	words = indexlevels(&layout);
+	if ((maxend = calloc(words + 1, sizeof *maxend)) == NULL) {
+		goto end;
+	}
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t *block = maxend + i / layout.blocklen;
+		if (entries[i].end > *block) {
+			*block = entries[i].end;
+		}
+	}
+	for (int level = 1; level < layout.levels; ++level) {
+		uint64_t *below = maxend + layout.level[level - 1];
+		for (uint64_t i = 0; i < layout.levellen[level]; ++i) {
+			uint64_t max = below[2 * i];
+			if (2 * i + 1 < layout.levellen[level - 1] &&
+			    below[2 * i + 1] > max) {
+				max = below[2 * i + 1];
+			}
+			maxend[layout.level[level] + i] = max;
+		}
+	}
+
+	*sizeret = DF_INDEX_HEADER + count * DF_INDEX_ENTRY + words * 8;
+	if ((ret = malloc(*sizeret)) == NULL) {
+		goto end;
+	}
+	buf.data = ret;
+	buf.base = 0;
+	buf.len = *sizeret;
+	buf.pos = 0;
+	/* Indexes are big endian whatever the version of the datefile */
+	buf.little = 0;
+	bwrite(DF_INDEX_MAGIC, 8, &buf);
+	bwriteu64(length, &buf);
+	bwriteu64(count, &buf);
+	bwriteu64(layout.blocklen, &buf);
+	for (uint64_t i = 0; i < count; ++i) {
+		bwriteu64(entries[i].start, &buf);
+		bwriteu64(entries[i].end, &buf);
+		bwriteu64(entries[i].data, &buf);
+	}
+	for (uint64_t i = 0; i < words; ++i) {
+		bwriteu64(maxend[i], &buf);
+	}
+end:
+	free(list.data);
+	free(entries);
+	free(maxend);
+	return ret;
+}
+
+static int reindex(datefile *file) {
+	struct stat st;
+	unsigned char *data;
+	uint64_t size;
+	char *path, *tmppath;
+	int fd;
+
+	/* The index records the length of the file as it is on disk */
+	if (commitwal(file, walcommit) ||
+	    fstat(file->fd, &st) == -1 ||
+	    (data = buildindex(file, (uint64_t) st.st_size, &size)) == NULL) {
+		return -1;
+	}
+	path = siblingpath(file->path, ".idx");
+	tmppath = siblingpath(file->path, ".idx.XXXXXX");
+	if (path == NULL || tmppath == NULL || (fd = mkstemp(tmppath)) == -1) {
+		goto error;
+	}
+
+	/* Written next to the index and renamed over it, like datedefrag */
+	for (uint64_t written = 0; written < size;) {
+		ssize_t n = write(fd, data + written, (size_t) (size - written));
+		if (n <= 0) {
+			close(fd);
+			unlink(tmppath);
+			goto error;
+		}
+		written += (uint64_t) n;
+	}
+	if (fsync(fd) == -1 || close(fd) == -1 || begincommit(file)) {
+		unlink(tmppath);
+		goto error;
+	}
+	/* Other datefiles pick up the index when they catch up */
+	if (rename(tmppath, path) == -1) {
+		endcommit(file, 0);
+		unlink(tmppath);
+		goto error;
+	}
+	free(data);
+	free(path);
+	free(tmppath);
+
+	indexclose(file);
+	return endcommit(file, 1) || indexopen(file, 1) ||
+		syncdir(file->path) ? -1:0;
+error:
+	free(data);
+	free(path);
+	free(tmppath);
+	return -1;
+}
+
+int datereindex(datefile *file) {
+	int ret;
+	if (file->map != NULL || beginwrite(file)) {
+		return -1;
+	}
+	ret = reindex(file);
+	endwrite(file);
+	return ret;
+}
+
+#ifdef NREM_TESTS
+/* Creates an empty datefile at a temporary path. `path` must end in XXXXXX */
+static int testdatefile(char *path, uint8_t version, datefile *ret) {
+	uint64_t root;
+	int fd;
+	if ((fd = mkstemp(path)) == -1) {
+		return -1;
+	}
+	if (dateinit(fd, version, &root)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return dateopen(path, ret);
+}
+
+/* Removes a test datefile along with its log, index, and lock file */
+static void testunlink(char *path) {
+	char *log = siblingpath(path, ".wal");
+	char *index = siblingpath(path, ".idx");
+	char *lock = siblingpath(path, ".lock");
+	unlink(path);
+	if (log != NULL) {
+		unlink(log);
+		free(log);
+	}
+	if (index != NULL) {
+		unlink(index);
+		free(index);
+	}
+	if (lock != NULL) {
+		unlink(lock);
+		free(lock);
+	}
+}
+
+static int hasevent(struct eventlist *list, char *name) {
+	if (list == NULL) {
+		return 0;
+	}
+	for (size_t i = 0; i < list->len; ++i) {
+		if (strcmp(list->events[i].name, name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* How many events a streamed search finds, or -1 if it fails */
+static int teststream(datefile *file, int64_t start, int64_t end) {
+	struct datesearch *search;
+	struct event event;
+	int count = 0, status;
+
+	if ((search = datesearchopen(file, start, end)) == NULL) {
+		return -1;
+	}
+	while ((status = datesearchnext(search, &event)) == 1) {
+		++count;
+	}
+	datesearchclose(search);
+	return status == 0 ? count : -1;
+}
+
+struct testcover {
+	uint64_t next;
+	int count;
+	int ok;
+};
+
+/* Makes sure the prefixes are in order and tile the range exactly */
+static int testcoverprefix(uint64_t prefix, int precision, void *arg) {
+	struct testcover *cover = arg;
+	if (prefix != cover->next || (prefix & fill1(64 - precision))) {
+		cover->ok = 0;
+	}
+	cover->next = prefix + fill1(64 - precision) + 1;
+	++cover->count;
+	return 0;
+}
+
+static int testcoverrange(uint64_t start, uint64_t end, int count) {
+	struct testcover cover = { .next = start, .count = 0, .ok = 1 };
+	coverrange(start, end, testcoverprefix, &cover);
+	return cover.ok && cover.next == end + 1 && cover.count == count;
+}
+
+static struct event testevents[] = {
+	{ .start = 100, .end = 100, .name = "a" },
+	{ .start = 50, .end = 200, .name = "b" },
+	{ .start = 1000, .end = 2000, .name = "c" },
+	{ .start = -300, .end = -100, .name = "d" },
+};
+
+/* Adding, searching and removing in a file of some version */
+static void testversion(uint8_t version, int *passed, int *total) {
+	struct event *events = testevents;
+	char path[] = "/tmp/nremtestXXXXXX";
+	datefile file, rofile;
+	struct eventlist *list;
+
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	for (int i = 0; i < sizeof testevents / sizeof *testevents; ++i) {
+		NREM_ASSERT(dateadd(events + i, &file) == 0);
+	}
+	NREM_ASSERT(datecommit(&file) == 0);
+	list = datesearch(&file, 0, 150);
+	NREM_ASSERT(list != NULL && list->len == 2);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "b"));
+	freeeventlist(list);
+
+	/* The whole file fits in one page, so searching again never misses */
+	uint64_t hits, misses, newhits, newmisses;
+	datecachestats(&file, &hits, &misses);
+	freeeventlist(datesearch(&file, 0, 150));
+	datecachestats(&file, &newhits, &newmisses);
+	NREM_ASSERT(newmisses == misses && newhits > hits);
+
+	/* Only a checkpointed log can be left for a read only open */
+	NREM_ASSERT(dateopenro(path, &rofile) == -1);
+	NREM_ASSERT(dateclose(&file) == 0);
+	NREM_ASSERT(dateopenro(path, &rofile) == 0);
+	list = datesearch(&rofile, -200, 150);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "b") &&
+			hasevent(list, "d"));
+	/* Names are copied out of the mapping, which can change as soon as
+	 * the search is over */
+	NREM_ASSERT(list != NULL && list->names != NULL &&
+			((unsigned char *) list->events[0].name < rofile.map ||
+			(unsigned char *) list->events[0].name >=
+			rofile.map + rofile.maplen));
+	freeeventlist(list);
+	NREM_ASSERT(dateadd(events, &rofile) == -1);
+	dateclose(&rofile);
+	testunlink(path);
+
+	/* Batches should give the same results as adding one at a time */
+	char batchpath[] = "/tmp/nremtestXXXXXX";
+	NREM_ASSERT(testdatefile(batchpath, version, &file) == 0);
+	NREM_ASSERT(dateadd(events + 2, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 2, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events + 3, 1, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 0, &file) == 0);
+	list = datesearch(&file, -200, 150);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "b") &&
+			hasevent(list, "d"));
+	freeeventlist(list);
+	list = datesearch(&file, 150, 1500);
+	NREM_ASSERT(list != NULL && list->len == 2);
+	NREM_ASSERT(hasevent(list, "b") && hasevent(list, "c"));
+	NREM_ASSERT(dateremove(&file, events[1].id) == 0);
+	freeeventlist(list);
+	list = datesearch(&file, 150, 1500);
+	NREM_ASSERT(list != NULL && list->len == 1 && hasevent(list, "c"));
+	freeeventlist(list);
+	/* Ids that aren't events are turned away without touching the file */
+	NREM_ASSERT(dateremove(&file, 0) == -1);
+	NREM_ASSERT(dateremove(&file, events[2].id + 8) == -1);
+	/* and so are ids of events that are gone */
+	NREM_ASSERT(dateremove(&file, events[1].id) == -1);
+	/* An event over all of time is in the root's own list */
+	struct event always = {
+		.start = INT64_MIN, .end = INT64_MAX, .name = "e" };
+	NREM_ASSERT(dateadd(&always, &file) == 0);
+	list = datesearch(&file, INT64_MIN, INT64_MIN);
+	NREM_ASSERT(list != NULL && list->len == 1 && hasevent(list, "e"));
+	freeeventlist(list);
+	list = datesearch(&file, 150, 1500);
+	NREM_ASSERT(list != NULL && list->len == 2 && hasevent(list, "e"));
+	freeeventlist(list);
+	NREM_ASSERT(dateremove(&file, always.id) == 0);
+	dateclose(&file);
+	NREM_ASSERT(dateopen(batchpath, &file) == 0);
+	list = datesearch(&file, -200, 1500);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	freeeventlist(list);
+	dateclose(&file);
+	testunlink(batchpath);
+}
+
+/* datedefrag brings version 0 files up to the latest version, and the versions
+ * that were never released aren't opened at all */
+static void testupgrade(int *passed, int *total) {
+	struct event *events = testevents;
+	char oldpath[] = "/tmp/nremtestXXXXXX";
+	char badpath[] = "/tmp/nremtestXXXXXX";
+	datefile file, rofile;
+	struct eventlist *list;
+	struct stat before, after;
+	NREM_ASSERT(testdatefile(badpath, DF_VERSION_NATIVE - 1, &file) == -1);
+	testunlink(badpath);
+	NREM_ASSERT(testdatefile(oldpath, DF_VERSION_BINARY, &file) == 0);
+	for (int i = 0; i < sizeof testevents / sizeof *testevents; ++i) {
+		NREM_ASSERT(dateadd(events + i, &file) == 0);
+	}
+	NREM_ASSERT(dateremove(&file, events[2].id) == 0);
+	NREM_ASSERT(datecommit(&file) == 0);
+	NREM_ASSERT(stat(oldpath, &before) == 0);
+	NREM_ASSERT(datedefrag(&file) == 0);
+	NREM_ASSERT(stat(oldpath, &after) == 0);
+	NREM_ASSERT(file.version == DF_VERSION_LATEST);
+	NREM_ASSERT(after.st_size < before.st_size);
+	/* The copy was renamed over the old file */
+	NREM_ASSERT(after.st_ino != before.st_ino);
+	NREM_ASSERT(dateopenro(oldpath, &rofile) == 0);
+	list = datesearch(&rofile, -1000, 3000);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	freeeventlist(list);
+	dateclose(&rofile);
+	list = datesearch(&file, -1000, 3000);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "b") &&
+			hasevent(list, "d"));
+	/* Ids move with the defrag, and removing relies on the prev pointers
+	 * surviving it */
+	uint64_t id = 0;
+	for (int i = 0; list != NULL && i < list->len; ++i) {
+		if (strcmp(list->events[i].name, "a") == 0) {
+			id = list->events[i].id;
+		}
+	}
+	freeeventlist(list);
+	NREM_ASSERT(dateremove(&file, id) == 0);
+	list = datesearch(&file, -1000, 3000);
+	NREM_ASSERT(list != NULL && list->len == 2);
+	NREM_ASSERT(hasevent(list, "b") && hasevent(list, "d"));
+	freeeventlist(list);
+	dateclose(&file);
+	testunlink(oldpath);
+}
+
+/* New nodes go in node pages, and defragging packs them back together */
+static void testpages(int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct df_header header;
+	struct treenode root, node;
+	datefile file;
+	int paged = 0;
+
+	NREM_ASSERT(testdatefile(path, DF_VERSION_LATEST, &file) == 0);
+	for (int i = 0; i < sizeof testevents / sizeof *testevents; ++i) {
+		NREM_ASSERT(dateadd(testevents + i, &file) == 0);
+	}
+	NREM_ASSERT(readat_header(&file, 0, &header) == 0 && header.meta != 0);
+	NREM_ASSERT(readnode(&file, header.bit1, &root) == 0);
+	for (int i = 0; i < 16; ++i) {
+		if (root.child[i] == 0) {
+			continue;
+		}
+		NREM_ASSERT(readnode(&file, root.child[i], &node) == 0);
+		NREM_ASSERT(node.flags & DF_NODE_PAGED);
+		NREM_ASSERT(root.child[i] % DF_NODE_PAGE_SIZE %
+				nodebytes(&file, node.size) == 0);
+		++paged;
+	}
+	NREM_ASSERT(paged > 0);
+
+	NREM_ASSERT(datedefrag(&file) == 0);
+	NREM_ASSERT(readat_header(&file, 0, &header) == 0);
+	NREM_ASSERT(readnode(&file, header.bit1, &root) == 0);
+	for (int i = 0; i < 16; ++i) {
+		if (root.child[i] != 0) {
+			NREM_ASSERT(readnode(&file, root.child[i], &node) == 0);
+			NREM_ASSERT(!(node.flags & DF_NODE_PAGED));
+		}
+	}
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Removed events make room for new ones instead of growing the file */
+static void testreuse(int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event event = { .start = 50, .end = 100000, .name = "reused" };
+	struct eventlist *list;
+	struct stat before, after;
+	datefile file;
+	int ok = 1;
+
+	NREM_ASSERT(testdatefile(path, DF_VERSION_LATEST, &file) == 0);
+	NREM_ASSERT(dateadd(testevents, &file) == 0);
+	NREM_ASSERT(dateadd(&event, &file) == 0);
+	NREM_ASSERT(dateremove(&file, event.id) == 0);
+	NREM_ASSERT(datecommit(&file) == 0);
+	NREM_ASSERT(stat(path, &before) == 0);
+	for (int i = 0; i < 50; ++i) {
+		ok = ok && dateadd(&event, &file) == 0 &&
+			dateremove(&file, event.id) == 0;
+	}
+	NREM_ASSERT(ok && datecommit(&file) == 0);
+	NREM_ASSERT(stat(path, &after) == 0);
+	NREM_ASSERT(after.st_size == before.st_size);
+
+	NREM_ASSERT(dateadd(&event, &file) == 0);
+	list = datesearch(&file, 0, 200);
+	NREM_ASSERT(list != NULL && list->len == 2);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "reused"));
+	freeeventlist(list);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Searches of the mirror find the same events as searches of the file, even
+ * after it's had to follow adds and removes */
+static void testmirror(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event event = { .start = 60, .end = 1500, .name = "mirrored" };
+	struct eventlist *list;
+	datefile file;
+
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dateadd(testevents, &file) == 0);
+	NREM_ASSERT(dateadd(testevents + 1, &file) == 0);
+	NREM_ASSERT(datemirror(&file) == 0 && file.mirror != NULL);
+	NREM_ASSERT(dateaddbatch(testevents + 2, 2, &file) == 0);
+	NREM_ASSERT(dateadd(&event, &file) == 0);
+	NREM_ASSERT(dateremove(&file, testevents[1].id) == 0);
+	NREM_ASSERT(file.mirror != NULL);
+
+	list = datesearch(&file, -200, 150);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "d") &&
+			hasevent(list, "mirrored"));
+	freeeventlist(list);
+	list = datesearch(&file, 1200, 3000);
+	NREM_ASSERT(list != NULL && list->len == 2);
+	NREM_ASSERT(hasevent(list, "c") && hasevent(list, "mirrored"));
+	freeeventlist(list);
+
+	NREM_ASSERT(dateremove(&file, event.id) == 0);
+	NREM_ASSERT(datedefrag(&file) == 0 && file.mirror != NULL);
+	list = datesearch(&file, -1000, 3000);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	NREM_ASSERT(!hasevent(list, "mirrored"));
+	freeeventlist(list);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Searches of the index find the same events as searches of the tree, and
+ * the index goes away once the file changes */
+static void testindex(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event events[150];
+	struct event event = { .start = -1000, .end = 20000, .name = "long" };
+	struct eventlist *list;
+	datefile file;
+	char *index;
+
+	for (int i = 0; i < 150; ++i) {
+		events[i].start = 10000 + i * 10;
+		events[i].end = events[i].start + 5;
+		events[i].name = "filler";
+	}
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dateaddbatch(testevents, 4, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 150, &file) == 0);
+	NREM_ASSERT(dateadd(&event, &file) == 0);
+	NREM_ASSERT(teststream(&file, -200, 150) == 4);
+	NREM_ASSERT(teststream(&file, -1000, 30000) == 155);
+	NREM_ASSERT(datereindex(&file) == 0 && indexusable(&file));
+	NREM_ASSERT(file.index->levels > 1);
+	dateclose(&file);
+
+	NREM_ASSERT(dateopenro(path, &file) == 0 && indexusable(&file));
+	list = datesearch(&file, -200, 150);
+	NREM_ASSERT(list != NULL && list->len == 4);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "b") &&
+			hasevent(list, "d") && hasevent(list, "long"));
+	freeeventlist(list);
+	list = datesearch(&file, 10995, 11003);
+	NREM_ASSERT(list != NULL && list->len == 3);
+	freeeventlist(list);
+	list = datesearch(&file, 30000, 40000);
+	NREM_ASSERT(list != NULL && list->len == 0);
+	freeeventlist(list);
+	NREM_ASSERT(teststream(&file, 10995, 11003) == 3);
+	NREM_ASSERT(teststream(&file, -1000, 30000) == 155);
+	dateclose(&file);
+
+	NREM_ASSERT((index = siblingpath(path, ".idx")) != NULL);
+	NREM_ASSERT(dateopen(path, &file) == 0 && indexusable(&file));
+	NREM_ASSERT(dateremove(&file, event.id) == 0);
+	NREM_ASSERT(!indexusable(&file) && access(index, F_OK) == -1);
+	list = datesearch(&file, -200, 150);
+	NREM_ASSERT(list != NULL && list->len == 3 && !hasevent(list, "long"));
+	freeeventlist(list);
+	/* Enough events found over and over to make the search's set grow */
+	list = datesearch(&file, -1000, 30000);
+	NREM_ASSERT(list != NULL && list->len == 154);
+	freeeventlist(list);
+	free(index);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Counts ranges of all sorts of sizes both ways, returning how many of them
+ * datecount got wrong */
+static int testcounts(datefile *file) {
+	int64_t starts[] = { -100000, -1000, -1, 0, 5, 999, 1000, 4096, 20000 };
+	uint64_t count;
+	int wrong = 0;
+
+	for (int i = 0; i < sizeof starts / sizeof *starts; ++i) {
+		for (int64_t len = 0; len < 1 << 20; len = len * 4 + 1) {
+			int64_t end = starts[i] + len;
+			if (datecount(file, starts[i], end, &count) ||
+			    count != (uint64_t) teststream(file,
+				    starts[i], end)) {
+				++wrong;
+			}
+		}
+	}
+	return wrong;
+}
+
+/* Counts stay right through adds, removes, defrags and upgrades */
+static void testcount(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event events[200];
+	uint64_t seed = 1, count;
+	datefile file;
+
+	for (int i = 0; i < 200; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		events[i].start = (int64_t) (seed >> 40) % 40000 - 20000;
+		events[i].end = events[i].start +
+			(int64_t) (seed >> 20 & 0xfff) * (i % 4);
+		events[i].name = "counted";
+	}
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 150, &file) == 0);
+	for (int i = 150; i < 200; ++i) {
+		NREM_ASSERT(dateadd(events + i, &file) == 0);
+	}
+	NREM_ASSERT(testcounts(&file) == 0);
+	NREM_ASSERT(datecount(&file, -1000000, 1000000, &count) == 0 &&
+			count == 200);
+	NREM_ASSERT(datecount(&file, 10, 5, &count) == 0 && count == 0);
+	for (int i = 0; i < 200; i += 3) {
+		NREM_ASSERT(dateremove(&file, events[i].id) == 0);
+	}
+	NREM_ASSERT(testcounts(&file) == 0);
+	NREM_ASSERT(datedefrag(&file) == 0);
+	NREM_ASSERT(testcounts(&file) == 0);
+	NREM_ASSERT(datecount(&file, -1000000, 1000000, &count) == 0 &&
+			count == 133);
+	/* Compressed nodes get split and emptied again */
+	NREM_ASSERT(dateaddbatch(events, 50, &file) == 0);
+	for (int i = 0; i < 50; i += 2) {
+		NREM_ASSERT(dateremove(&file, events[i].id) == 0);
+	}
+	NREM_ASSERT(testcounts(&file) == 0);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Counts the nodes under `ptr` that path compression should have cut out, or
+ * that were copied with room for more slots than they use */
+static int testuncompressed(datefile *file, uint64_t ptr) {
+	struct treenode node;
+	int children = 0, wrong = 0;
+
+	if (readlinks(file, ptr, &node)) {
+		return 1;
+	}
+	for (int i = 0; i < 1 << nodebits(file); ++i) {
+		if (node.child[i] != 0) {
+			++children;
+			wrong += testuncompressed(file, node.child[i]);
+		}
+	}
+	return wrong + (ptr != file->bit1 && ((children < 2 &&
+		!hasevents(file, &node)) || (!(node.flags & DF_NODE_PAGED) &&
+		__builtin_popcountll(node.map) != node.size)));
+}
+
+/* Defragmented files are path compressed, and every event in them can still be
+ * found and removed */
+static void testdefrag(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event events[200];
+	struct eventlist *list;
+	uint64_t seed = 2, count;
+	datefile file;
+
+	for (int i = 0; i < 200; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		events[i].start = (int64_t) (seed >> 40) % 40000 - 20000;
+		events[i].end = events[i].start +
+			(int64_t) (seed >> 20 & 0xffff) * (i % 3);
+		events[i].name = i % 2 ? "odd" : "even";
+	}
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 200, &file) == 0);
+	for (int i = 0; i < 200; i += 4) {
+		NREM_ASSERT(dateremove(&file, events[i].id) == 0);
+	}
+	NREM_ASSERT(datedefrag(&file) == 0);
+	NREM_ASSERT(testuncompressed(&file, file.bit1) == 0);
+	NREM_ASSERT(testcounts(&file) == 0);
+
+	list = datesearch(&file, -1000000, 1000000);
+	NREM_ASSERT(list != NULL && list->len == 150);
+	for (int i = 0; list != NULL && i < list->len; ++i) {
+		NREM_ASSERT(dateremove(&file, list->events[i].id) == 0);
+	}
+	freeeventlist(list);
+	NREM_ASSERT(datecount(&file, -1000000, 1000000, &count) == 0 &&
+			count == 0);
+	NREM_ASSERT(datecommit(&file) == 0);
+	dateclose(&file);
+
+	NREM_ASSERT(dateopen(path, &file) == 0);
+	list = datesearch(&file, -1000000, 1000000);
+	NREM_ASSERT(list != NULL && list->len == 0);
+	freeeventlist(list);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Whether two lists have the same events, in any order */
+static int samelist(struct eventlist *a, struct eventlist *b) {
+	size_t j;
+	if (a == NULL || b == NULL || a->len != b->len) {
+		return 0;
+	}
+	for (size_t i = 0; i < a->len; ++i) {
+		for (j = 0; j < b->len; ++j) {
+			if (a->events[i].id == b->events[j].id) {
+				break;
+			}
+		}
+		if (j == b->len ||
+		    strcmp(a->events[i].name, b->events[j].name) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Searches the ranges one at a time and all at once, returning how many of
+ * them came out different */
+static int testranges(datefile *file, struct daterange *ranges, size_t n) {
+	struct eventlist *lists[8], *list;
+	int wrong = 0;
+
+	if (datesearchmulti(file, ranges, n, lists)) {
+		return -1;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		list = datesearch(file, ranges[i].start, ranges[i].end);
+		wrong += !samelist(list, lists[i]);
+		freeeventlist(list);
+		freeeventlist(lists[i]);
+	}
+	return wrong;
+}
+
+/* One search over several ranges finds what searching them one by one does,
+ * whether the file is read only, indexed or mirrored */
+static void testmulti(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct daterange ranges[8] = {
+		{ -20000, -15000 }, { -14999, -14000 }, { -100, -1 }, { 0, 0 },
+		{ 1, 500 }, { 5000, 9000 }, { 9001, 9001 }, { 15000, 30000 },
+	};
+	struct daterange bad[2] = { { 0, 10 }, { 10, 20 } };
+	struct eventlist *lists[2];
+	struct event events[100];
+	uint64_t seed = 2;
+	datefile file;
+
+	for (int i = 0; i < 100; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		events[i].start = (int64_t) (seed >> 40) % 40000 - 20000;
+		events[i].end = events[i].start +
+			(int64_t) (seed >> 20 & 0x3fff) * (i % 3);
+		events[i].name = i % 2 ? "odd" : "even";
+	}
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 100, &file) == 0);
+	NREM_ASSERT(testranges(&file, ranges, 8) == 0);
+	NREM_ASSERT(testranges(&file, ranges + 3, 1) == 0);
+	NREM_ASSERT(datesearchmulti(&file, bad, 2, lists) == -1);
+	NREM_ASSERT(lists[0] == NULL && lists[1] == NULL);
+	NREM_ASSERT(datereindex(&file) == 0);
+	dateclose(&file);
+
+	NREM_ASSERT(dateopenro(path, &file) == 0 && indexusable(&file));
+	NREM_ASSERT(testranges(&file, ranges, 8) == 0);
+	dateclose(&file);
+
+	NREM_ASSERT(dateopen(path, &file) == 0);
+	NREM_ASSERT(dateremove(&file, events[0].id) == 0);
+	NREM_ASSERT(testranges(&file, ranges, 8) == 0);
+	NREM_ASSERT(datemirror(&file) == 0);
+	NREM_ASSERT(testranges(&file, ranges, 8) == 0);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Searches split between threads find the same events as searches that
+ * aren't, each of them once */
+static void testparallel(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct daterange ranges[8] = {
+		{ -20000, -15000 }, { -14999, -14000 }, { -100, -1 }, { 0, 0 },
+		{ 1, 500 }, { 5000, 9000 }, { 9001, 9001 }, { 15000, 30000 },
+	};
+	struct eventlist *serial[8], *list;
+	struct event events[300];
+	uint64_t seed = 3;
+	datefile file;
+	int same;
+
+	for (int i = 0; i < 300; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		events[i].start = (int64_t) (seed >> 40) % 40000 - 20000;
+		events[i].end = events[i].start +
+			(int64_t) (seed >> 20 & 0x3fff) * (i % 4);
+		events[i].name = i % 2 ? "odd" : "even";
+	}
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dateaddbatch(events, 300, &file) == 0);
+	NREM_ASSERT(datecommit(&file) == 0);
+	for (int i = 0; i < 8; ++i) {
+		serial[i] = datesearch(&file, ranges[i].start, ranges[i].end);
+	}
+
+	NREM_ASSERT(datesetparallel(&file, 0, 0) == -1);
+	NREM_ASSERT(datesetparallel(&file, 4, 0) == 0);
+	same = 1;
+	for (int i = 0; i < 8; ++i) {
+		list = datesearch(&file, ranges[i].start, ranges[i].end);
+		same &= samelist(serial[i], list);
+		same &= teststream(&file, ranges[i].start, ranges[i].end) ==
+			(int) serial[i]->len;
+		freeeventlist(list);
+	}
+	NREM_ASSERT(same);
+	NREM_ASSERT(testranges(&file, ranges, 8) == 0);
+
+	/* However finely the tree is cut up */
+	NREM_ASSERT(datesetparallel(&file, 3, 100) == 0);
+	list = datesearch(&file, ranges[0].start, ranges[7].end);
+	NREM_ASSERT(list != NULL && list->len == 300);
+	freeeventlist(list);
+
+	/* Uncommitted changes are searched on one thread */
+	NREM_ASSERT(dateadd(events, &file) == 0);
+	list = datesearch(&file, events[0].start, events[0].end);
+	NREM_ASSERT(list != NULL && file.wal->len != 0 &&
+			hasevent(list, "even"));
+	freeeventlist(list);
+	NREM_ASSERT(dateremove(&file, events[0].id) == 0);
+	NREM_ASSERT(datesetparallel(&file, 1, 0) == 0 &&
+			file.parallel == NULL);
+	dateclose(&file);
+
+	NREM_ASSERT(dateopenro(path, &file) == 0);
+	NREM_ASSERT(datesetparallel(&file, 4, 0) == 0);
+	same = 1;
+	for (int i = 0; i < 8; ++i) {
+		list = datesearch(&file, ranges[i].start, ranges[i].end);
+		same &= samelist(serial[i], list);
+		freeeventlist(list);
+	}
+	NREM_ASSERT(same);
+	dateclose(&file);
+
+	for (int i = 0; i < 8; ++i) {
+		freeeventlist(serial[i]);
+	}
+	testunlink(path);
+}
+
+/* Every change moves the generation forward, even across an upgrade */
+static void testgeneration(uint8_t version, int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	uint64_t generation = 0, last = 0;
+	datefile file;
+
+	NREM_ASSERT(testdatefile(path, version, &file) == 0);
+	NREM_ASSERT(dategeneration(&file, &last) == 0 && last == 0);
+	NREM_ASSERT(dateadd(testevents, &file) == 0);
+	NREM_ASSERT(dategeneration(&file, &generation) == 0 &&
+			generation > last);
+	last = generation;
+	NREM_ASSERT(datecount(&file, -1000, 1000, &generation) == 0);
+	NREM_ASSERT(dategeneration(&file, &generation) == 0 &&
+			generation == last);
+	NREM_ASSERT(dateaddbatch(testevents + 1, 3, &file) == 0);
+	NREM_ASSERT(dategeneration(&file, &generation) == 0 &&
+			generation > last);
+	last = generation;
+	NREM_ASSERT(dateremove(&file, testevents[1].id) == 0);
+	NREM_ASSERT(dategeneration(&file, &generation) == 0 &&
+			generation > last);
+	last = generation;
+	NREM_ASSERT(datedefrag(&file) == 0);
+	NREM_ASSERT(dategeneration(&file, &generation) == 0 &&
+			generation > last);
+	last = generation;
+	dateclose(&file);
+
+	NREM_ASSERT(dateopenro(path, &file) == 0);
+	NREM_ASSERT(dategeneration(&file, &generation) == 0 &&
+			generation == last);
+	dateclose(&file);
+	testunlink(path);
+}
+
+/* Datefiles sharing a file see each other's changes once they're committed */
+static void testshared(int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event late = { .start = 10, .end = 20, .name = "late" };
+	struct eventlist *list;
+	uint64_t generation = 0, last = 0, count;
+	datefile a, b, ro;
+
+	NREM_ASSERT(testdatefile(path, DF_VERSION_LATEST, &a) == 0);
+	NREM_ASSERT(dateadd(testevents, &a) == 0 && datecommit(&a) == 0);
+	NREM_ASSERT(dateopen(path, &b) == 0);
+	NREM_ASSERT(datemirror(&b) == 0);
+	NREM_ASSERT(dategeneration(&b, &last) == 0);
+
+	NREM_ASSERT(dateadd(&late, &a) == 0);
+	NREM_ASSERT(datecount(&b, 0, 200, &count) == 0 && count == 1);
+	NREM_ASSERT(datecommit(&a) == 0);
+	NREM_ASSERT(datecount(&b, 0, 200, &count) == 0 && count == 2);
+	list = datesearch(&b, 0, 200);
+	NREM_ASSERT(list != NULL && list->len == 2 && hasevent(list, "late"));
+	freeeventlist(list);
+	NREM_ASSERT(dategeneration(&b, &generation) == 0 && generation > last);
+
+	/* Changes go the other way too, even after the file is replaced */
+	NREM_ASSERT(dateremove(&b, late.id) == 0 && datecommit(&b) == 0);
+	NREM_ASSERT(datedefrag(&b) == 0);
+	list = datesearch(&a, 0, 200);
+	NREM_ASSERT(list != NULL && list->len == 1 && hasevent(list, "a"));
+	freeeventlist(list);
+	NREM_ASSERT(dateadd(testevents + 2, &a) == 0 && datecommit(&a) == 0);
+	NREM_ASSERT(datecount(&b, -1000, 5000, &count) == 0 && count == 2);
+
+	/* The log isn't empty, but the writer that filled it is still around,
+	 * so everything in it is in the file already */
+	NREM_ASSERT(dateadd(&late, &a) == 0);
+	NREM_ASSERT(dateopenro(path, &ro) == 0);
+	NREM_ASSERT(datecount(&ro, -1000, 5000, &count) == 0 && count == 2);
+	dateclose(&ro);
+	NREM_ASSERT(datecommit(&a) == 0);
+
+	dateclose(&a);
+	dateclose(&b);
+	testunlink(path);
+}
+
+/* Goes through the rest of a search, counting the events it finds into
+ * `count` and failing if one of them comes out twice */
+static int testdrain(struct datesearch *search, struct seenset *seen,
+		int *count) {
+	struct event event;
+	int status;
+
+	while ((status = datesearchnext(search, &event)) == 1) {
+		if (seenadd(seen, event.id) != 0) {
+			return -1;
+		}
+		++*count;
+	}
+	return status;
+}
+
+/* An open search doesn't keep anybody from committing, it starts over after
+ * the commit without handing out what it already found again */
+static void testslowsearch(int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event many[SEARCH_BATCH + 50], later[SEARCH_BATCH];
+	struct event late = { .start = 10, .end = 20, .name = "late" };
+	struct seenset seen = {NULL, 0, 0}, roseen = {NULL, 0, 0};
+	struct datesearch *search, *rosearch;
+	struct event event;
+	datefile a, b, ro;
+	int count, rocount;
+	uint64_t maplen;
+	size_t n = sizeof many / sizeof *many;
+
+	for (size_t i = 0; i < n; ++i) {
+		many[i].start = (int64_t) i;
+		many[i].end = (int64_t) i + 5;
+		many[i].name = "many";
+	}
+	for (size_t i = 0; i < sizeof later / sizeof *later; ++i) {
+		later[i].start = later[i].end = 5000 + (int64_t) i;
+		later[i].name = "later";
+	}
+	NREM_ASSERT(testdatefile(path, DF_VERSION_LATEST, &a) == 0);
+	NREM_ASSERT(dateaddbatch(many, n, &a) == 0 && datecommit(&a) == 0);
+	NREM_ASSERT(dateopen(path, &b) == 0);
+	NREM_ASSERT(dateopenro(path, &ro) == 0);
+
+	/* Only the first batch comes out before the commit, and the events
+	 * after it grow the file past the mapping */
+	NREM_ASSERT((search = datesearchopen(&b, 0, 1000)) != NULL);
+	NREM_ASSERT((rosearch = datesearchopen(&ro, 0, 1000)) != NULL);
+	NREM_ASSERT(datesearchnext(search, &event) == 1 &&
+			seenadd(&seen, event.id) == 0);
+	NREM_ASSERT(datesearchnext(rosearch, &event) == 1 &&
+			seenadd(&roseen, event.id) == 0);
+	count = rocount = 1;
+	maplen = ro.maplen;
+	NREM_ASSERT(dateadd(&late, &a) == 0 &&
+			dateaddbatch(later, sizeof later / sizeof *later,
+				&a) == 0 &&
+			datecommit(&a) == 0);
+	NREM_ASSERT(testdrain(search, &seen, &count) == 0 &&
+			count == (int) n + 1);
+	NREM_ASSERT(testdrain(rosearch, &roseen, &rocount) == 0 &&
+			rocount == (int) n + 1 && ro.maplen > maplen);
+	datesearchclose(search);
+	datesearchclose(rosearch);
+
+	/* The ids of a defragmented file mean something else */
+	NREM_ASSERT((rosearch = datesearchopen(&ro, 0, 1000)) != NULL);
+	NREM_ASSERT(datesearchnext(rosearch, &event) == 1);
+	NREM_ASSERT(datedefrag(&a) == 0);
+	free(roseen.ids);
+	roseen.ids = NULL;
+	roseen.size = roseen.len = 0;
+	NREM_ASSERT(testdrain(rosearch, &roseen, &rocount) == -1);
+	datesearchclose(rosearch);
+	NREM_ASSERT(teststream(&ro, 0, 1000) == (int) n + 1);
+
+	free(seen.ids);
+	free(roseen.ids);
+	dateclose(&ro);
+	dateclose(&b);
+	dateclose(&a);
+	testunlink(path);
+}
+
+/* Committed changes survive a crash and uncommitted ones don't */
+static void testcrash(int *passed, int *total) {
+	char path[] = "/tmp/nremtestXXXXXX";
+	struct event kept = { .start = 10, .end = 20, .name = "kept" };
+	struct event lost = { .start = 10, .end = 20, .name = "lost" };
+	struct eventlist *list;
+	datefile file;
+	pid_t pid;
+	int status;
+
+	NREM_ASSERT(testdatefile(path, DF_VERSION_LATEST, &file) == 0);
+	NREM_ASSERT(dateadd(testevents, &file) == 0);
+	dateclose(&file);
+	if ((pid = fork()) == 0) {
+		_exit(dateopen(path, &file) || dateadd(&kept, &file) ||
+			datecommit(&file) || dateadd(&lost, &file));
+	}
+	NREM_ASSERT(pid != -1 && waitpid(pid, &status, 0) == pid &&
+			WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	NREM_ASSERT(dateopenro(path, &file) == -1);
+	NREM_ASSERT(dateopen(path, &file) == 0);
+	list = datesearch(&file, 0, 200);
+	NREM_ASSERT(list != NULL && list->len == 2);
+	NREM_ASSERT(hasevent(list, "a") && hasevent(list, "kept"));
+	freeeventlist(list);
+	dateclose(&file);
+	testunlink(path);
+}
+
+int datestest(int *passed, int *total) {
+	NREM_ASSERT(testcoverrange(0, UINT64_MAX, 1));
+	NREM_ASSERT(testcoverrange(1, UINT64_MAX, 64));
+	NREM_ASSERT(testcoverrange(0, UINT64_MAX - 1, 64));
+	NREM_ASSERT(testcoverrange(75, 75, 1));
+	NREM_ASSERT(testcoverrange(32, 95, 2));
+	NREM_ASSERT(testcoverrange(0x34, 0xff, 4));
+	NREM_ASSERT(testcoverrange(1, 0xfffe, 30));
+
+	const uint8_t versions[] = {DF_VERSION_BINARY, DF_VERSION_NATIVE};
+	for (int i = 0; i < sizeof versions / sizeof *versions; ++i) {
+		testversion(versions[i], passed, total);
+	}
+	testupgrade(passed, total);
+	for (int i = 0; i < sizeof versions / sizeof *versions; ++i) {
+		testmirror(versions[i], passed, total);
+		testindex(versions[i], passed, total);
+		testcount(versions[i], passed, total);
+		testdefrag(versions[i], passed, total);
+		testmulti(versions[i], passed, total);
+		testparallel(versions[i], passed, total);
+		testgeneration(versions[i], passed, total);
+	}
+	testpages(passed, total);
+	testreuse(passed, total);
+	testcrash(passed, total);
+	testshared(passed, total);
+	testslowsearch(passed, total);
+
 	NREM_ASSERT(su64(us64(0)) == 0);
 	NREM_ASSERT(su64(us64(10)) == 10);
 	NREM_ASSERT(su64(us64((1llu << 63) + 100)) == (1llu << 63) + 100);
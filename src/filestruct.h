@@ -27,6 +27,7 @@
  *      Y(I64, name, ~) \
  *      Y(STR, name, ~) \
  *      Y(PTR, name, struct which this points to) \
+ *      Y(U64S, name, count) \
  *    ) \
  *    X(struct 2 name, \
  *      Y(PADDING, name, size) \
@@ -35,49 +36,185 @@
  *    )
  *
  * Every call to X creates a new struct with a specified name and elements. Note
- * that STR MUST come at the end to avoid memory leaks */
+ * that STR MUST come at the end to avoid memory leaks. U64S are fixed size
+ * arrays of U64s, name##_pos is the position of the first one.
+ *
+ * Integers are big endian, or little endian where a filestruct_buf or
+ * filestruct_io says so.
+ *
+ * For each struct, a _layout struct gives the size of the struct in the file
+ * and the offset of every member, leaving out the bytes of a STR, and a _native
+ * struct has the same members with C types, for view_ functions to read in
+ * place from little endian buffers. From those, bread_ and bwrite_ functions
+ * are generated which decode and encode a struct in memory, a size_ function
+ * which gives the encoded size of a struct, and read_ and write_ functions
+ * which move a whole struct at a time through a filestruct_io and decode or
+ * encode it in memory. */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FILESTRUCT_LITTLE_HOST 1
+#else
+#define FILESTRUCT_LITTLE_HOST 0
+#endif
 
-#define READ_FUNC(bits) \
-static int readu##bits(uint##bits##_t *ret, FILE *file) { \
-	*ret = 0; \
-	for (int i = 0; i < sizeof *ret; ++i) { \
-		int c; \
- \
-		c = fgetc(file); \
-		if (c < 0) { \
-			return -1; \
-		} \
-		if (c > 0xff) { \
-			return -1; \
-		} \
-		*ret <<= 8; \
-		*ret |= (uint8_t) c; \
-	} \
-	return 0; \
+/* Big endian 64 bit integers at any alignment. Where the compiler says the
+ * machine is little endian, that's one load and a byte swap. */
+static inline uint64_t loadu64(const unsigned char *data) {
+#if FILESTRUCT_LITTLE_HOST
+	uint64_t val;
+	memcpy(&val, data, sizeof val);
+	return __builtin_bswap64(val);
+#else
+	uint64_t val = 0;
+	for (int i = 0; i < 8; ++i) {
+		val = val << 8 | data[i];
+	}
+	return val;
+#endif
 }
-READ_FUNC(8)
-READ_FUNC(64)
-#undef READ_FUNC
-
-#define WRITE_FUNC(bits) \
-static int writeu##bits(uint##bits##_t val, FILE *file) { \
-	char buff[sizeof val]; \
-	int ret; \
-	for (int i = 0; i < sizeof val; ++i) { \
-		buff[((int) sizeof val) - i - 1] = (char) (val & 0xff); \
-		val >>= 8; \
-	} \
-	ret = fwrite(buff, sizeof buff, 1, file) == 1 ? 0:-1; \
-	return ret; \
+
+static inline void storeu64(unsigned char *data, uint64_t val) {
+#if FILESTRUCT_LITTLE_HOST
+	val = __builtin_bswap64(val);
+	memcpy(data, &val, sizeof val);
+#else
+	for (int i = 7; i >= 0; --i) {
+		data[i] = (unsigned char) (val & 0xff);
+		val >>= 8;
+	}
+#endif
+}
+
+/* Little endian ones, which are just a load or store on most machines */
+static inline uint64_t loadle64(const unsigned char *data) {
+#if FILESTRUCT_LITTLE_HOST
+	uint64_t val;
+	memcpy(&val, data, sizeof val);
+	return val;
+#else
+	uint64_t val = 0;
+	for (int i = 7; i >= 0; --i) {
+		val = val << 8 | data[i];
+	}
+	return val;
+#endif
+}
+
+static inline void storele64(unsigned char *data, uint64_t val) {
+#if FILESTRUCT_LITTLE_HOST
+	memcpy(data, &val, sizeof val);
+#else
+	for (int i = 0; i < 8; ++i) {
+		data[i] = (unsigned char) (val & 0xff);
+		val >>= 8;
+	}
+#endif
+}
+
+static inline uint64_t load64(const unsigned char *data, int little) {
+	return little ? loadle64(data) : loadu64(data);
+}
+
+static inline void store64(unsigned char *data, uint64_t val, int little) {
+	if (little) {
+		storele64(data, val);
+	}
+	else {
+		storeu64(data, val);
+	}
+}
+
+/* A chunk of a file that's already in memory (a memory map, for example).
+ * `base` is the file offset of `data[0]`, and `pos` is relative to `data`. */
+struct filestruct_buf {
+	const unsigned char *data;
+	uint64_t base;
+	uint64_t len;
+	uint64_t pos;
+	/* Set if the integers in it are little endian instead of big endian */
+	int little;
+};
+
+static int bread(void *ret, uint64_t len, struct filestruct_buf *buf) {
+	if (buf->pos > buf->len || buf->len - buf->pos < len) {
+		return -1;
+	}
+	memcpy(ret, buf->data + buf->pos, len);
+	buf->pos += len;
+	return 0;
 }
-WRITE_FUNC(8)
-WRITE_FUNC(64)
-#undef WRITE_FUNC
+
+static int breadu8(uint8_t *ret, struct filestruct_buf *buf) {
+	if (buf->pos >= buf->len) {
+		return -1;
+	}
+	*ret = buf->data[buf->pos++];
+	return 0;
+}
+
+static int breadu64(uint64_t *ret, struct filestruct_buf *buf) {
+	if (buf->pos > buf->len || buf->len - buf->pos < sizeof *ret) {
+		return -1;
+	}
+	*ret = load64(buf->data + buf->pos, buf->little);
+	buf->pos += sizeof *ret;
+	return 0;
+}
+
+/* The same thing, but for encoding structures into memory */
+struct filestruct_wbuf {
+	unsigned char *data;
+	uint64_t base;
+	uint64_t len;
+	uint64_t pos;
+	int little;
+};
+
+static int bwrite(const void *val, uint64_t len, struct filestruct_wbuf *buf) {
+	if (buf->pos > buf->len || buf->len - buf->pos < len) {
+		return -1;
+	}
+	memcpy(buf->data + buf->pos, val, len);
+	buf->pos += len;
+	return 0;
+}
+
+static int bwriteu8(uint8_t val, struct filestruct_wbuf *buf) {
+	if (buf->pos >= buf->len) {
+		return -1;
+	}
+	buf->data[buf->pos++] = val;
+	return 0;
+}
+
+static int bwriteu64(uint64_t val, struct filestruct_wbuf *buf) {
+	if (buf->pos > buf->len || buf->len - buf->pos < sizeof val) {
+		return -1;
+	}
+	store64(buf->data + buf->pos, val, buf->little);
+	buf->pos += sizeof val;
+	return 0;
+}
+
+/* Where read_ and write_ functions get and put the bytes of a struct. `read`
+ * and `write` move `len` bytes at `pos` of whatever `ctx` is, and fail unless
+ * all of them could be moved. */
+struct filestruct_io {
+	int (*read)(void *ctx, uint64_t pos, void *buf, size_t len);
+	int (*write)(void *ctx, uint64_t pos, const void *buf, size_t len);
+	void *ctx;
+	/* The byte order, like in filestruct_buf */
+	int little;
+};
 
 /* Unsigned -> signed 64 bit int conversion. 0x80000... is zero */
 static inline int64_t us64(uint64_t v) {
@@ -102,16 +239,8 @@ static inline uint64_t su64(int64_t v) {
 #define CAT(a, b) CAT_PRIM(a, b)
 #define N(n) CAT(NAMESPACE, n)
 
-#define FTELL(var) \
-	{ \
-		long pos; \
-		if ((pos = ftell(file)) == -1) { \
-			return -1; \
-		} \
-		var = (uint64_t) pos; \
-	} \
-
-/* For everything except defragmentation, PTRs and U64s are the same */
+/* PTRs are stored like U64s, the struct they point to is only there for the
+ * reader */
 #define PTR(name, arg) U64(name, arg)
 
 /* structure definitions */
@@ -134,6 +263,8 @@ static inline uint64_t su64(int64_t v) {
 #define STR(name, arg) \
 	uint64_t name##_len; \
 	char *name;
+#define U64S(name, count) \
+	uint64_t name[count];
 
 STRUCTS
 
@@ -144,52 +275,31 @@ STRUCTS
 #undef U64
 #undef I64
 #undef STR
+#undef U64S
 
-/* read functions */
+/* layouts, which are the structs as they're laid out in the file. They're only
+ * used for their sizes and the offsets of their members, so that a member can
+ * be found without going through every member before it. Arrays of unsigned
+ * char don't need any alignment, so nothing is ever padded. */
 #define X(name, members) \
-	static int CAT(read_, N(name))(struct N(name) *ret, \
-			FILE *file) { \
-		FTELL(ret->offset); \
+	struct CAT(N(name), _layout) { \
 		members \
-		return 0; \
-	}
+	};
 #define Y(type, name, arg) \
-	FTELL(ret->name##_pos) \
 	type(name, arg)
 #define PADDING(name, size) \
-	if (fread(ret->name, size, 1, file) < 1) { \
-		return -1; \
-	}
+	unsigned char name[size];
 #define U8(name, arg) \
-	if (readu8(&ret->name, file)) { \
-		return -1; \
-	}
+	unsigned char name[1];
 #define U64(name, arg) \
-	if (readu64(&ret->name, file)) { \
-		return -1; \
-	}
+	unsigned char name[8];
 #define I64(name, arg) \
-	{ \
-		uint64_t tmp; \
-		if (readu64(&tmp, file)) { \
-			return -1; \
-		} \
-		ret->name = us64(tmp); \
-	}
-/* XXX: If there is a STR member, and then something else fails later, that's a
- * memory leak. Don't let that happen please. */
+	unsigned char name[8];
+/* Just the length, the string itself comes right after the layout */
 #define STR(name, arg) \
-	if (readu64(&ret->name##_len, file)) { \
-		return -1; \
-	} \
-	if ((ret->name = malloc(ret->name##_len + 1)) == NULL) { \
-		return -1; \
-	} \
-	if (fread(ret->name, ret->name##_len, 1, file) < 1) { \
-		free(ret->name); \
-		return -1; \
-	} \
-	ret->name[ret->name##_len] = '\0';
+	unsigned char name[8];
+#define U64S(name, count) \
+	unsigned char name[count][8];
 
 STRUCTS
 
@@ -200,44 +310,33 @@ STRUCTS
 #undef U64
 #undef I64
 #undef STR
+#undef U64S
+
+#define LAYOUT(name) struct CAT(N(name), _layout)
+#define NATIVE(name) struct CAT(N(name), _native)
+#define AT(name) (data + offsetof(filestruct_layout, name))
 
-/* write functions */
+/* native structs, which are the structs as they're laid out in a little endian
+ * file, but with C types. If every member of a struct is naturally aligned in
+ * the file, its native struct has no padding and can be read in place. */
 #define X(name, members) \
-	static int CAT(write_, N(name))(struct N(name) *ret, \
-			FILE *file) { \
-		FTELL(ret->offset) \
+	NATIVE(name) { \
 		members \
-		if (fflush(file) == EOF) { \
-			return -1; \
-		} \
-		return 0; \
-	}
+	};
 #define Y(type, name, arg) \
-	FTELL(ret->name##_pos) \
 	type(name, arg)
-#define PADDING(name, len) \
-	if (fwrite(ret->name, len, 1, file) < 1) { \
-		return -1; \
-	}
+#define PADDING(name, size) \
+	unsigned char name[size];
 #define U8(name, arg) \
-	if (writeu8(ret->name, file)) { \
-		return -1; \
-	}
+	uint8_t name;
 #define U64(name, arg) \
-	if (writeu64(ret->name, file)) { \
-		return -1; \
-	}
+	uint64_t name;
 #define I64(name, arg) \
-	if (writeu64(su64(ret->name), file)) {  \
-		return -1; \
-	}
+	int64_t name;
 #define STR(name, arg) \
-	if (writeu64(ret->name##_len, file)) { \
-		return -1; \
-	} \
-	if (fwrite(ret->name, ret->name##_len, 1, file) < 1) { \
-		return -1; \
-	}
+	uint64_t name##_len;
+#define U64S(name, count) \
+	uint64_t name[count];
 
 STRUCTS
 
@@ -248,176 +347,219 @@ STRUCTS
 #undef U64
 #undef I64
 #undef STR
+#undef U64S
 
-#undef PTR
-
-/* To defragment a file, we just take the "root" element (in the case of nrem,
- * the file header), and follow the pointers. For each structure, if we've seen
- * it before, we know where to point to. If we haven't, we just write the
- * structure and point to that.
- *
- * This requres two things: a list of all the pointers we've seen, and a
- * defragmentation function. That list of pointers is just a hashmap, which is
- * implemented below.
- * */
-
-/* Hashmaps */
-#ifndef FILESTRUCT_ONCE
-#define FILESTRUCT_MAP_SPACE 131 /* arbitrary prime number */
-
-struct filestruct_map_item {
-	uint64_t key;
-	uint64_t value;
-	struct filestruct_map_item *next;
-};
-
-/* a filestruct_map is an array of FILESTRUCT_MAP_SPACE filestruct_map_items,
- * where a filestruct_map_item is a linkedlist of keys and values */
-typedef struct filestruct_map_item *filestruct_map[FILESTRUCT_MAP_SPACE];
-
-static void init_filestruct_map(filestruct_map map) {
-	for (int i = 0; i < FILESTRUCT_MAP_SPACE; ++i) {
-		map[i] = NULL;
-	}
-}
-
-static void free_filestruct_map(filestruct_map map) {
-	for (int i = 0; i < FILESTRUCT_MAP_SPACE; ++i) {
-		struct filestruct_map_item *iter = map[i];
-		while (iter != NULL) {
-			struct filestruct_map_item *next = iter->next;
-			free(iter);
-			iter = next;
-		}
+/* view functions, which give the native struct at the position of a buffer
+ * without copying or decoding anything. They give NULL unless both the buffer
+ * and the machine are little endian, the native struct has no padding, and the
+ * struct is aligned in memory. The position of the buffer doesn't move. */
+#define X(name, members) \
+	static const NATIVE(name) *CAT(view_, N(name))( \
+			const struct filestruct_buf *buf) { \
+		const unsigned char *data; \
+\
+		if (!FILESTRUCT_LITTLE_HOST || !buf->little || \
+		    sizeof(NATIVE(name)) != sizeof(LAYOUT(name)) || \
+		    buf->pos > buf->len || \
+		    buf->len - buf->pos < sizeof(NATIVE(name))) { \
+			return NULL; \
+		} \
+		data = buf->data + buf->pos; \
+		if ((uintptr_t) data % _Alignof(NATIVE(name)) != 0) { \
+			return NULL; \
+		} \
+		return (const NATIVE(name) *) (const void *) data; \
 	}
-}
 
-static uint64_t filestruct_map_search(filestruct_map map, uint64_t key) {
-	const int index = (int) (key % FILESTRUCT_MAP_SPACE);
-	struct filestruct_map_item *iter = map[index];
-	while (iter != NULL) {
-		if (iter->key == key) {
-			return iter->value;
-		}
-		iter = iter->next;
-	}
-	return UINT64_MAX;
-}
+STRUCTS
 
-static int filestruct_map_contains(filestruct_map map, uint64_t key) {
-	return filestruct_map_search(map, key) != UINT64_MAX;
-}
+#undef X
 
-static int add_filestruct_map(filestruct_map map,
-		uint64_t key, uint64_t value) {
-	if (filestruct_map_contains(map, key)) {
-		return 0;
+/* size functions */
+#define X(name, members) \
+	static uint64_t CAT(size_, N(name))(struct N(name) *ret) { \
+		uint64_t size = sizeof(LAYOUT(name)); \
+		members \
+		return size; \
 	}
+#define Y(type, name, arg) \
+	type(name, arg)
+#define PADDING(name, len)
+#define U8(name, arg)
+#define U64(name, arg)
+#define I64(name, arg)
+#define STR(name, arg) \
+	size += ret->name##_len;
+#define U64S(name, count)
 
-	const int index = (int) (key % FILESTRUCT_MAP_SPACE);
-	struct filestruct_map_item *newitem;
-	if ((newitem = malloc(sizeof *newitem)) == NULL) {
-		return -1;
-	}
-	newitem->key = key;
-	newitem->value = value;
-	newitem->next = map[index];
-	map[index] = newitem;
-	return 0;
-}
+STRUCTS
 
-#undef FILESTRUCT_MAP_SPACE
+#undef X
+#undef Y
+#undef PADDING
+#undef U8
+#undef U64
+#undef I64
+#undef STR
+#undef U64S
 
-static inline int seek(FILE *file, uint64_t position, int whence) {
-	if (position > LONG_MAX) {
-		return -1;
+/* buffer read functions. The whole layout is checked against the buffer once,
+ * and then every member is copied out of the native struct if there's a view
+ * of it, or decoded straight from its offset otherwise. Little endian I64s are
+ * stored as they are, big endian ones are converted by su64(). */
+#define X(name, members) \
+	static int CAT(bread_, N(name))(struct N(name) *ret, \
+			struct filestruct_buf *buf) { \
+		typedef LAYOUT(name) filestruct_layout; \
+		const NATIVE(name) *native; \
+		const unsigned char *data; \
+		int little = buf->little; \
+\
+		if (buf->pos > buf->len || \
+		    buf->len - buf->pos < sizeof(filestruct_layout)) { \
+			return -1; \
+		} \
+		data = buf->data + buf->pos; \
+		native = CAT(view_, N(name))(buf); \
+		ret->offset = buf->base + buf->pos; \
+		buf->pos += sizeof(filestruct_layout); \
+		members \
+		return 0; \
 	}
-	return fseek(file, (long) position, whence);
-}
-static inline int tell(FILE *file, uint64_t *ret) {
-	long val = ftell(file);
-	if (val < 0) {
-		return -1;
+#define Y(type, name, arg) \
+	ret->name##_pos = ret->offset + offsetof(filestruct_layout, name); \
+	type(name, arg)
+#define PADDING(name, size) \
+	memcpy(ret->name, AT(name), size);
+#define U8(name, arg) \
+	ret->name = *AT(name);
+#define U64(name, arg) \
+	ret->name = native != NULL ? native->name : \
+		little ? loadle64(AT(name)) : loadu64(AT(name));
+#define I64(name, arg) \
+	if (native != NULL) { \
+		ret->name = native->name; \
+	} \
+	else { \
+		ret->name = little ? (int64_t) loadle64(AT(name)) : \
+			us64(loadu64(AT(name))); \
+	}
+/* The length is checked against the buffer first so that a corrupted length
+ * can't make us allocate some absurd amount of memory */
+#define STR(name, arg) \
+	ret->name##_len = native != NULL ? native->name##_len : \
+		little ? loadle64(AT(name)) : loadu64(AT(name)); \
+	if (ret->name##_len > buf->len - buf->pos) { \
+		return -1; \
+	} \
+	if ((ret->name = malloc(ret->name##_len + 1)) == NULL) { \
+		return -1; \
+	} \
+	memcpy(ret->name, buf->data + buf->pos, ret->name##_len); \
+	ret->name[ret->name##_len] = '\0'; \
+	buf->pos += ret->name##_len;
+#define U64S(name, count) \
+	if (native != NULL) { \
+		memcpy(ret->name, native->name, sizeof ret->name); \
+	} \
+	else { \
+		for (int filestruct_i = 0; filestruct_i < count; \
+				++filestruct_i) { \
+			const unsigned char *at = AT(name) + \
+				8 * (size_t) filestruct_i; \
+			ret->name[filestruct_i] = little ? loadle64(at) : \
+				loadu64(at); \
+		} \
 	}
-	*ret = (uint64_t) val;
-	return 0;
-}
-
-#endif
 
-/* Hashmap definitions */
-#define X(name, members) \
-	static filestruct_map CAT(N(name), _map) = {0};
 STRUCTS
-#undef X
-
-#define X(name, members) \
-	free_filestruct_map(CAT(N(name), _map)); \
-	init_filestruct_map(CAT(N(name), _map));
-static int N(reset_hashmaps)() {
-	STRUCTS
-	return 0;
-}
-#undef X
 
-/* Naive defrag declarations */
-#define X(name, members) \
-static uint64_t CAT(defragnaive_, N(name))(uint64_t ptr, FILE *in, FILE *out);
-STRUCTS
 #undef X
+#undef Y
+#undef PADDING
+#undef U8
+#undef U64
+#undef I64
+#undef STR
+#undef U64S
 
-/* Naive defrag functions */
+/* buffer write functions, the same thing backwards. Where a view would work,
+ * members are stored into the native struct. */
 #define X(name, members) \
-	static uint64_t CAT(defragnaive_, N(name)) \
-			(uint64_t ptr, FILE *in, FILE *out) { \
-		filestruct_map * map = &CAT(N(name), _map); \
-		uint64_t ret; \
-		struct N(name) orig; \
-		/* No duplicate structures */ \
-		if (filestruct_map_contains(*map, ptr)) { \
-			return filestruct_map_search(*map, ptr); \
-		} \
+	static int CAT(bwrite_, N(name))(struct N(name) *ret, \
+			struct filestruct_wbuf *buf) { \
+		typedef LAYOUT(name) filestruct_layout; \
+		NATIVE(name) *native = NULL; \
+		unsigned char *data; \
+		int little = buf->little; \
 \
-		if (seek(in, ptr, SEEK_SET) || \
-		    seek(out, 0, SEEK_END) || \
-		    tell(out, &ret) || \
-		    add_filestruct_map(*map, ptr, ret)) { \
-			goto error; \
+		if (buf->pos > buf->len || \
+		    buf->len - buf->pos < CAT(size_, N(name))(ret)) { \
+			return -1; \
 		} \
-\
-		/* First, naively copy from input to output */\
-		if (CAT(read_, N(name))(&orig, in) || \
-		    CAT(write_, N(name))(&orig, out)) { \
-			goto error; \
+		data = buf->data + buf->pos; \
+		if (FILESTRUCT_LITTLE_HOST && little && \
+		    sizeof(NATIVE(name)) == sizeof(filestruct_layout) && \
+		    (uintptr_t) data % _Alignof(NATIVE(name)) == 0) { \
+			native = (NATIVE(name) *) (void *) data; \
 		} \
-		/* Then, correct for pointers */ \
+		ret->offset = buf->base + buf->pos; \
+		buf->pos += sizeof(filestruct_layout); \
 		members \
-		return ret; \
-error: \
-		return UINT64_MAX; \
+		return 0; \
 	}
 #define Y(type, name, arg) \
-	do { \
-		type(name, arg) \
-	} while (0);
-
-/* These can all be copied naively without issues */
-#define PADDING(name, len) ;
-#define U8(name, arg) ;
-#define U64(name, arg) ;
-#define I64(name, arg) ;
-#define STR(name, arg) ;
-
-#define PTR(name, type) \
-	uint64_t dstval; \
-	/* Sanitize pointers */ \
-	if (orig.name == 0) { \
-		break; \
+	ret->name##_pos = ret->offset + offsetof(filestruct_layout, name); \
+	type(name, arg)
+#define PADDING(name, size) \
+	memcpy(AT(name), ret->name, size);
+#define U8(name, arg) \
+	*AT(name) = ret->name;
+#define U64(name, arg) \
+	if (native != NULL) { \
+		native->name = ret->name; \
 	} \
-	dstval = CAT(defragnaive_, N(type))(orig.name, in, out); \
-	if (seek(out, orig.name##_pos, SEEK_SET) || \
-	    writeu64(dstval, out)) { \
-		goto error; \
+	else if (little) { \
+		storele64(AT(name), ret->name); \
+	} \
+	else { \
+		storeu64(AT(name), ret->name); \
+	}
+#define I64(name, arg) \
+	if (native != NULL) { \
+		native->name = ret->name; \
+	} \
+	else if (little) { \
+		storele64(AT(name), (uint64_t) ret->name); \
+	} \
+	else { \
+		storeu64(AT(name), su64(ret->name)); \
+	}
+#define STR(name, arg) \
+	if (native != NULL) { \
+		native->name##_len = ret->name##_len; \
+	} \
+	else { \
+		store64(AT(name), ret->name##_len, little); \
+	} \
+	memcpy(buf->data + buf->pos, ret->name, ret->name##_len); \
+	buf->pos += ret->name##_len;
+#define U64S(name, count) \
+	if (native != NULL) { \
+		memcpy(native->name, ret->name, sizeof ret->name); \
+	} \
+	else { \
+		for (int filestruct_i = 0; filestruct_i < count; \
+				++filestruct_i) { \
+			unsigned char *at = AT(name) + \
+				8 * (size_t) filestruct_i; \
+			if (little) { \
+				storele64(at, ret->name[filestruct_i]); \
+			} \
+			else { \
+				storeu64(at, ret->name[filestruct_i]); \
+			} \
+		} \
 	}
 
 STRUCTS
@@ -429,19 +571,162 @@ STRUCTS
 #undef U64
 #undef I64
 #undef STR
-#undef PTR
+#undef U64S
 
+/* read functions, which read the layout of the struct in one go. If the struct
+ * has a string, decoding that fails, but we know the length of the string
+ * afterwards and can read the whole thing. The layout is read into a native
+ * struct so that it's aligned for a view. */
 #define X(name, members) \
-	static int CAT(defrag_, N(name))(uint64_t ptr, FILE *in, FILE *out) { \
-		if (CAT(NAMESPACE, reset_hashmaps)()) { \
+	static int CAT(read_, N(name))(struct N(name) *ret, uint64_t pos, \
+			struct filestruct_io *io) { \
+		union { \
+			NATIVE(name) native; \
+			unsigned char data[sizeof(LAYOUT(name))]; \
+		} stack; \
+		struct filestruct_buf buf; \
+		unsigned char *data; \
+		uint64_t fullsize; \
+		int status; \
+\
+		if (io->read(io->ctx, pos, stack.data, sizeof stack.data)) { \
+			return -1; \
+		} \
+		buf.data = stack.data; \
+		buf.base = pos; \
+		buf.len = sizeof stack.data; \
+		buf.pos = 0; \
+		buf.little = io->little; \
+		if (CAT(bread_, N(name))(ret, &buf) == 0) { \
+			return 0; \
+		} \
+\
+		if ((fullsize = CAT(size_, N(name))(ret)) <= sizeof stack.data || \
+		    fullsize > SIZE_MAX || \
+		    (data = malloc((size_t) fullsize)) == NULL) { \
 			return -1; \
 		} \
-		return CAT(defragnaive_, N(name))(ptr, in, out) == UINT64_MAX; \
+		buf.data = data; \
+		buf.len = fullsize; \
+		buf.pos = 0; \
+		status = io->read(io->ctx, pos, data, (size_t) fullsize) || \
+			CAT(bread_, N(name))(ret, &buf); \
+		free(data); \
+		return status ? -1:0; \
 	}
+
 STRUCTS
+
 #undef X
 
-#undef FTELL
+/* write functions, which encode the whole struct and write it at once */
+#define X(name, members) \
+	static int CAT(write_, N(name))(struct N(name) *val, uint64_t pos, \
+			struct filestruct_io *io) { \
+		union { \
+			NATIVE(name) native; \
+			unsigned char data[1024]; \
+		} stack; \
+		struct filestruct_wbuf buf; \
+		unsigned char *data; \
+		uint64_t size; \
+		int status; \
+\
+		size = CAT(size_, N(name))(val); \
+		data = stack.data; \
+		if (size > sizeof stack.data && (size > SIZE_MAX || \
+		    (data = malloc((size_t) size)) == NULL)) { \
+			return -1; \
+		} \
+		buf.data = data; \
+		buf.base = pos; \
+		buf.len = size; \
+		buf.pos = 0; \
+		buf.little = io->little; \
+		status = CAT(bwrite_, N(name))(val, &buf) || \
+			io->write(io->ctx, pos, data, (size_t) size); \
+		if (data != stack.data) { \
+			free(data); \
+		} \
+		return status ? -1:0; \
+	}
+
+STRUCTS
+
+#undef X
+
+#undef LAYOUT
+#undef NATIVE
+#undef AT
+#undef PTR
+
+#ifndef FILESTRUCT_ONCE
+/* Positional reads and writes of a whole buffer. They never move the file
+ * position, so nothing else using the file has to care about them. */
+static int preadall(int fd, uint64_t pos, void *buf, size_t len) {
+	unsigned char *out = buf;
+	if (pos > (uint64_t) INT64_MAX - len) {
+		return -1;
+	}
+	while (len > 0) {
+		ssize_t n = pread(fd, out, len, (off_t) pos);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		out += n;
+		pos += (uint64_t) n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+static int pwriteall(int fd, uint64_t pos, const void *buf, size_t len) {
+	const unsigned char *in = buf;
+	if (pos > (uint64_t) INT64_MAX - len) {
+		return -1;
+	}
+	while (len > 0) {
+		ssize_t n = pwrite(fd, in, len, (off_t) pos);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		in += n;
+		pos += (uint64_t) n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+/* A filestruct_io for the file open at `*fd` */
+static int fdread(void *fd, uint64_t pos, void *buf, size_t len) {
+	return preadall(*(int *) fd, pos, buf, len);
+}
+static int fdwrite(void *fd, uint64_t pos, const void *buf, size_t len) {
+	return pwriteall(*(int *) fd, pos, buf, len);
+}
+static inline struct filestruct_io fdio(int *fd) {
+	struct filestruct_io ret = {
+		.read = fdread,
+		.write = fdwrite,
+		.ctx = fd,
+	};
+	return ret;
+}
+
+static int writeu64at(struct filestruct_io *io, uint64_t pos, uint64_t val) {
+	unsigned char data[8];
+	store64(data, val, io->little);
+	return io->write(io->ctx, pos, data, sizeof data);
+}
+
+#endif
+
 #undef CAT_PRIM
 #undef CAT
 #undef N
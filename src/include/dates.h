@@ -21,18 +21,110 @@
 #ifndef HAVE_DATES
 #define HAVE_DATES
 
-#include <stdio.h>
 #include <stdint.h>
 
+#include <pagecache.h>
+
+/* The default size of a datefile's page cache, in pages */
+#define DATE_CACHE_PAGES 256
+
+struct datepath;
+struct datealloc;
+struct wal;
+struct datemirror;
+struct dateindex;
+struct datesearch;
+struct datelock;
+struct dateparallel;
+
 typedef struct {
-	FILE *file;
+	int fd;
 	char *path;
 	uint64_t bit1;
 	uint8_t bitn;
+	uint8_t version;
+
+	/* If the file was opened with dateopenro, the entire file is mapped
+	 * into memory here and every read is served from the mapping. NULL
+	 * otherwise. */
+	unsigned char *map;
+	uint64_t maplen;
+
+	/* Every read and write of a writable datefile goes through here */
+	struct pagecache cache;
+
+	/* Where the last insertion happened, private to dates.c */
+	struct datepath *cursor;
+	/* Where new nodes go, private to dates.c */
+	struct datealloc *alloc;
+	/* Where changes wait to be committed, private to dates.c. NULL for a
+	 * read only datefile. */
+	struct wal *wal;
+	/* The tree in memory if datemirror was called, private to dates.c */
+	struct datemirror *mirror;
+	/* The sidecar index if there is one, private to dates.c */
+	struct dateindex *index;
+	/* What keeps other processes using the file out of the way, private
+	 * to dates.c */
+	struct datelock *lock;
+	/* The threads from datesetparallel, private to dates.c. NULL if
+	 * searches stay on the calling thread. */
+	struct dateparallel *parallel;
 } datefile;
 
+/* Opens a datefile, creating it if it doesn't exist. Changes are logged to
+ * `<path>.wal` before they reach the file, and a log left by a crash is
+ * replayed here.
+ *
+ * Any number of processes can have a datefile open, and they're kept apart
+ * with locks on `<path>.lock`. Searches wait for commits, but not for a
+ * writer that's still making changes, and commits only wait for the searches
+ * that are reading the file right then. Only one datefile makes changes at a
+ * time, from its first change until those changes are committed, and other
+ * datefiles see them once they are. Datefiles in one process lock each other
+ * out like separate processes do, so one that holds uncommitted changes can
+ * keep another one waiting forever. */
 int dateopen(char *path, datefile *ret);
 
+/* Opens an existing datefile read only. The file is memory mapped so that
+ * searches don't have to make any syscalls. dateadd, dateremove, and
+ * datedefrag all fail on a read only datefile. Also fails if a crash left
+ * changes in the log that might not have reached the file, dateopen will
+ * replay them. A log that a datefile open somewhere else is still using is
+ * fine, that datefile has already written everything in it to the file.
+ * Other datefiles can still commit changes, and the file is mapped again if
+ * they make it grow. */
+int dateopenro(char *path, datefile *ret);
+
+/* Commits everything that's still in the log and closes the datefile, which
+ * is freed even if that fails */
+int dateclose(datefile *file);
+
+/* Makes every change since the last commit durable at once. Changes are
+ * visible to searches straight away but can be lost in a crash until they
+ * are committed, which also happens by itself once enough of them pile up.
+ * Committing lets other writers in again. */
+int datecommit(datefile *file);
+
+/* Loads the whole tree and every event into memory, so that datesearch never
+ * reads the file. dateadd and dateremove still write to the file, and then
+ * read back the nodes they changed to keep the copy up to date. Meant for
+ * long running programs that search over and over, like the TUI. */
+int datemirror(datefile *file);
+
+/* Changes the size of the page cache, 0 disables it */
+int datesetcache(datefile *file, size_t pages);
+void datecachestats(datefile *file, uint64_t *hits, uint64_t *misses);
+
+/* Splits searches of the tree between `threads` threads, 1 keeps them on the
+ * calling thread. The part of the tree in the search range is cut into about
+ * `split` subtrees per thread, 0 for the default, and the threads take
+ * subtrees until there are none left. A search opened with datesearchopen
+ * finds everything before it returns and keeps it in memory. Searches of the
+ * mirror, the index, or uncommitted changes don't use the threads. The
+ * datefile can't be used in a child after fork(). */
+int datesetparallel(datefile *file, int threads, int split);
+
 struct event {
 	int64_t start;
 	int64_t end;
@@ -48,17 +140,79 @@ struct eventlist {
 	size_t len;
 	size_t alloc;
 	struct event *events;
+	/* The name of every event is in here, one after another, so freeing a
+	 * list is the same amount of work however many events it has */
+	char *names;
+	size_t nameslen;
+	size_t namesalloc;
 };
 
 int dateadd(struct event *event, datefile *file);
 
+/* Adds `n` events, setting their ids. The prefixes of every event are sorted
+ * and added in one walk of the tree, so this is much faster than calling
+ * dateadd `n` times. */
+int dateaddbatch(struct event *events, size_t n, datefile *file);
+
 struct eventlist *datesearch(datefile *file, int64_t start, int64_t end);
 void freeeventlist(struct eventlist *list);
 
+/* An inclusive range of times, for datesearchmulti */
+struct daterange {
+	int64_t start;
+	int64_t end;
+};
+
+/* Does a datesearch for each of `n` ranges into ret[0] to ret[n-1], in one walk
+ * of the file. The ranges have to be sorted and can't overlap. An event in
+ * several of the ranges is still only read once. On failure every list is
+ * NULL. */
+int datesearchmulti(datefile *file, struct daterange *ranges, size_t n,
+		struct eventlist **ret);
+
+/* A search that hands out its events one at a time instead of putting them all
+ * in a list. Apart from the ids of the events it has found so far, it takes
+ * the same memory however many events there are, unless datesetparallel has
+ * it find them all on threads up front. A search always goes through the
+ * file, even if it's mirrored.
+ *
+ * The file is only locked while the search reads a batch of events, so a
+ * slow reader never holds up writers. If anything commits changes in the
+ * meantime, the search starts over and skips the events it already handed
+ * out, so events that were there all along come out once and events added or
+ * removed since the search was opened may or may not. The search fails if the
+ * file was defragmented. Changes through `file` itself have to be committed
+ * before the search goes on. */
+struct datesearch *datesearchopen(datefile *file, int64_t start, int64_t end);
+
+/* Reads the next event of a search into `ret`. Returns 1 if there was one, 0
+ * once there aren't any more, and -1 on failure. Events come in no particular
+ * order. The name only lasts until the next call. */
+int datesearchnext(struct datesearch *search, struct event *ret);
+void datesearchclose(struct datesearch *search);
+
+/* Counts the events datesearch would find in start-end into `ret`, without
+ * reading any of them from files of the latest version */
+int datecount(datefile *file, int64_t start, int64_t end, uint64_t *ret);
+
 int dateremove(datefile *file, uint64_t id);
 
+/* Gets a number that goes up whenever the events in the datefile change, so
+ * that results found in it can be cached until then */
+int dategeneration(datefile *file, uint64_t *ret);
+
+/* Packs the file together and upgrades it to the latest version. The copy is
+ * written next to the datefile and renamed over it once it's on disk, so a
+ * crash leaves either the old file or the new one, and `file` moves over to
+ * the new one. */
 int datedefrag(datefile *file);
 
+/* Writes every event sorted by start time to `<path>.idx`, which searches use
+ * instead of the tree until the datefile changes. The first change through
+ * any datefile deletes the index again, so this is for files that are read
+ * much more often than they're written. */
+int datereindex(datefile *file);
+
 #ifdef NREM_TESTS
 
 int datestest(int *passed, int *total);
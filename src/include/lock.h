@@ -0,0 +1,74 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+#ifndef HAVE_LOCK
+#define HAVE_LOCK
+
+#include <stdint.h>
+
+/* Keeps processes that share a datefile out of each other's way, with two
+ * locks on a file next to it:
+ *
+ *   - The writer lock lets one handle make changes at a time. It's taken
+ *     before the first change and held until the changes are committed, so
+ *     uncommitted changes never have to be merged with anybody else's.
+ *   - The commit lock is held shared while reading the file and exclusively
+ *     while a commit writes to it. Readers only wait for the commit itself,
+ *     not for the writer to finish making its changes.
+ *
+ * The file also counts the commits, so that a handle can tell if anything it
+ * has cached from the datefile went stale while it wasn't holding a lock. */
+struct datelock {
+	int fd;                     /* -1 if the file couldn't be opened */
+	int readers;                /* How many reads are going on */
+	int writing;
+	int committing;
+	int known;                  /* Whether `seen` has been read yet */
+	uint64_t seen;              /* The count when we last looked */
+};
+
+/* Opens the lock file at `path`, creating it if needed. If the file can't be
+ * opened at all and `writable` isn't set, nothing is ever locked. */
+int lockopen(struct datelock *lock, char *path, int writable);
+
+/* Releases every lock */
+void lockclose(struct datelock *lock);
+
+/* Takes the commit lock shared, unless this handle already holds it. Sets
+ * `changed` if there were commits since the last time this handle looked. */
+int lockread(struct datelock *lock, int *changed);
+void unlockread(struct datelock *lock);
+
+/* Takes the writer lock, unless this handle already holds it */
+int lockwrite(struct datelock *lock, int *changed);
+void unlockwrite(struct datelock *lock);
+/* Whether some other handle holds the writer lock right now */
+int lockbusy(struct datelock *lock);
+
+/* Takes the commit lock exclusively, waiting for every reader to finish. The
+ * writer lock has to be held. */
+int lockcommit(struct datelock *lock);
+/* Gives the commit lock back, counting a commit if `changed` is set. Reads
+ * that were going on when the commit started keep their shared lock. */
+int unlockcommit(struct datelock *lock, int changed);
+
+int locktest(int *passed, int *total);
+
+#endif
@@ -0,0 +1,76 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+#ifndef HAVE_PAGECACHE
+#define HAVE_PAGECACHE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_PAGESIZE 4096
+
+struct cachepage {
+	uint64_t index;             /* Which page of the file this is */
+	size_t len;                 /* Only less than CACHE_PAGESIZE at EOF */
+	struct cachepage *prev;     /* LRU list, most recently used first */
+	struct cachepage *next;
+	struct cachepage *hnext;    /* Hash chain */
+	unsigned char data[CACHE_PAGESIZE];
+};
+
+/* An LRU cache of the pages of a file. The cache is write through: every write
+ * goes straight to the file, and cachewrote() has to be called afterwards to
+ * keep the cached copy in sync. Pages are read with pread(), so separate
+ * caches of one file can be read from on separate threads. */
+struct pagecache {
+	int fd;
+	size_t capacity;            /* In pages, 0 disables the cache */
+	size_t len;
+	struct cachepage *pages;
+	struct cachepage *head;
+	struct cachepage *tail;
+	struct cachepage **table;
+	size_t tablesize;           /* Always a power of 2 */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+int cacheinit(struct pagecache *cache, int fd, size_t capacity);
+
+/* Drops every cached page and changes the capacity. The hit and miss counters
+ * are kept. */
+int cacheresize(struct pagecache *cache, size_t capacity);
+
+/* Drops every cached page, for when the file is changed behind our back */
+void cacheclear(struct pagecache *cache);
+
+void cachefree(struct pagecache *cache);
+
+/* Reads `len` bytes at `pos`. Fails if any of those bytes are past EOF. */
+int cacheread(struct pagecache *cache, uint64_t pos, void *buf, size_t len);
+
+/* Tells the cache that `len` bytes were written to the file at `pos` */
+void cachewrote(struct pagecache *cache, uint64_t pos,
+		const void *buf, size_t len);
+
+int cachetest(int *passed, int *total);
+
+#endif
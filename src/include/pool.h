@@ -0,0 +1,57 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+#ifndef HAVE_POOL
+#define HAVE_POOL
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Threads that wait around for jobs, so that a job doesn't have to pay for
+ * starting them. Every job runs on every thread at once, and the thread that
+ * hands out the job is one of them. */
+struct pool {
+	pthread_t *threads;
+	size_t nthreads;            /* Counting the one that runs poolrun() */
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	void (*job)(void *arg, size_t worker);
+	void *arg;
+	uint64_t round;             /* Counts the jobs handed out so far */
+	size_t busy;                /* Threads still running the current job */
+	int stop;
+};
+
+/* Starts `threads` - 1 threads. The pool can't be used in a child after
+ * fork(), the threads aren't there anymore. */
+int poolinit(struct pool *pool, size_t threads);
+
+/* Calls job(arg, worker) on every thread, with a different `worker` from 0 up
+ * to nthreads - 1 on each, and waits for all of them to return */
+void poolrun(struct pool *pool, void (*job)(void *arg, size_t worker),
+		void *arg);
+
+void poolfree(struct pool *pool);
+
+int pooltest(int *passed, int *total);
+
+#endif
@@ -23,6 +23,8 @@
 
 #include <curses.h>
 
+#include <dates.h>
+
 #define KEY_ESCAPE '\x1b'
 
 enum tui_state {
@@ -38,6 +40,7 @@ int tui_cal(enum tui_state *state, WINDOW *win);
 int tui_viewday(enum tui_state *state, WINDOW *win);
 int tui_newevent(enum tui_state *state, WINDOW *win);
 
+int tui_cal_reset(WINDOW *win);
 int tui_viewday_reset(WINDOW *win);
 int tui_newevent_reset(WINDOW *win);
 
@@ -45,6 +48,26 @@ int tui_newevent_reset(WINDOW *win);
  * rest of the screen */
 void tui_calwidget(WINDOW *win, int top, int left, int w, int h,
 		int year, int mon, int day);
+/* Moves the selection of a calendar drawn by tui_calwidget with the same area
+ * and month from one day to another, only redrawing those two days */
+void tui_calmove(WINDOW *win, int top, int left, int w, int h,
+		int year, int mon, int from, int to);
+
+/* Reads the generation of the datefile, which the cache goes by until the next
+ * call. It's checked once before every key is handled, and has to be checked
+ * again after changing the datefile for the change to show up before that. */
+int tui_checkgeneration(void);
+/* The generation from the last check, fails if that check did */
+int tui_generation(uint64_t *ret);
+
+/* Searches for the events of every day of a month that isn't cached for the
+ * current generation of the datefile yet, all in one search */
+int tui_loadmonth(int mon, int year);
+/* Gets the events of a day, from the cache if the datefile hasn't changed
+ * since they were found. The list belongs to the cache and lasts until the
+ * datefile changes and the day is loaded again. */
+struct eventlist *tui_dayevents(int day, int mon, int year);
+void tui_freecache(void);
 
 extern char const * const months[12];
 extern char const * const weekdays[7];
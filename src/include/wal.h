@@ -0,0 +1,111 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+#ifndef HAVE_WAL
+#define HAVE_WAL
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <pagecache.h>
+
+/* Dirty pages after which an operation commits on its own */
+#define WAL_GROUP_PAGES 1024
+/* Log size after which a commit checkpoints */
+#define WAL_CHECKPOINT_SIZE (1 << 22)
+
+struct walpage {
+	uint64_t index;
+	size_t lo;                  /* The part of the page that was written */
+	size_t hi;
+	struct walpage *next;       /* Every dirty page, most recent first */
+	struct walpage *hnext;      /* Hash chain */
+	unsigned char data[CACHE_PAGESIZE];
+};
+
+struct walpunch {
+	uint64_t pos;
+	uint64_t len;
+};
+
+/* A write ahead log in front of a file. Writes don't go to the file right
+ * away, they're held in dirty pages that reads see through. walcommit() then
+ * appends everything written since the last commit to the log as one record,
+ * makes it durable with a single fdatasync, and only then writes it to the
+ * file. If we crash before the record is complete, none of it happened, and if
+ * we crash after, walopen() writes it again. The log is emptied once the file
+ * itself is synced (a checkpoint). */
+struct wal {
+	FILE *log;
+	int fd;                     /* The file the log is in front of */
+	struct pagecache *cache;    /* Kept in sync with what reaches the file */
+	struct walpage *pages;
+	struct walpage **table;
+	size_t tablesize;           /* Always a power of 2 */
+	size_t len;                 /* In pages */
+	struct walpunch *punches;   /* Holes to punch after the next commit */
+	size_t npunches;
+	size_t punchalloc;
+	uint64_t end;               /* The end of the file, counting dirty pages */
+	uint64_t fileend;           /* The end of the file on disk */
+	uint64_t logsize;
+};
+
+/* Opens or creates the log at `path` for the file open at `fd`, writing
+ * whatever a crash left in it to the file first */
+int walopen(struct wal *wal, char *path, int fd, struct pagecache *cache);
+
+/* Whether the log at `path` has anything in it that hasn't been checkpointed,
+ * in which case the file alone is out of date */
+int walpending(char *path);
+
+/* Reads `len` bytes at `pos`, including uncommitted writes. Fails if any of
+ * those bytes are past the end of the file. */
+int walread(struct wal *wal, uint64_t pos, void *buf, size_t len);
+
+int walwrite(struct wal *wal, uint64_t pos, const void *buf, size_t len);
+
+/* The size of the file once everything is committed */
+uint64_t walend(struct wal *wal);
+
+/* Frees `len` bytes at `pos` on disk once the next commit is done, since
+ * until then a crash might still need them */
+int walpunch(struct wal *wal, uint64_t pos, uint64_t len);
+
+int walcommit(struct wal *wal);
+
+/* Commits, syncs the file, and empties the log */
+int walcheckpoint(struct wal *wal);
+
+/* Catches up with commits and checkpoints made through another handle on the
+ * same log and file. There can't be any uncommitted writes. */
+int walsync(struct wal *wal);
+
+/* Moves the log over to a new file at the same path. The log has to be
+ * checkpointed first. */
+int walreplace(struct wal *wal, int fd);
+
+/* Checkpoints and closes the log, but not the file */
+int walclose(struct wal *wal);
+
+int waltest(int *passed, int *total);
+
+#endif
@@ -0,0 +1,313 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+/* For F_OFD_SETLKW */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <tests.h>
+#include <lock.h>
+
+/* Lock file representation:
+ *
+ *     struct {
+ *         uint64_t commits;            How many commits there have been
+ *     };
+ *
+ *   Big endian like everything else. The locks are on single bytes: byte 0 is
+ *   the writer lock and byte 1 is the commit lock.
+ *
+ *   Open file description locks belong to the open file instead of the
+ *   process, so two handles in one process keep each other out like two
+ *   processes would. Without them we fall back to plain POSIX locks, which
+ *   only work between processes.
+ * */
+
+#define LOCK_WRITER 0
+#define LOCK_COMMIT 1
+
+#ifdef F_OFD_SETLKW
+#define SETLKW F_OFD_SETLKW
+#define SETLK F_OFD_SETLK
+#define GETLK F_OFD_GETLK
+#else
+#define SETLKW F_SETLKW
+#define SETLK F_SETLK
+#define GETLK F_GETLK
+#endif
+
+static int setlock(struct datelock *lock, off_t byte, short type) {
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = byte,
+		.l_len = 1,
+	};
+	while (fcntl(lock->fd, type == F_UNLCK ? SETLK : SETLKW, &fl) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int readcommits(struct datelock *lock, uint64_t *ret) {
+	unsigned char buf[8];
+	ssize_t n;
+
+	if ((n = pread(lock->fd, buf, sizeof buf, 0)) == -1) {
+		return -1;
+	}
+	/* A new lock file hasn't counted anything yet */
+	*ret = 0;
+	if (n < (ssize_t) sizeof buf) {
+		return 0;
+	}
+	for (int i = 0; i < 8; ++i) {
+		*ret = (*ret << 8) | buf[i];
+	}
+	return 0;
+}
+
+/* Checks for commits since the last time, which only works while holding a
+ * lock that keeps commits out */
+static int checkcommits(struct datelock *lock, int *changed) {
+	uint64_t commits;
+	if (readcommits(lock, &commits)) {
+		return -1;
+	}
+	*changed = lock->known && commits != lock->seen;
+	lock->known = 1;
+	lock->seen = commits;
+	return 0;
+}
+
+/* Whether this handle would have to wait for a `type` lock on `byte` */
+static int blocked(struct datelock *lock, off_t byte, short type) {
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = byte,
+		.l_len = 1,
+	};
+	if (fcntl(lock->fd, GETLK, &fl) == -1) {
+		return -1;
+	}
+	return fl.l_type != F_UNLCK;
+}
+
+int lockbusy(struct datelock *lock) {
+	if (lock->fd == -1 || lock->writing) {
+		return 0;
+	}
+	return blocked(lock, LOCK_WRITER, F_WRLCK) == 1;
+}
+
+int lockopen(struct datelock *lock, char *path, int writable) {
+	lock->readers = lock->writing = lock->committing = 0;
+	lock->known = 0;
+	lock->seen = 0;
+	if ((lock->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) != -1) {
+		return 0;
+	}
+	if (writable) {
+		return -1;
+	}
+	/* Shared locks work on files opened read only too */
+	lock->fd = open(path, O_RDONLY | O_CLOEXEC);
+	return 0;
+}
+
+void lockclose(struct datelock *lock) {
+	if (lock->fd != -1) {
+		close(lock->fd);
+		lock->fd = -1;
+	}
+}
+
+int lockread(struct datelock *lock, int *changed) {
+	*changed = 0;
+	if (lock->fd == -1) {
+		return 0;
+	}
+	if (lock->readers > 0 || lock->committing) {
+		++lock->readers;
+		return 0;
+	}
+	if (setlock(lock, LOCK_COMMIT, F_RDLCK)) {
+		return -1;
+	}
+	if (checkcommits(lock, changed)) {
+		setlock(lock, LOCK_COMMIT, F_UNLCK);
+		return -1;
+	}
+	++lock->readers;
+	return 0;
+}
+
+void unlockread(struct datelock *lock) {
+	if (lock->fd == -1) {
+		return;
+	}
+	if (--lock->readers == 0 && !lock->committing) {
+		setlock(lock, LOCK_COMMIT, F_UNLCK);
+	}
+}
+
+int lockwrite(struct datelock *lock, int *changed) {
+	*changed = 0;
+	if (lock->fd == -1 || lock->writing) {
+		return 0;
+	}
+	if (setlock(lock, LOCK_WRITER, F_WRLCK)) {
+		return -1;
+	}
+	/* Commits only happen under the writer lock, so now the count can't
+	 * change under us */
+	if (checkcommits(lock, changed)) {
+		setlock(lock, LOCK_WRITER, F_UNLCK);
+		return -1;
+	}
+	lock->writing = 1;
+	return 0;
+}
+
+void unlockwrite(struct datelock *lock) {
+	if (lock->fd == -1 || !lock->writing) {
+		return;
+	}
+	setlock(lock, LOCK_WRITER, F_UNLCK);
+	lock->writing = 0;
+}
+
+int lockcommit(struct datelock *lock) {
+	if (lock->fd == -1) {
+		return 0;
+	}
+	if (!lock->writing || lock->committing) {
+		return -1;
+	}
+	/* A shared lock this handle holds is turned into the exclusive one */
+	if (setlock(lock, LOCK_COMMIT, F_WRLCK)) {
+		return -1;
+	}
+	lock->committing = 1;
+	return 0;
+}
+
+int unlockcommit(struct datelock *lock, int changed) {
+	unsigned char buf[8];
+	uint64_t commits;
+	int ret = 0;
+
+	if (lock->fd == -1 || !lock->committing) {
+		return 0;
+	}
+	if (changed) {
+		if (readcommits(lock, &commits)) {
+			ret = -1;
+		}
+		else {
+			++commits;
+			for (int i = 7; i >= 0; --i) {
+				buf[i] = (unsigned char) (commits >> (56 - 8*i));
+			}
+			if (pwrite(lock->fd, buf, sizeof buf, 0) !=
+					(ssize_t) sizeof buf) {
+				ret = -1;
+			}
+			lock->seen = commits;
+			lock->known = 1;
+		}
+	}
+	lock->committing = 0;
+	if (setlock(lock, LOCK_COMMIT,
+				lock->readers > 0 ? F_RDLCK : F_UNLCK)) {
+		ret = -1;
+	}
+	return ret;
+}
+
+#ifdef NREM_TESTS
+int locktest(int *passed, int *total) {
+	char path[] = "/tmp/nremlocktestXXXXXX";
+	struct datelock a, b;
+	int fd, changed;
+
+	NREM_ASSERT((fd = mkstemp(path)) != -1);
+	if (fd == -1) {
+		return 1;
+	}
+	close(fd);
+	NREM_ASSERT(lockopen(&a, path, 1) == 0);
+	NREM_ASSERT(lockopen(&b, path, 0) == 0);
+
+	/* Readers share, and nested reads only lock once */
+	NREM_ASSERT(lockread(&a, &changed) == 0 && !changed);
+	NREM_ASSERT(lockread(&a, &changed) == 0 && !changed);
+	NREM_ASSERT(lockread(&b, &changed) == 0 && !changed);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_RDLCK) == 0);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_WRLCK) == 1);
+	unlockread(&a);
+	unlockread(&b);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_WRLCK) == 1);
+	unlockread(&a);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_WRLCK) == 0);
+
+	/* A writer only keeps readers out while it commits */
+	NREM_ASSERT(lockwrite(&a, &changed) == 0 && !changed);
+	NREM_ASSERT(blocked(&b, LOCK_WRITER, F_WRLCK) == 1);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_RDLCK) == 0);
+	NREM_ASSERT(lockread(&a, &changed) == 0);
+	NREM_ASSERT(lockcommit(&a) == 0);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_RDLCK) == 1);
+	NREM_ASSERT(unlockcommit(&a, 1) == 0);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_RDLCK) == 0);
+	NREM_ASSERT(blocked(&b, LOCK_COMMIT, F_WRLCK) == 1);
+	unlockread(&a);
+	unlockwrite(&a);
+	NREM_ASSERT(blocked(&b, LOCK_WRITER, F_WRLCK) == 0);
+
+	/* The other handle sees the commit once, and the committer never */
+	NREM_ASSERT(lockread(&b, &changed) == 0 && changed);
+	unlockread(&b);
+	NREM_ASSERT(lockread(&b, &changed) == 0 && !changed);
+	unlockread(&b);
+	NREM_ASSERT(lockread(&a, &changed) == 0 && !changed);
+	unlockread(&a);
+
+	/* Committing needs the writer lock */
+	NREM_ASSERT(lockcommit(&a) == -1);
+
+	lockclose(&a);
+	lockclose(&b);
+	unlink(path);
+	return 0;
+}
+#else
+int locktest(int *passed, int *total) {
+	++*total;
+	return 1;
+}
+#endif
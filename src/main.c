@@ -51,28 +51,57 @@ int main(int argc, char **argv) {
 		fputs("Failed to get datefile path, set $DATEFILE\n", stderr);
 		return 1;
 	}
-	if (dateopen(path, &f)) {
+	/* Searches and counts never write to the datefile, so they use the
+	 * memory mapped read only mode when they can */
+	int opened = 0;
+	if (argc >= 3 && strcmp(argv[1], "cli") == 0 &&
+	    (strcmp(argv[2], "search") == 0 ||
+	     strcmp(argv[2], "count") == 0)) {
+		opened = dateopenro(path, &f) == 0;
+	}
+	if (!opened && dateopen(path, &f)) {
 		fprintf(stderr, "Failed to open datefile %s\n", path);
 		return 1;
 	}
+	/* Searches are split between threads if asked to. They work just the
+	 * same without them, so it's fine if they can't be started. */
+	if ((env = getenv("NREM_THREADS")) != NULL) {
+		datesetparallel(&f, atoi(env), 0);
+	}
 
+	int ret;
 	if (strcmp(argv[1], "cli") == 0) {
-		return nremcli(argc-1, argv+1);
+		ret = nremcli(argc-1, argv+1);
 	}
-	if (strcmp(argv[1], "tui") == 0) {
-		return nremtui(argc-1, argv+1);
+	else if (strcmp(argv[1], "tui") == 0) {
+		/* The calendar searches every day of the month each time it's
+		 * drawn. Without the mirror that's just slower, so it's fine if
+		 * it can't be loaded. */
+		datemirror(&f);
+		ret = nremtui(argc-1, argv+1);
 	}
-	if (strcmp(argv[1], "test") == 0) {
-		int passed, total, status;
+	else if (strcmp(argv[1], "test") == 0) {
+		int passed, total;
 		passed = total = 0;
-		status = runtests(&passed, &total);
+		ret = runtests(&passed, &total);
 		if (passed < total) {
 			fputs("NOT ALL TESTS PASSED!\n", stderr);
 		}
 		fprintf(stderr, "%d/%d tests passed\n", passed, total);
-		return status;
+	}
+	else {
+		fprintf(stderr, "Invalid command %s\n", argv[1]);
+		ret = 1;
 	}
 
-	fprintf(stderr, "Invalid command %s\n", argv[1]);
-	return 1;
+	/* Nothing is durable until it's committed */
+	if (datecommit(&f)) {
+		fprintf(stderr, "Failed to commit datefile %s\n", path);
+		ret = 1;
+	}
+	if (dateclose(&f)) {
+		fprintf(stderr, "Failed to close datefile %s\n", path);
+		ret = 1;
+	}
+	return ret;
 }
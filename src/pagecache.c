@@ -0,0 +1,375 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <tests.h>
+#include <pagecache.h>
+
+static inline size_t hashpage(struct pagecache *cache, uint64_t index) {
+	/* Fibonacci hashing, consecutive pages are the common case */
+	return (size_t) ((index * 0x9e3779b97f4a7c15llu) >> 32) &
+		(cache->tablesize - 1);
+}
+
+int cacheinit(struct pagecache *cache, int fd, size_t capacity) {
+	cache->fd = fd;
+	cache->capacity = capacity;
+	cache->len = 0;
+	cache->head = cache->tail = NULL;
+	cache->pages = NULL;
+	cache->table = NULL;
+	cache->tablesize = 0;
+	cache->hits = cache->misses = 0;
+
+	if (capacity == 0) {
+		return 0;
+	}
+
+	for (cache->tablesize = 1; cache->tablesize < capacity * 2;
+			cache->tablesize <<= 1) ;
+
+	cache->pages = malloc(capacity * sizeof *cache->pages);
+	cache->table = calloc(cache->tablesize, sizeof *cache->table);
+	if (cache->pages == NULL || cache->table == NULL) {
+		cachefree(cache);
+		return -1;
+	}
+	return 0;
+}
+
+int cacheresize(struct pagecache *cache, size_t capacity) {
+	uint64_t hits, misses;
+	hits = cache->hits;
+	misses = cache->misses;
+	cachefree(cache);
+	if (cacheinit(cache, cache->fd, capacity)) {
+		return -1;
+	}
+	cache->hits = hits;
+	cache->misses = misses;
+	return 0;
+}
+
+void cacheclear(struct pagecache *cache) {
+	cache->len = 0;
+	cache->head = cache->tail = NULL;
+	if (cache->table != NULL) {
+		memset(cache->table, 0,
+				cache->tablesize * sizeof *cache->table);
+	}
+}
+
+void cachefree(struct pagecache *cache) {
+	free(cache->pages);
+	free(cache->table);
+	cache->pages = NULL;
+	cache->table = NULL;
+	cache->capacity = cache->len = 0;
+	cache->head = cache->tail = NULL;
+}
+
+static struct cachepage *findpage(struct pagecache *cache, uint64_t index) {
+	struct cachepage *iter;
+	for (iter = cache->table[hashpage(cache, index)]; iter != NULL;
+			iter = iter->hnext) {
+		if (iter->index == index) {
+			return iter;
+		}
+	}
+	return NULL;
+}
+
+static void unlinkpage(struct pagecache *cache, struct cachepage *page) {
+	if (page->prev != NULL) {
+		page->prev->next = page->next;
+	}
+	else {
+		cache->head = page->next;
+	}
+	if (page->next != NULL) {
+		page->next->prev = page->prev;
+	}
+	else {
+		cache->tail = page->prev;
+	}
+}
+
+static void pushpage(struct pagecache *cache, struct cachepage *page) {
+	page->prev = NULL;
+	page->next = cache->head;
+	if (cache->head != NULL) {
+		cache->head->prev = page;
+	}
+	else {
+		cache->tail = page;
+	}
+	cache->head = page;
+}
+
+static void appendpage(struct pagecache *cache, struct cachepage *page) {
+	page->prev = cache->tail;
+	page->next = NULL;
+	if (cache->tail != NULL) {
+		cache->tail->next = page;
+	}
+	else {
+		cache->head = page;
+	}
+	cache->tail = page;
+}
+
+static void unhashpage(struct pagecache *cache, struct cachepage *page) {
+	struct cachepage **iter;
+	for (iter = cache->table + hashpage(cache, page->index); *iter != NULL;
+			iter = &(*iter)->hnext) {
+		if (*iter == page) {
+			*iter = page->hnext;
+			return;
+		}
+	}
+}
+
+/* Reads up to `len` bytes at `pos`. Returns how much was read before EOF, or
+ * -1 on failure. */
+static ssize_t readpos(int fd, uint64_t pos, void *buf, size_t len) {
+	unsigned char *out = buf;
+	size_t done = 0;
+
+	if (pos > (uint64_t) INT64_MAX - len) {
+		return -1;
+	}
+	while (done < len) {
+		ssize_t n = pread(fd, out + done, len - done,
+				(off_t) (pos + done));
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += (size_t) n;
+	}
+	return (ssize_t) done;
+}
+
+static struct cachepage *getpage(struct pagecache *cache, uint64_t index) {
+	struct cachepage *page;
+	ssize_t len;
+
+	if ((page = findpage(cache, index)) != NULL) {
+		++cache->hits;
+		if (page != cache->head) {
+			unlinkpage(cache, page);
+			pushpage(cache, page);
+		}
+		return page;
+	}
+	++cache->misses;
+
+	/* Evict the least recently used page if we're out of room */
+	if (cache->len < cache->capacity) {
+		page = cache->pages + cache->len++;
+	}
+	else {
+		page = cache->tail;
+		unlinkpage(cache, page);
+		unhashpage(cache, page);
+	}
+
+	if (index > LONG_MAX / CACHE_PAGESIZE ||
+	    (len = readpos(cache->fd, index * CACHE_PAGESIZE,
+			page->data, CACHE_PAGESIZE)) == -1) {
+		goto error;
+	}
+
+	page->index = index;
+	page->len = (size_t) len;
+	page->hnext = cache->table[hashpage(cache, index)];
+	cache->table[hashpage(cache, index)] = page;
+	pushpage(cache, page);
+	return page;
+error:
+	/* Nothing is cached in this page anymore, so put it at the back of the
+	 * list where it gets reused first */
+	page->index = UINT64_MAX;
+	page->len = 0;
+	page->hnext = NULL;
+	appendpage(cache, page);
+	return NULL;
+}
+
+int cacheread(struct pagecache *cache, uint64_t pos, void *buf, size_t len) {
+	unsigned char *out = buf;
+
+	if (cache->capacity == 0) {
+		return readpos(cache->fd, pos, buf, len) == (ssize_t) len ?
+			0:-1;
+	}
+
+	while (len > 0) {
+		struct cachepage *page;
+		size_t pageoff, n;
+
+		if ((page = getpage(cache, pos / CACHE_PAGESIZE)) == NULL) {
+			return -1;
+		}
+		pageoff = (size_t) (pos % CACHE_PAGESIZE);
+		if (pageoff >= page->len && page->len < CACHE_PAGESIZE) {
+			/* A short page ended where the file did when it was
+			 * read, and writes further on may have grown it since */
+			unhashpage(cache, page);
+			page->index = UINT64_MAX;
+			page->len = 0;
+			if ((page = getpage(cache, pos / CACHE_PAGESIZE)) ==
+					NULL) {
+				return -1;
+			}
+		}
+		if (pageoff >= page->len) {
+			return -1;
+		}
+		n = page->len - pageoff;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(out, page->data + pageoff, n);
+		out += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void cachewrote(struct pagecache *cache, uint64_t pos,
+		const void *buf, size_t len) {
+	const unsigned char *in = buf;
+
+	if (cache->capacity == 0) {
+		return;
+	}
+
+	while (len > 0) {
+		struct cachepage *page;
+		size_t pageoff, n;
+
+		pageoff = (size_t) (pos % CACHE_PAGESIZE);
+		n = CACHE_PAGESIZE - pageoff;
+		if (n > len) {
+			n = len;
+		}
+
+		page = findpage(cache, pos / CACHE_PAGESIZE);
+		if (page != NULL) {
+			if (pageoff <= page->len) {
+				memcpy(page->data + pageoff, in, n);
+				if (pageoff + n > page->len) {
+					page->len = pageoff + n;
+				}
+			}
+			else {
+				/* There'd be a gap in the page, so just forget
+				 * about it */
+				unhashpage(cache, page);
+				page->index = UINT64_MAX;
+				page->len = 0;
+			}
+		}
+
+		in += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+#ifdef NREM_TESTS
+int cachetest(int *passed, int *total) {
+	struct pagecache cache;
+	unsigned char data[CACHE_PAGESIZE * 3 + 100];
+	unsigned char buf[200];
+	FILE *file;
+
+	for (size_t i = 0; i < sizeof data; ++i) {
+		data[i] = (unsigned char) (i * 7);
+	}
+	NREM_ASSERT((file = tmpfile()) != NULL);
+	if (file == NULL) {
+		return 1;
+	}
+	NREM_ASSERT(fwrite(data, sizeof data, 1, file) == 1);
+	fflush(file);
+
+	NREM_ASSERT(cacheinit(&cache, fileno(file), 2) == 0);
+
+	/* Straddles the first two pages */
+	NREM_ASSERT(cacheread(&cache, CACHE_PAGESIZE - 50, buf, 100) == 0);
+	NREM_ASSERT(memcmp(buf, data + CACHE_PAGESIZE - 50, 100) == 0);
+	NREM_ASSERT(cache.misses == 2 && cache.hits == 0);
+	NREM_ASSERT(cacheread(&cache, 10, buf, 10) == 0);
+	NREM_ASSERT(cache.misses == 2 && cache.hits == 1);
+
+	/* Page 1 is the least recently used, so it gets evicted */
+	NREM_ASSERT(cacheread(&cache, CACHE_PAGESIZE * 2, buf, 10) == 0);
+	NREM_ASSERT(cacheread(&cache, 0, buf, 10) == 0);
+	NREM_ASSERT(cache.misses == 3 && cache.hits == 2);
+	NREM_ASSERT(cacheread(&cache, CACHE_PAGESIZE, buf, 10) == 0);
+	NREM_ASSERT(cache.misses == 4);
+
+	/* Reads past EOF fail */
+	NREM_ASSERT(cacheread(&cache, sizeof data - 10, buf, 20) == -1);
+
+	/* Writes show up in the cache, including ones that extend the file */
+	memset(buf, 0xaa, sizeof buf);
+	fseek(file, sizeof data - 10, SEEK_SET);
+	fwrite(buf, 20, 1, file);
+	fflush(file);
+	NREM_ASSERT(cacheread(&cache, sizeof data - 10, buf, 10) == 0);
+	cachewrote(&cache, sizeof data - 10, buf, 20);
+	NREM_ASSERT(cacheread(&cache, sizeof data - 10, buf + 100, 20) == 0);
+	NREM_ASSERT(memcmp(buf, buf + 100, 20) == 0);
+
+	/* A short page is read again once the file has grown past it */
+	fseek(file, CACHE_PAGESIZE * 4, SEEK_SET);
+	fwrite(buf, 1, 1, file);
+	fflush(file);
+	NREM_ASSERT(cacheread(&cache, sizeof data + 10, buf, 10) == 0);
+	NREM_ASSERT(buf[0] == 0 && buf[9] == 0);
+
+	NREM_ASSERT(cacheresize(&cache, 0) == 0);
+	NREM_ASSERT(cacheread(&cache, 5, buf, 10) == 0);
+	NREM_ASSERT(memcmp(buf, data + 5, 10) == 0);
+
+	cachefree(&cache);
+	fclose(file);
+	return 0;
+}
+#else
+int cachetest(int *passed, int *total) {
+	++*total;
+	return 1;
+}
+#endif
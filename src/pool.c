@@ -0,0 +1,210 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <tests.h>
+#include <pool.h>
+
+struct poolworker {
+	struct pool *pool;
+	size_t index;
+};
+
+static void *poolthread(void *arg) {
+	struct poolworker *worker = arg;
+	struct pool *pool = worker->pool;
+	size_t index = worker->index;
+	uint64_t round = 0;
+
+	free(worker);
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		void (*job)(void *arg, size_t worker);
+		void *jobarg;
+
+		while (!pool->stop && pool->round == round) {
+			pthread_cond_wait(&pool->wake, &pool->mutex);
+		}
+		if (pool->stop) {
+			break;
+		}
+		round = pool->round;
+		job = pool->job;
+		jobarg = pool->arg;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job(jobarg, index);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+int poolinit(struct pool *pool, size_t threads) {
+	pool->nthreads = 1;
+	pool->round = 0;
+	pool->busy = 0;
+	pool->stop = 0;
+	if (threads == 0 ||
+	    (pool->threads = malloc(threads * sizeof *pool->threads)) ==
+			NULL) {
+		return -1;
+	}
+	if (pthread_mutex_init(&pool->mutex, NULL)) {
+		goto errormutex;
+	}
+	if (pthread_cond_init(&pool->wake, NULL)) {
+		goto errorwake;
+	}
+	if (pthread_cond_init(&pool->done, NULL)) {
+		goto errordone;
+	}
+
+	/* The thread that calls poolrun() is worker 0 */
+	while (pool->nthreads < threads) {
+		struct poolworker *worker;
+		if ((worker = malloc(sizeof *worker)) == NULL) {
+			goto errorthreads;
+		}
+		worker->pool = pool;
+		worker->index = pool->nthreads;
+		if (pthread_create(pool->threads + pool->nthreads, NULL,
+				poolthread, worker)) {
+			free(worker);
+			goto errorthreads;
+		}
+		++pool->nthreads;
+	}
+	return 0;
+errorthreads:
+	poolfree(pool);
+	return -1;
+errordone:
+	pthread_cond_destroy(&pool->wake);
+errorwake:
+	pthread_mutex_destroy(&pool->mutex);
+errormutex:
+	free(pool->threads);
+	return -1;
+}
+
+void poolrun(struct pool *pool, void (*job)(void *arg, size_t worker),
+		void *arg) {
+	if (pool->nthreads == 1) {
+		job(arg, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->job = job;
+	pool->arg = arg;
+	pool->busy = pool->nthreads - 1;
+	++pool->round;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->mutex);
+
+	job(arg, 0);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->busy > 0) {
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void poolfree(struct pool *pool) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->mutex);
+	for (size_t i = 1; i < pool->nthreads; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+}
+
+#ifdef NREM_TESTS
+#define TEST_THREADS 4
+#define TEST_ROUNDS 100
+
+struct testjob {
+	atomic_int calls[TEST_THREADS];
+	atomic_int total;
+};
+
+static void testjob(void *arg, size_t worker) {
+	struct testjob *job = arg;
+	atomic_fetch_add(&job->calls[worker], 1);
+	atomic_fetch_add(&job->total, 1);
+}
+
+int pooltest(int *passed, int *total) {
+	struct pool pool;
+	struct testjob job;
+	int ok;
+
+	for (int i = 0; i < TEST_THREADS; ++i) {
+		atomic_init(&job.calls[i], 0);
+	}
+	atomic_init(&job.total, 0);
+
+	NREM_ASSERT(poolinit(&pool, 0) == -1);
+
+	/* One thread just runs the job on the caller */
+	NREM_ASSERT(poolinit(&pool, 1) == 0);
+	poolrun(&pool, testjob, &job);
+	NREM_ASSERT(atomic_load(&job.calls[0]) == 1 &&
+			atomic_load(&job.total) == 1);
+	poolfree(&pool);
+
+	/* Every job runs once on each thread, and poolrun() doesn't return
+	 * until all of them are done */
+	NREM_ASSERT(poolinit(&pool, TEST_THREADS) == 0);
+	NREM_ASSERT(pool.nthreads == TEST_THREADS);
+	ok = 1;
+	for (int i = 0; i < TEST_ROUNDS; ++i) {
+		poolrun(&pool, testjob, &job);
+		if (atomic_load(&job.total) != 1 + (i + 1) * TEST_THREADS) {
+			ok = 0;
+		}
+	}
+	NREM_ASSERT(ok);
+	NREM_ASSERT(atomic_load(&job.calls[0]) == 1 + TEST_ROUNDS);
+	for (int i = 1; i < TEST_THREADS; ++i) {
+		NREM_ASSERT(atomic_load(&job.calls[i]) == TEST_ROUNDS);
+	}
+	poolfree(&pool);
+	return 0;
+}
+#else
+int pooltest(int *passed, int *total) {
+	++*total;
+	return 1;
+}
+#endif
@@ -21,6 +21,10 @@
 #include <util.h>
 #include <tests.h>
 #include <dates.h>
+#include <pagecache.h>
+#include <wal.h>
+#include <lock.h>
+#include <pool.h>
 
 #ifdef NREM_TESTS
 
@@ -35,6 +39,18 @@ int runtests(int *passed, int *total) {
 	if (utiltest(passed, total)) {
 		ret = 1;
 	}
+	if (cachetest(passed, total)) {
+		ret = 1;
+	}
+	if (waltest(passed, total)) {
+		ret = 1;
+	}
+	if (locktest(passed, total)) {
+		ret = 1;
+	}
+	if (pooltest(passed, total)) {
+		ret = 1;
+	}
 
 	return ret;
 }
@@ -51,6 +51,106 @@ char const * const weekdays[] = {
 int tui_hascolor;
 static int dump;
 
+/* The events of single days, tagged with the generation of the datefile they
+ * were found in. A day's slot only depends on its place in the month, so the
+ * days of a month never push each other out. */
+#define DAYCACHE_SIZE 64
+static struct {
+	int day, mon, year;
+	uint64_t generation;
+	struct eventlist *events;
+} daycache[DAYCACHE_SIZE];
+
+static int dayslot(int day, int mon, int year) {
+	return ((year * 12 + mon) * 31 + day) % DAYCACHE_SIZE;
+}
+
+static int daycached(int day, int mon, int year, uint64_t generation) {
+	int slot = dayslot(day, mon, year);
+	return daycache[slot].events != NULL &&
+		daycache[slot].day == day && daycache[slot].mon == mon &&
+		daycache[slot].year == year &&
+		daycache[slot].generation == generation;
+}
+
+/* The generation of the datefile as of the last check, if it could be read */
+static uint64_t checkedgen;
+static int checkedok;
+
+int tui_checkgeneration(void) {
+	checkedok = dategeneration(&f, &checkedgen) == 0;
+	return !checkedok;
+}
+
+int tui_generation(uint64_t *ret) {
+	*ret = checkedgen;
+	return checkedok ? 0:-1;
+}
+
+static void daystore(int day, int mon, int year, uint64_t generation,
+		struct eventlist *events) {
+	int slot = dayslot(day, mon, year);
+	freeeventlist(daycache[slot].events);
+	daycache[slot].day = day;
+	daycache[slot].mon = mon;
+	daycache[slot].year = year;
+	daycache[slot].generation = generation;
+	daycache[slot].events = events;
+}
+
+int tui_loadmonth(int mon, int year) {
+	struct daterange ranges[31];
+	struct eventlist *lists[31];
+	int days[31];
+	int monthlen = getmonthlen(year, mon);
+	size_t n = 0;
+
+	if (!checkedok) {
+		return 1;
+	}
+	for (int i = 0; i < monthlen; ++i) {
+		if (!daycached(i, mon, year, checkedgen)) {
+			ranges[n].start = findstart(i, mon, year);
+			ranges[n].end = findend(i, mon, year);
+			days[n++] = i;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+	if (datesearchmulti(&f, ranges, n, lists)) {
+		return 1;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		daystore(days[i], mon, year, checkedgen, lists[i]);
+	}
+	return 0;
+}
+
+struct eventlist *tui_dayevents(int day, int mon, int year) {
+	struct eventlist *events;
+
+	if (!checkedok) {
+		return NULL;
+	}
+	if (!daycached(day, mon, year, checkedgen)) {
+		events = datesearch(&f, findstart(day, mon, year),
+				findend(day, mon, year));
+		if (events == NULL) {
+			return NULL;
+		}
+		daystore(day, mon, year, checkedgen, events);
+	}
+	return daycache[dayslot(day, mon, year)].events;
+}
+
+void tui_freecache(void) {
+	for (int i = 0; i < DAYCACHE_SIZE; ++i) {
+		freeeventlist(daycache[i].events);
+		daycache[i].events = NULL;
+	}
+}
+
 int nremtui(int argc, char **argv) {
 	WINDOW *win;
 	enum tui_state state, prevstate;
@@ -82,12 +182,16 @@ int nremtui(int argc, char **argv) {
 		[NEWEVENT] = tui_newevent,
 	};
 	int (*resets[])(WINDOW *win) = {
-		[VIEWCAL] = NULL,
+		[VIEWCAL] = tui_cal_reset,
 		[VIEWDAY] = tui_viewday_reset,
 		[NEWEVENT] = tui_newevent_reset,
 	};
 
 	for (;;) {
+		/* Everything drawn for one key goes by the same generation,
+		 * however many days it looks up. A failed check just means
+		 * nothing is cached until the next one. */
+		tui_checkgeneration();
 		if (state != prevstate && resets[state] != NULL) {
 			if ((ret = resets[state](win)) != 0) {
 				goto end;
@@ -110,12 +214,21 @@ int nremtui(int argc, char **argv) {
 	}
 
 end:
+	tui_freecache();
 	endwin();
 	return ret;
 }
 
-void tui_calwidget(WINDOW *win, int top, int left, int w, int h,
-		int year, int mon, int day) {
+/* Where the parts of a calendar go */
+struct calgeom {
+	int top;
+	int leftmargin, topmargin;
+	int boxwidth, boxheight, calwidth;
+	int weeks, firstday, monthlen;
+};
+
+static void calgeometry(WINDOW *win, int top, int left, int w, int h,
+		int year, int mon, struct calgeom *ret) {
 	int winw, winh;
 	getmaxyx(win, winh, winw);
 
@@ -126,104 +239,140 @@ void tui_calwidget(WINDOW *win, int top, int left, int w, int h,
 		h = winh - top;
 	}
 
-	int boxwidth = (w-1)/7;
-	int boxheight = (h-1)/6;
-	int calwidth = boxwidth*7+1;
-	int leftmargin = left + (w - calwidth) / 2;
-	int topmargin = top + 2;
-	wmove(win, top, leftmargin+1);
-	wattron(win, A_UNDERLINE);
-	for (int i = 0; i < calwidth-2; ++i) {
-		waddch(win, ' ');
+	ret->top = top;
+	ret->boxwidth = (w-1)/7;
+	ret->boxheight = (h-1)/6;
+	ret->calwidth = ret->boxwidth*7+1;
+	ret->leftmargin = left + (w - ret->calwidth) / 2;
+	ret->topmargin = top + 2;
+	ret->weeks = getweeks(year, mon);
+	ret->firstday = getfirstday(year, mon);
+	ret->monthlen = getmonthlen(year, mon);
+}
+
+/* Draws the box of one cell of a calendar, counting cells from the top left.
+ * The events are only looked up if the month is `loaded`. If it's the cell
+ * of `day`, the cursor's place goes in `cursory` and `cursorx`. */
+static void drawcell(WINDOW *win, struct calgeom *geom, int cell, int loaded,
+		int year, int mon, int day, int *cursory, int *cursorx) {
+	struct eventlist *events = NULL;
+	int i = cell / 7, j = cell % 7;
+	int currday = cell - geom->firstday;
+	int boxwidth = geom->boxwidth;
+
+	if (0 <= currday && currday < geom->monthlen) {
+		if (loaded) {
+			events = tui_dayevents(currday, mon, year);
+		}
+	}
+	else {
+		currday = -1;
+	}
+	for (int r = 0; r < geom->boxheight; ++r) {
+		chtype attrs = 0;
+		int cy, cx, newcx;
+
+		wmove(win, geom->topmargin + i*geom->boxheight+r,
+				geom->leftmargin + j*boxwidth);
+		waddch(win, '|');
+
+		if (currday == day && tui_hascolor) {
+			attrs |= COLOR_PAIR(COL_BRIGHT);
+		}
+		if (r == geom->boxheight-1) {
+			attrs |= A_UNDERLINE;
+		}
+		wattron(win, attrs);
+
+		getyx(win, cy, cx);
+
+		if (r == 0 && currday == day) {
+			*cursory = cy;
+			*cursorx = cx;
+		}
+
+		if (currday != -1 && r == 0) {
+			char date[20];
+			sprintf(date, "%d", currday+1);
+			waddnstr(win, date, boxwidth-1);
+		}
+		if (events != NULL && r > 0 && r <= events->len) {
+			waddnstr(win, events->events[r-1].name, boxwidth-1);
+		}
+
+		getyx(win, dump, newcx);
+		if (newcx < cx + boxwidth - 1) {
+			whline(win, ' ' | attrs, cx + boxwidth - 1 - newcx);
+		}
+		wattroff(win, attrs);
+		wmove(win, cy, cx + boxwidth - 1);
+		waddch(win, '|');
 	}
-	wattroff(win, A_UNDERLINE);
-	wmove(win, top + 1, leftmargin);
+}
+
+void tui_calwidget(WINDOW *win, int top, int left, int w, int h,
+		int year, int mon, int day) {
+	struct calgeom geom;
+	int cursorx, cursory;
+	int loaded;
+
+	calgeometry(win, top, left, w, h, year, mon, &geom);
+	wmove(win, top, geom.leftmargin+1);
+	whline(win, ' ' | A_UNDERLINE, geom.calwidth-2);
+	wmove(win, top + 1, geom.leftmargin);
 	waddch(win, '|');
-	wattron(win, A_UNDERLINE);
 	for (int i = 0; i < 7; ++i) {
 		int curx;
-		wmove(win, top + 1, i * boxwidth + leftmargin + 1);
+		wmove(win, top + 1, i * geom.boxwidth + geom.leftmargin + 1);
+		wattron(win, A_UNDERLINE);
 		waddstr(win, weekdays[i]);
-		for (getyx(win, dump, curx);
-				curx < (i+1) * boxwidth + leftmargin;
-				++curx) {
-			waddch(win, ' ');
+		getyx(win, dump, curx);
+		if (curx < (i+1) * geom.boxwidth + geom.leftmargin) {
+			whline(win, ' ' | A_UNDERLINE,
+				(i+1) * geom.boxwidth + geom.leftmargin - curx);
 		}
 		if (i == 6) {
 			wattroff(win, A_UNDERLINE);
 		}
+		wmove(win, top + 1, (i+1) * geom.boxwidth + geom.leftmargin);
 		waddch(win, '|');
 	}
 
-	int weeks = getweeks(year, mon);
-	int firstday = getfirstday(year, mon);
-	int cursorx, cursory;
-	int monthlen = getmonthlen(year, mon);
+	/* The days of the month come from the cache, or from one search if
+	 * the datefile changed. If that fails the days are just drawn empty. */
+	loaded = tui_loadmonth(mon, year) == 0;
+
 	cursorx = cursory = -1;
+	for (int i = 0; i < geom.weeks * 7; ++i) {
+		drawcell(win, &geom, i, loaded, year, mon, day,
+				&cursory, &cursorx);
+	}
 
-	for (int i = 0; i < weeks; ++i) {
-		for (int j = 0; j < 7; ++j) {
-			struct eventlist *events = NULL;
-			int currday = i*7 + j - firstday;
-			if (0 <= currday && currday < monthlen) {
-				time_t start, end;
-				start = findstart(currday, mon, year);
-				end = findend(currday, mon, year);
-				events = datesearch(&f, start, end);
-			}
-			else {
-				currday = -1;
-			}
-			for (int r = 0; r < boxheight; ++r) {
-				wmove(win, topmargin + i*boxheight+r,
-						leftmargin + j*boxwidth);
-				waddch(win, '|');
-
-				if (currday == day && tui_hascolor) {
-					wattron(win, COLOR_PAIR(COL_BRIGHT));
-				}
-				if (r == boxheight-1) {
-					wattron(win, A_UNDERLINE);
-				}
-
-				int cy, cx;
-				getyx(win, cy, cx);
-
-				if (r == 0 && currday == day) {
-					cursory = cy;
-					cursorx = cx;
-				}
-
-				if (currday != -1 && r == 0) {
-					char date[20];
-					sprintf(date, "%d", currday+1);
-					waddnstr(win, date, boxwidth-1);
-				}
-				if (events != NULL &&
-						r > 0 && r <= events->len) {
-					waddnstr(win, events->events[r-1].name,
-							boxwidth-1);
-				}
-
-				int newcx;
-				for (getyx(win, dump, newcx);
-						newcx < cx + boxwidth - 1;
-						++newcx) {
-					waddch(win, ' ');
-				}
-				wattroff(win, A_UNDERLINE);
-				if (currday == day && tui_hascolor) {
-					wattroff(win, COLOR_PAIR(COL_BRIGHT));
-				}
-				waddch(win, '|');
-			}
-			freeeventlist(events);
-		}
+	if (cursorx != -1 && cursory != -1) {
+		wmove(win, cursory, cursorx);
 	}
 
+	wnoutrefresh(win);
+}
+
+void tui_calmove(WINDOW *win, int top, int left, int w, int h,
+		int year, int mon, int from, int to) {
+	struct calgeom geom;
+	int cursorx, cursory;
+	int loaded;
+
+	calgeometry(win, top, left, w, h, year, mon, &geom);
+	loaded = tui_loadmonth(mon, year) == 0;
+
+	cursorx = cursory = -1;
+	drawcell(win, &geom, from + geom.firstday, loaded, year, mon, to,
+			&cursory, &cursorx);
+	drawcell(win, &geom, to + geom.firstday, loaded, year, mon, to,
+			&cursory, &cursorx);
+
 	if (cursorx != -1 && cursory != -1) {
 		wmove(win, cursory, cursorx);
 	}
 
-	wrefresh(win);
+	wnoutrefresh(win);
 }
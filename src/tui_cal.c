@@ -24,28 +24,66 @@
 #include <util.h>
 #include <interfaces.h>
 
+/* What's on the screen right now, so that moving the cursor around a month
+ * only has to redraw the two days it moved between */
+static struct {
+	int valid;
+	int w, h;
+	int year, mon, day;
+	uint64_t generation;
+} drawn;
+
+int tui_cal_reset(WINDOW *win) {
+	drawn.valid = 0;
+	return 0;
+}
+
 int tui_cal(enum tui_state *state, WINDOW *win) {
+	uint64_t generation;
 	int w, h;
 	getmaxyx(win, h, w);
 	if (w == -1 || h == -1) {
 		return 1;
 	}
 
-	wclear(win);
+	if (tui_generation(&generation)) {
+		drawn.valid = 0;
+	}
 
-	/* Draw calendar header */
-	char header[50];
-	int headerlen;
-	headerlen = snprintf(header, sizeof header,
-			"%s, %d", months[tui_mon], tui_year);
-	header[sizeof header - 1] = '\0';
-	if (headerlen < 0) {
-		return 1;
+	if (drawn.valid && drawn.w == w && drawn.h == h &&
+			drawn.year == tui_year && drawn.mon == tui_mon &&
+			drawn.generation == generation) {
+		if (drawn.day != tui_day) {
+			tui_calmove(win, 1, 0, -1, -1, tui_year, tui_mon,
+					drawn.day, tui_day);
+		}
 	}
-	mvwaddstr(win, 0, w/2 - headerlen/2, header);
+	else {
+		werase(win);
+
+		/* Draw calendar header */
+		char header[50];
+		int headerlen;
+		headerlen = snprintf(header, sizeof header,
+				"%s, %d", months[tui_mon], tui_year);
+		header[sizeof header - 1] = '\0';
+		if (headerlen < 0) {
+			return 1;
+		}
+		mvwaddstr(win, 0, w/2 - headerlen/2, header);
 
-	/* Draw the calendar itself */
-	tui_calwidget(win, 1, 0, -1, -1, tui_year, tui_mon, tui_day);
+		/* Draw the calendar itself */
+		tui_calwidget(win, 1, 0, -1, -1, tui_year, tui_mon, tui_day);
+
+		drawn.valid = 1;
+		drawn.w = w;
+		drawn.h = h;
+		drawn.year = tui_year;
+		drawn.mon = tui_mon;
+		drawn.generation = generation;
+	}
+	drawn.day = tui_day;
+	doupdate();
 
 	int c = wgetch(win);
 
@@ -99,7 +99,7 @@ int tui_newevent(enum tui_state *state, WINDOW *win) {
 	getmaxyx(win, h, w);
 	cx = cy = 0;
 
-	wclear(win);
+	werase(win);
 
 	add_prompt(win, "Name: ", -2, h, w);
 	waddnstr(win, name, namecur);
@@ -107,8 +107,8 @@ int tui_newevent(enum tui_state *state, WINDOW *win) {
 		getyx(win, cy, cx);
 	}
 	waddnstr(win, name+namecur, namelen-namecur);
-	for (int i = 0; i < BASE_LEFT*2 - namelen; ++i) {
-		waddch(win, '_');
+	if (namelen < BASE_LEFT*2) {
+		whline(win, '_', BASE_LEFT*2 - namelen);
 	}
 
 	add_prompt(win, "Start: ", -1, h, w);
@@ -137,7 +137,8 @@ int tui_newevent(enum tui_state *state, WINDOW *win) {
 
 	wmove(win, cy, cx);
 
-	wrefresh(win);
+	wnoutrefresh(win);
+	doupdate();
 
 	int c = wgetch(win);
 
@@ -261,7 +262,9 @@ int tui_newevent(enum tui_state *state, WINDOW *win) {
 		newevent.end = convtime(eyear, emon, eday, ehr, emin, esec);
 		name[namelen] = '\0';
 		newevent.name = name;
-		dateadd(&newevent, &f);
+		if (dateadd(&newevent, &f) || datecommit(&f)) {
+			return 1;
+		}
 
 		*state = VIEWCAL;
 
@@ -29,10 +29,9 @@ static struct eventlist *events;
 static int selected;
 static int scratch;
 
+/* The events belong to the day cache */
 static int refreshevents() {
-	events = datesearch(&f,
-			findstart(tui_day, tui_mon, tui_year),
-			findend(tui_day, tui_mon, tui_year));
+	events = tui_dayevents(tui_day, tui_mon, tui_year);
 	return events == NULL;
 }
 
@@ -48,7 +47,7 @@ int tui_viewday(enum tui_state *state, WINDOW *win) {
 		goto cstate;
 	}
 	getmaxyx(win, scratch, w);
-	wclear(win);
+	werase(win);
 	for (int i = 0; i < events->len; ++i) {
 		char line[256];
 		struct tm *start;
@@ -71,7 +70,8 @@ int tui_viewday(enum tui_state *state, WINDOW *win) {
 		}
 	}
 	wmove(win, selected, 0);
-	wrefresh(win);
+	wnoutrefresh(win);
+	doupdate();
 
 	int c = getch();
 
@@ -87,10 +87,10 @@ int tui_viewday(enum tui_state *state, WINDOW *win) {
 		*state = NEWEVENT;
 		goto cstate;
 	case 'd':
-		if (dateremove(&f, events->events[selected].id)) {
+		if (dateremove(&f, events->events[selected].id) ||
+		    datecommit(&f) || tui_checkgeneration()) {
 			return 1;
 		}
-		freeeventlist(events);
 		return refreshevents();
 	case 'q': case KEY_ESCAPE:
 		*state = VIEWCAL;
@@ -99,6 +99,6 @@ int tui_viewday(enum tui_state *state, WINDOW *win) {
 
 	return 0;
 cstate:
-	freeeventlist(events);
+	events = NULL;
 	return 0;
 }
@@ -0,0 +1,601 @@
+/* @LEGAL_HEAD [0]
+ *
+ * nrem, a cli friendly calendar
+ * Copyright (C) 2023  Nate Choe <nate@natechoe.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * @LEGAL_TAIL */
+
+/* For fallocate() */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <tests.h>
+#include <wal.h>
+
+/* Log representation:
+ *   The log is a list of records, one for each commit:
+ *
+ *     struct {
+ *         char magic[8];               "datewal1"
+ *         uint64_t len;                The length of `entries`
+ *         uint64_t sum;                The FNV-1a hash of `entries`
+ *         struct {
+ *             uint64_t pos;            Where in the file this goes
+ *             uint64_t len;
+ *             char data[len];
+ *         } entries[];
+ *     };
+ *
+ *   All integers are big endian, like in datefiles. A record that's cut off or
+ *   doesn't match its hash is where a crash interrupted a commit, so it and
+ *   everything after it is ignored.
+ * */
+
+#define WAL_MAGIC "datewal1"
+#define WAL_HEADER_SIZE 24
+
+static void putu64(unsigned char *buf, uint64_t val) {
+	for (int i = 7; i >= 0; --i) {
+		buf[i] = (unsigned char) (val & 0xff);
+		val >>= 8;
+	}
+}
+
+static uint64_t getu64(const unsigned char *buf) {
+	uint64_t ret = 0;
+	for (int i = 0; i < 8; ++i) {
+		ret = (ret << 8) | buf[i];
+	}
+	return ret;
+}
+
+static uint64_t checksum(const unsigned char *data, uint64_t len) {
+	uint64_t hash = 0xcbf29ce484222325llu;
+	for (uint64_t i = 0; i < len; ++i) {
+		hash = (hash ^ data[i]) * 0x100000001b3llu;
+	}
+	return hash;
+}
+
+static int seekto(FILE *file, uint64_t pos) {
+	if (pos > LONG_MAX) {
+		return -1;
+	}
+	return fseek(file, (long) pos, SEEK_SET);
+}
+
+static int fileend(int fd, uint64_t *ret) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return -1;
+	}
+	*ret = (uint64_t) st.st_size;
+	return 0;
+}
+
+static int writeall(int fd, uint64_t pos, const void *buf, size_t len) {
+	const unsigned char *in = buf;
+	if (pos > (uint64_t) INT64_MAX - len) {
+		return -1;
+	}
+	while (len > 0) {
+		ssize_t n = pwrite(fd, in, len, (off_t) pos);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		in += n;
+		pos += (uint64_t) n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+static inline size_t hashpage(struct wal *wal, uint64_t index) {
+	return (size_t) ((index * 0x9e3779b97f4a7c15llu) >> 32) &
+		(wal->tablesize - 1);
+}
+
+static struct walpage *findpage(struct wal *wal, uint64_t index) {
+	struct walpage *page;
+	for (page = wal->table[hashpage(wal, index)]; page != NULL;
+			page = page->hnext) {
+		if (page->index == index) {
+			return page;
+		}
+	}
+	return NULL;
+}
+
+static void freepages(struct wal *wal) {
+	while (wal->pages != NULL) {
+		struct walpage *next = wal->pages->next;
+		free(wal->pages);
+		wal->pages = next;
+	}
+	memset(wal->table, 0, wal->tablesize * sizeof *wal->table);
+	wal->len = 0;
+}
+
+/* Writes the entries of one record to the file */
+static int applyentries(struct wal *wal, unsigned char *entries, uint64_t len) {
+	uint64_t pos = 0;
+	while (pos < len) {
+		uint64_t at, n;
+		if (len - pos < 16) {
+			return -1;
+		}
+		at = getu64(entries + pos);
+		n = getu64(entries + pos + 8);
+		pos += 16;
+		if (n > len - pos || n > SIZE_MAX ||
+		    writeall(wal->fd, at, entries + pos, (size_t) n)) {
+			return -1;
+		}
+		cachewrote(wal->cache, at, entries + pos, (size_t) n);
+		pos += n;
+	}
+	return 0;
+}
+
+static int truncatelog(struct wal *wal) {
+	if (fflush(wal->log) == EOF ||
+	    ftruncate(fileno(wal->log), 0) == -1 ||
+	    fdatasync(fileno(wal->log)) == -1) {
+		return -1;
+	}
+	wal->logsize = 0;
+	return 0;
+}
+
+/* Writes every complete record in the log to the file, then empties it */
+static int replay(struct wal *wal) {
+	unsigned char header[WAL_HEADER_SIZE];
+	unsigned char *entries;
+	struct stat st;
+	uint64_t pos, len;
+	int applied;
+
+	if (fstat(fileno(wal->log), &st) == -1) {
+		return -1;
+	}
+	if (st.st_size == 0) {
+		return 0;
+	}
+	if (seekto(wal->log, 0)) {
+		return -1;
+	}
+
+	applied = 0;
+	for (pos = 0; pos + WAL_HEADER_SIZE <= (uint64_t) st.st_size;
+			pos += WAL_HEADER_SIZE + len) {
+		if (fread(header, sizeof header, 1, wal->log) < 1 ||
+		    memcmp(header, WAL_MAGIC, 8) != 0) {
+			break;
+		}
+		len = getu64(header + 8);
+		if (len > (uint64_t) st.st_size - pos - WAL_HEADER_SIZE) {
+			break;
+		}
+		if ((entries = malloc((size_t) len)) == NULL) {
+			return -1;
+		}
+		if (fread(entries, 1, (size_t) len, wal->log) != len ||
+		    checksum(entries, len) != getu64(header + 16)) {
+			free(entries);
+			break;
+		}
+		if (applyentries(wal, entries, len)) {
+			free(entries);
+			return -1;
+		}
+		free(entries);
+		applied = 1;
+	}
+
+	if (applied && fdatasync(wal->fd) == -1) {
+		return -1;
+	}
+	return truncatelog(wal);
+}
+
+int walopen(struct wal *wal, char *path, int fd, struct pagecache *cache) {
+	int logfd;
+
+	wal->fd = fd;
+	wal->cache = cache;
+	wal->pages = NULL;
+	wal->len = 0;
+	wal->punches = NULL;
+	wal->npunches = wal->punchalloc = 0;
+	wal->logsize = 0;
+	wal->tablesize = WAL_GROUP_PAGES * 2;
+	if ((wal->table = calloc(wal->tablesize, sizeof *wal->table)) ==
+			NULL) {
+		return -1;
+	}
+
+	if ((logfd = open(path, O_RDWR | O_CREAT, 0666)) == -1) {
+		goto error;
+	}
+	if ((wal->log = fdopen(logfd, "r+")) == NULL) {
+		close(logfd);
+		goto error;
+	}
+	if (replay(wal) || fileend(fd, &wal->fileend)) {
+		fclose(wal->log);
+		goto error;
+	}
+	wal->end = wal->fileend;
+	return 0;
+error:
+	free(wal->table);
+	return -1;
+}
+
+int walpending(char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && st.st_size > 0;
+}
+
+int walread(struct wal *wal, uint64_t pos, void *buf, size_t len) {
+	unsigned char *out = buf;
+
+	if (pos > wal->end || len > wal->end - pos) {
+		return -1;
+	}
+	if (wal->len == 0 && pos + len <= wal->fileend) {
+		return cacheread(wal->cache, pos, buf, len);
+	}
+
+	while (len > 0) {
+		struct walpage *page;
+		size_t pageoff, n;
+
+		pageoff = (size_t) (pos % CACHE_PAGESIZE);
+		n = CACHE_PAGESIZE - pageoff;
+		if (n > len) {
+			n = len;
+		}
+
+		/* Anything past the end of the file on disk that hasn't been
+		 * written is a hole */
+		if ((page = findpage(wal, pos / CACHE_PAGESIZE)) != NULL) {
+			memcpy(out, page->data + pageoff, n);
+		}
+		else if (pos >= wal->fileend) {
+			memset(out, 0, n);
+		}
+		else if (pos + n > wal->fileend) {
+			size_t m = (size_t) (wal->fileend - pos);
+			if (cacheread(wal->cache, pos, out, m)) {
+				return -1;
+			}
+			memset(out + m, 0, n - m);
+		}
+		else if (cacheread(wal->cache, pos, out, n)) {
+			return -1;
+		}
+
+		out += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Gets the dirty copy of a page, making one if there isn't one yet */
+static struct walpage *dirtypage(struct wal *wal, uint64_t index) {
+	struct walpage *page;
+	uint64_t start = index * CACHE_PAGESIZE;
+	size_t have = 0;
+
+	if ((page = findpage(wal, index)) != NULL) {
+		return page;
+	}
+	if ((page = malloc(sizeof *page)) == NULL) {
+		return NULL;
+	}
+	if (start < wal->fileend) {
+		have = wal->fileend - start < CACHE_PAGESIZE ?
+			(size_t) (wal->fileend - start) : CACHE_PAGESIZE;
+		if (cacheread(wal->cache, start, page->data, have)) {
+			free(page);
+			return NULL;
+		}
+	}
+	memset(page->data + have, 0, CACHE_PAGESIZE - have);
+
+	page->index = index;
+	page->lo = CACHE_PAGESIZE;
+	page->hi = 0;
+	page->next = wal->pages;
+	wal->pages = page;
+	page->hnext = wal->table[hashpage(wal, index)];
+	wal->table[hashpage(wal, index)] = page;
+	++wal->len;
+	return page;
+}
+
+int walwrite(struct wal *wal, uint64_t pos, const void *buf, size_t len) {
+	const unsigned char *in = buf;
+
+	while (len > 0) {
+		struct walpage *page;
+		size_t pageoff, n;
+
+		pageoff = (size_t) (pos % CACHE_PAGESIZE);
+		n = CACHE_PAGESIZE - pageoff;
+		if (n > len) {
+			n = len;
+		}
+
+		if ((page = dirtypage(wal, pos / CACHE_PAGESIZE)) == NULL) {
+			return -1;
+		}
+		memcpy(page->data + pageoff, in, n);
+		if (pageoff < page->lo) {
+			page->lo = pageoff;
+		}
+		if (pageoff + n > page->hi) {
+			page->hi = pageoff + n;
+		}
+
+		in += n;
+		pos += n;
+		len -= n;
+		if (pos > wal->end) {
+			wal->end = pos;
+		}
+	}
+	return 0;
+}
+
+uint64_t walend(struct wal *wal) {
+	return wal->end;
+}
+
+int walpunch(struct wal *wal, uint64_t pos, uint64_t len) {
+	if (wal->npunches >= wal->punchalloc) {
+		struct walpunch *newpunches;
+		size_t newalloc = wal->punchalloc == 0 ? 16 :
+			wal->punchalloc * 2;
+		newpunches = realloc(wal->punches,
+				newalloc * sizeof *newpunches);
+		if (newpunches == NULL) {
+			return -1;
+		}
+		wal->punches = newpunches;
+		wal->punchalloc = newalloc;
+	}
+	wal->punches[wal->npunches].pos = pos;
+	wal->punches[wal->npunches].len = len;
+	++wal->npunches;
+	return 0;
+}
+
+/* Punching holes is only ever a hint, so failures are ignored */
+static void punchholes(struct wal *wal) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	for (size_t i = 0; i < wal->npunches; ++i) {
+		struct walpunch *punch = wal->punches + i;
+		if (punch->pos + punch->len <= LONG_MAX) {
+			fallocate(wal->fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(off_t) punch->pos, (off_t) punch->len);
+		}
+	}
+#endif
+	wal->npunches = 0;
+}
+
+int walcommit(struct wal *wal) {
+	struct walpage *page;
+	unsigned char *record, *iter;
+	uint64_t len;
+
+	if (wal->len == 0) {
+		punchholes(wal);
+		return 0;
+	}
+
+	len = 0;
+	for (page = wal->pages; page != NULL; page = page->next) {
+		len += 16 + page->hi - page->lo;
+	}
+	if ((record = malloc(WAL_HEADER_SIZE + len)) == NULL) {
+		return -1;
+	}
+	iter = record + WAL_HEADER_SIZE;
+	for (page = wal->pages; page != NULL; page = page->next) {
+		putu64(iter, page->index * CACHE_PAGESIZE + page->lo);
+		putu64(iter + 8, page->hi - page->lo);
+		memcpy(iter + 16, page->data + page->lo, page->hi - page->lo);
+		iter += 16 + page->hi - page->lo;
+	}
+	memcpy(record, WAL_MAGIC, 8);
+	putu64(record + 8, len);
+	putu64(record + 16, checksum(record + WAL_HEADER_SIZE, len));
+
+	/* The record has to be durable before any of it reaches the file. If
+	 * only part of it made it to the log, cut that part off again so later
+	 * records aren't stuck behind it. */
+	if (seekto(wal->log, wal->logsize) ||
+	    fwrite(record, 1, WAL_HEADER_SIZE + len, wal->log) !=
+			WAL_HEADER_SIZE + len ||
+	    fflush(wal->log) == EOF ||
+	    fdatasync(fileno(wal->log)) == -1) {
+		free(record);
+		clearerr(wal->log);
+		ftruncate(fileno(wal->log), (off_t) wal->logsize);
+		return -1;
+	}
+	wal->logsize += WAL_HEADER_SIZE + len;
+
+	/* Now the record can be written to the file without syncing, a crash
+	 * from here on is fixed by replaying it. Space freed in this commit
+	 * may already be in use again, so the holes go first and the record
+	 * fills back in whatever it needs. */
+	punchholes(wal);
+	if (applyentries(wal, record + WAL_HEADER_SIZE, len)) {
+		free(record);
+		return -1;
+	}
+	free(record);
+	wal->fileend = wal->end;
+	freepages(wal);
+
+	if (wal->logsize >= WAL_CHECKPOINT_SIZE) {
+		return walcheckpoint(wal);
+	}
+	return 0;
+}
+
+int walcheckpoint(struct wal *wal) {
+	if (walcommit(wal)) {
+		return -1;
+	}
+	if (wal->logsize == 0) {
+		return 0;
+	}
+	if (fdatasync(wal->fd) == -1) {
+		return -1;
+	}
+	return truncatelog(wal);
+}
+
+int walsync(struct wal *wal) {
+	struct stat st;
+	if (wal->len != 0 || fflush(wal->log) == EOF ||
+	    fstat(fileno(wal->log), &st) == -1 ||
+	    fileend(wal->fd, &wal->fileend)) {
+		return -1;
+	}
+	wal->logsize = (uint64_t) st.st_size;
+	wal->end = wal->fileend;
+	return 0;
+}
+
+int walreplace(struct wal *wal, int fd) {
+	if (wal->len != 0 || wal->logsize != 0) {
+		return -1;
+	}
+	wal->fd = fd;
+	if (fileend(fd, &wal->fileend)) {
+		return -1;
+	}
+	wal->end = wal->fileend;
+	return 0;
+}
+
+int walclose(struct wal *wal) {
+	int ret = walcheckpoint(wal);
+	if (fclose(wal->log) == EOF) {
+		ret = -1;
+	}
+	freepages(wal);
+	free(wal->table);
+	free(wal->punches);
+	return ret;
+}
+
+#ifdef NREM_TESTS
+int waltest(int *passed, int *total) {
+	char path[] = "/tmp/nremwaltestXXXXXX";
+	unsigned char data[CACHE_PAGESIZE * 2];
+	unsigned char buf[CACHE_PAGESIZE * 2];
+	struct pagecache cache, cache2;
+	struct wal wal, wal2;
+	FILE *file;
+	int fd;
+
+	for (size_t i = 0; i < sizeof data; ++i) {
+		data[i] = (unsigned char) (i * 7);
+	}
+	NREM_ASSERT((file = tmpfile()) != NULL);
+	NREM_ASSERT((fd = mkstemp(path)) != -1);
+	if (file == NULL || fd == -1) {
+		return 1;
+	}
+	close(fd);
+	NREM_ASSERT(pwrite(fileno(file), data, 100, 0) == 100);
+	NREM_ASSERT(cacheinit(&cache, fileno(file), 4) == 0);
+	NREM_ASSERT(walopen(&wal, path, fileno(file), &cache) == 0);
+	NREM_ASSERT(!walpending(path));
+
+	/* Writes are seen right away, but don't reach the file until they're
+	 * committed. Writing past the end leaves a hole. */
+	NREM_ASSERT(walwrite(&wal, 50, data + 1000, 100) == 0);
+	NREM_ASSERT(walwrite(&wal, CACHE_PAGESIZE + 10, data, 10) == 0);
+	NREM_ASSERT(walend(&wal) == CACHE_PAGESIZE + 20);
+	NREM_ASSERT(walread(&wal, 0, buf, 150) == 0);
+	NREM_ASSERT(memcmp(buf, data, 50) == 0 &&
+			memcmp(buf + 50, data + 1000, 100) == 0);
+	NREM_ASSERT(walread(&wal, 200, buf, 10) == 0 && buf[0] == 0);
+	NREM_ASSERT(walread(&wal, CACHE_PAGESIZE + 15, buf, 10) == -1);
+	NREM_ASSERT(lseek(fileno(file), 0, SEEK_END) == 100);
+
+	NREM_ASSERT(walcommit(&wal) == 0);
+	NREM_ASSERT(walpending(path));
+	NREM_ASSERT(pread(fileno(file), buf, 100, 50) == 100);
+	NREM_ASSERT(memcmp(buf, data + 1000, 100) == 0);
+
+	/* Lose the writes to the file like a crash would, then replay */
+	NREM_ASSERT(pwrite(fileno(file), data, 150, 0) == 150);
+	NREM_ASSERT(cacheinit(&cache2, fileno(file), 0) == 0);
+	NREM_ASSERT(walopen(&wal2, path, fileno(file), &cache2) == 0);
+	NREM_ASSERT(!walpending(path));
+	NREM_ASSERT(walread(&wal2, 50, buf, 100) == 0);
+	NREM_ASSERT(memcmp(buf, data + 1000, 100) == 0);
+	NREM_ASSERT(walclose(&wal2) == 0);
+	cachefree(&cache2);
+
+	/* A record that was cut off is never replayed */
+	memset(buf, 0, WAL_HEADER_SIZE);
+	memcpy(buf, WAL_MAGIC, 8);
+	putu64(buf + 8, 100);
+	fd = open(path, O_WRONLY | O_APPEND);
+	NREM_ASSERT(fd != -1 && write(fd, buf, WAL_HEADER_SIZE + 50) ==
+			WAL_HEADER_SIZE + 50);
+	close(fd);
+	NREM_ASSERT(walpending(path));
+	NREM_ASSERT(cacheinit(&cache2, fileno(file), 0) == 0);
+	NREM_ASSERT(walopen(&wal2, path, fileno(file), &cache2) == 0);
+	NREM_ASSERT(!walpending(path));
+	NREM_ASSERT(walclose(&wal2) == 0);
+	cachefree(&cache2);
+
+	NREM_ASSERT(walclose(&wal) == 0);
+	cachefree(&cache);
+	fclose(file);
+	unlink(path);
+	return 0;
+}
+#else
+int waltest(int *passed, int *total) {
+	++*total;
+	return 1;
+}
+#endif
@@ -12,7 +12,7 @@ for infile in $(ls | grep '.*\.in$') ; do
 	else
 		echo "TEST $infile FAILED!" > /dev/stderr
 	fi
-	rm ./test.date > /dev/null 2>&1
+	rm ./test.date ./test.date.wal ./test.date.idx ./test.date.lock > /dev/null 2>&1
 	total=$(expr $total + 1)
 done
 echo "$passed/$total"
@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+
+# Counts how many bytes the tui sends to the terminal for each key pressed,
+# by running it in a tmux pane and watching what comes out of the pane.
+# Not run by test.sh, since it needs tmux.
+#
+# Usage: ./tuibytes.sh [key ...]
+# The keys are given in tmux's send-keys syntax, and default to moving around
+# the calendar a bit. COLUMNS and LINES set the size of the terminal.
+
+keys=("$@")
+if [ ${#keys[@]} -eq 0 ] ; then
+	keys=(l l l j j k h L H)
+fi
+
+session=nrem-tuibytes-$$
+out=$(mktemp)
+datefile=${DATEFILE:-./test.date}
+
+tmux new-session -d -s "$session" -x "${COLUMNS:-80}" -y "${LINES:-24}" \
+	"sleep 0.5; DATEFILE='$datefile' exec ./nrem tui" || exit 1
+tmux pipe-pane -t "$session" "cat >> $out"
+sleep 1
+
+before=$(wc -c < "$out")
+echo "start: $before"
+total=0
+for key in "${keys[@]}" ; do
+	tmux send-keys -t "$session" "$key"
+	sleep 0.3
+	after=$(wc -c < "$out")
+	echo "$key: $(expr $after - $before)"
+	total=$(expr $total + $after - $before)
+	before=$after
+done
+echo "total: $total over ${#keys[@]} keys"
+
+tmux kill-session -t "$session"
+rm -f "$out"